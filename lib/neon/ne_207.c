@@ -26,6 +26,9 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
 
 #include "ne_alloc.h"
 #include "ne_utils.h"
@@ -132,7 +135,8 @@ static int start_element(void *userdata, int parent,
                          const char **atts) 
 {
     ne_207_parser *p = userdata;
-    int state = ne_xml_mapid(map207, NE_XML_MAPLEN(map207), nspace, name);
+    int state = ne_xml_mapid_current(p->parser, map207,
+                                     NE_XML_MAPLEN(map207), name);
 
     if (!can_handle(parent, state))
         return NE_XML_DECLINE;
@@ -244,17 +248,51 @@ int ne_accept_207(void *userdata, ne_request *req, const ne_status *status)
 }
 
 /* Handling of 207 errors: we keep a string buffer, and append
- * messages to it as they come down.
+ * messages to it as they come down, up to ERROR_MAX bytes; beyond
+ * that, errors are only counted, by status code, and a summary of
+ * them is appended at the end.  Any error handler registered for the
+ * session is passed each error as it is parsed, and every error is
+ * counted by status code in the session's error state.
  *
  * Note, 424 means it would have worked but something else went wrong.
  * We will have had the error for "something else", so we display
  * that, and skip 424 errors. */
 
+/* Maximum length of the errors listed in the error string.  The
+ * session error string holds 512 bytes, leaving room for the summary
+ * of omitted errors, which needs under 192 bytes for up to MAX_CODES
+ * status codes and counts of up to ten digits. */
+#define ERROR_MAX (320)
+
+/* Number of distinct status codes counted separately in the summary
+ * of errors omitted from the error string. */
+#define MAX_CODES (8)
+
+#define ERRHDL_ID "http://webdav.org/neon/hooks/207-errors"
+
+/* The 207 error state of a session: the error handler registered,
+ * and the counts of the errors in the last 207 response, by status
+ * code in order of first occurrence. */
+struct error_state {
+    ne_207_error_fn *fn;
+    void *userdata;
+    ne_207_error_count *counts;
+    int ncounts, maxcounts;
+};
+
 /* This is passed as userdata to the 207 code. */
 struct context {
     char *href;
     ne_buffer *buf;
     unsigned int is_error;
+    /* number of errors omitted from the error string, in total and
+     * for each of the first MAX_CODES status codes. */
+    unsigned long omitted;
+    struct {
+        int code;
+        unsigned long count;
+    } codes[MAX_CODES];
+    struct error_state *state;
 };
 
 static void *start_response(void *userdata, const char *href)
@@ -265,19 +303,121 @@ static void *start_response(void *userdata, const char *href)
     return NULL;
 }
 
+/* Count an error with status 'code' which is omitted from the error
+ * string. */
+static void omit_error(struct context *ctx, int code)
+{
+    int n;
+
+    ctx->omitted++;
+
+    for (n = 0; n < MAX_CODES && ctx->codes[n].count; n++) {
+        if (ctx->codes[n].code == code) break;
+    }
+
+    if (n < MAX_CODES) {
+        ctx->codes[n].code = code;
+        ctx->codes[n].count++;
+    }
+}
+
+/* Append the summary of omitted errors to the error string. */
+static void summarize_errors(struct context *ctx)
+{
+    unsigned long counted = 0;
+    char buf[64];
+    int n;
+
+    ne_snprintf(buf, sizeof buf, "[%lu more errors:", ctx->omitted);
+    ne_buffer_zappend(ctx->buf, buf);
+
+    for (n = 0; n < MAX_CODES && ctx->codes[n].count; n++) {
+        ne_snprintf(buf, sizeof buf, " %lu x %d,", ctx->codes[n].count,
+                    ctx->codes[n].code);
+        ne_buffer_zappend(ctx->buf, buf);
+        counted += ctx->codes[n].count;
+    }
+
+    if (counted < ctx->omitted) {
+        ne_snprintf(buf, sizeof buf, " %lu other,", ctx->omitted - counted);
+        ne_buffer_zappend(ctx->buf, buf);
+    }
+
+    /* replace the trailing comma. */
+    ctx->buf->data[ne_buffer_size(ctx->buf) - 1] = ']';
+    ne_buffer_zappend(ctx->buf, "\n");
+}
+
+/* Count an error with status 'code' in the session's error
+ * state. */
+static void count_error(struct error_state *state, int code)
+{
+    int n;
+
+    for (n = 0; n < state->ncounts; n++) {
+        if (state->counts[n].code == code) {
+            state->counts[n].count++;
+            return;
+        }
+    }
+
+    if (state->ncounts == state->maxcounts) {
+        state->maxcounts = state->maxcounts ? state->maxcounts * 2 : 4;
+        state->counts = ne_realloc(state->counts, state->maxcounts
+                                   * sizeof *state->counts);
+    }
+
+    state->counts[n].code = code;
+    state->counts[n].count = 1;
+    state->ncounts++;
+}
+
 static void handle_error(struct context *ctx, const ne_status *status,
 			 const char *description)
 {
+    if (status && status->klass != 2) {
+        count_error(ctx->state, status->code);
+        if (ctx->state->fn) {
+            ctx->state->fn(ctx->state->userdata, ctx->href, status,
+                           description);
+        }
+    }
+
     if (status && status->klass != 2 && status->code != 424) {
-	char buf[50];
+	char buf[100];
+        size_t used = ne_buffer_size(ctx->buf), hreflen, len;
+
 	ctx->is_error = 1;
-	sprintf(buf, "%d", status->code);
-	ne_buffer_concat(ctx->buf, ctx->href, ": ", 
-			 buf, " ", status->reason_phrase, "\n", NULL);
-	if (description != NULL) {
+
+	ne_snprintf(buf, sizeof buf, ": %d %.60s\n", status->code,
+                    status->reason_phrase);
+        len = strlen(buf);
+        hreflen = strlen(ctx->href);
+
+        /* List errors whilst they fit; the href of the first is
+         * truncated if it is too long to fit on its own. */
+        if (used == 0 && hreflen + len > ERROR_MAX)
+            hreflen = ERROR_MAX - len;
+
+        if (ctx->omitted || used + hreflen + len > ERROR_MAX) {
+            omit_error(ctx, status->code);
+            return;
+        }
+
+        ne_buffer_append(ctx->buf, ctx->href, hreflen);
+        ne_buffer_zappend(ctx->buf, buf);
+        used += hreflen + len;
+
+	if (description != NULL && used + 5 < ERROR_MAX) {
+            size_t desclen = strlen(description);
+
 	    /* TODO: these can be multi-line. Would be good to
 	     * word-wrap this at col 80. */
-	    ne_buffer_concat(ctx->buf, " -> ", description, "\n", NULL);
+            if (used + 5 + desclen > ERROR_MAX)
+                desclen = ERROR_MAX - used - 5;
+	    ne_buffer_zappend(ctx->buf, " -> ");
+            ne_buffer_append(ctx->buf, description, desclen);
+            ne_buffer_zappend(ctx->buf, "\n");
 	}
     }
 
@@ -298,6 +438,52 @@ end_propstat(void *userdata, void *propstat,
     handle_error(ctx, status, description);
 }
 
+static void free_state(void *userdata)
+{
+    struct error_state *state = userdata;
+
+    if (state->counts) ne_free(state->counts);
+    ne_free(state);
+}
+
+/* Returns the 207 error state of session 'sess', creating it if
+ * necessary. */
+static struct error_state *get_state(ne_session *sess)
+{
+    struct error_state *state = ne_get_session_private(sess, ERRHDL_ID);
+
+    if (state == NULL) {
+        state = ne_calloc(sizeof *state);
+        ne_hook_destroy_session(sess, free_state, state);
+        ne_set_session_private(sess, ERRHDL_ID, state);
+    }
+
+    return state;
+}
+
+void ne_207_set_error_handler(ne_session *sess, ne_207_error_fn *fn,
+                              void *userdata)
+{
+    struct error_state *state = get_state(sess);
+
+    state->fn = fn;
+    state->userdata = userdata;
+}
+
+int ne_207_get_error_counts(ne_session *sess,
+                            const ne_207_error_count **counts)
+{
+    struct error_state *state = ne_get_session_private(sess, ERRHDL_ID);
+
+    if (state == NULL) {
+        *counts = NULL;
+        return 0;
+    }
+
+    *counts = state->counts;
+    return state->ncounts;
+}
+
 /* Dispatch a DAV request and handle a 207 error response appropriately */
 /* TODO: hook up Content-Type parsing; passing charset to XML parser */
 int ne_simple_request(ne_session *sess, ne_request *req)
@@ -312,6 +498,8 @@ int ne_simple_request(ne_session *sess, ne_request *req)
     /* The error string is progressively written into the
      * ne_buffer by the element callbacks */
     ctx.buf = ne_buffer_create();
+    ctx.state = get_state(sess);
+    ctx.state->ncounts = 0;
 
     ne_207_set_response_handlers(p207, start_response, end_response);
     ne_207_set_propstat_handlers(p207, NULL, end_propstat);
@@ -329,6 +517,7 @@ int ne_simple_request(ne_session *sess, ne_request *req)
 	    } else if (ctx.is_error) {
 		/* If we've actually got any error information
 		 * from the 207, then set that as the error */
+                if (ctx.omitted) summarize_errors(&ctx);
 		ne_set_error(sess, "%s", ctx.buf->data);
 		ret = NE_ERROR;
 	    }
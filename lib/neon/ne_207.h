@@ -87,6 +87,40 @@ int ne_accept_207(void *userdata, ne_request *req, const ne_status *status);
 void *ne_207_get_current_propstat(ne_207_parser *p);
 void *ne_207_get_current_response(ne_207_parser *p);
 
+/* An error handler, called for each response or propstat given a
+ * non-2xx status (including 424 Failed Dependency) in a 207 response,
+ * as the response is parsed.  'href' is the URI of the resource
+ * concerned; 'description' is the responsedescription, or NULL. */
+typedef void ne_207_error_fn(void *userdata, const char *href,
+                             const ne_status *status,
+                             const char *description);
+
+/* Register an error handler for the 207 responses to requests
+ * dispatched using ne_simple_request on session 'sess'; this includes
+ * ne_copy, ne_move and ne_delete.  Pass 'fn' as NULL to remove it.
+ *
+ * Whether or not a handler is registered, the session error string
+ * set by ne_simple_request lists only the first few errors in full,
+ * followed by a count of the remainder for each status code. */
+void ne_207_set_error_handler(ne_session *sess, ne_207_error_fn *fn,
+                              void *userdata);
+
+/* The number of errors in a 207 response with a given status code. */
+typedef struct {
+    int code;
+    unsigned long count;
+} ne_207_error_count;
+
+/* Retrieve the counts of all the errors (including 424 errors, and
+ * those listed in the error string) in the 207 response to the last
+ * request dispatched using ne_simple_request on session 'sess', by
+ * status code in order of first occurrence.  Sets '*counts' to an
+ * array which is valid until the next such request or until the
+ * session is destroyed, and returns the number of entries; zero if
+ * there were no errors. */
+int ne_207_get_error_counts(ne_session *sess,
+                            const ne_207_error_count **counts);
+
 /* Dispatch request 'req', returning:
  *  NE_ERROR: for a dispatch error, or a non-2xx response, or a
  *            207 response which contained a non-2xx propstat
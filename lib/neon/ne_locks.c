@@ -55,11 +55,37 @@
 struct lock_list {
     struct ne_lock *lock;
     struct lock_list *next, *prev;
+    /* for locks in a store: */
+    struct lock_node *node; /* node for the lock's path */
+    struct lock_list *same; /* next lock with the same path */
+    struct lock_list *tnext; /* next lock in the token hash chain */
 };
 
+/* The locks in a store are indexed by path, in a trie of path
+ * segments: a node exists for each segment of the path of each stored
+ * lock.  The children of each node are found through a hash table of
+ * all nodes in the store, keyed on the parent node and the segment.
+ * As in ne_path_compare, segments are compared case-insensitively. */
+struct lock_node {
+    char *name; /* path segment; NULL for the root */
+    unsigned int hash;
+    struct lock_node *parent;
+    struct lock_node *hnext; /* next node in the hash chain */
+    struct lock_node *children, *sibling, *prev_sibling;
+    struct lock_list *locks; /* locks on this path */
+};
+
+/* Initial size of the hash tables; must be a power of two. */
+#define INDEX_SIZE (64)
+
 struct ne_lock_store_s {
     struct lock_list *locks;
     struct lock_list *cursor; /* current position in 'locks' */
+    struct lock_node root; /* the path trie */
+    struct lock_node **nodes; /* hash table of nodes */
+    unsigned int nnodes, nodes_size;
+    struct lock_list **tokens; /* hash table of locks by token */
+    unsigned int ntokens, tokens_size;
 };
 
 struct lh_req_cookie {
@@ -179,15 +205,37 @@ static void lk_destroy(ne_request *req, void *userdata)
     ne_free(lrc);
 }
 
+/* Free node 'node' and all the nodes beneath it. */
+static void free_nodes(struct lock_node *node)
+{
+    struct lock_node *child, *next;
+
+    for (child = node->children; child != NULL; child = next) {
+        next = child->sibling;
+        free_nodes(child);
+        ne_free(child->name);
+        ne_free(child);
+    }
+}
+
 void ne_lockstore_destroy(ne_lock_store *store)
 {
     free_list(store->locks, 1);
+    free_nodes(&store->root);
+    ne_free(store->nodes);
+    ne_free(store->tokens);
     ne_free(store);
 }
 
 ne_lock_store *ne_lockstore_create(void)
 {
-    return ne_calloc(sizeof(ne_lock_store));
+    ne_lock_store *store = ne_calloc(sizeof *store);
+
+    store->nodes_size = store->tokens_size = INDEX_SIZE;
+    store->nodes = ne_calloc(INDEX_SIZE * sizeof *store->nodes);
+    store->tokens = ne_calloc(INDEX_SIZE * sizeof *store->tokens);
+
+    return store;
 }
 
 #define CURSOR_RET(s) ((s)->cursor?(s)->cursor->lock:NULL)
@@ -226,12 +274,146 @@ static void submit_lock(struct lh_req_cookie *lrc, struct ne_lock *lock)
     insert_lock(&lrc->submit, lock);
 }
 
+/* Find the next segment of path *path: returns its length, and sets
+ * *seg to point to it, or returns zero if there are no more
+ * segments.  Empty segments are skipped. */
+static size_t next_segment(const char **path, const char **seg)
+{
+    const char *pnt = *path;
+
+    while (*pnt == '/') pnt++;
+    *seg = pnt;
+    while (*pnt != '/' && *pnt != '\0') pnt++;
+    *path = pnt;
+
+    return pnt - *seg;
+}
+
+/* Returns the hash of 'len' bytes of 'str', case-insensitively,
+ * continuing from hash 'h'. */
+static unsigned int hash_string(unsigned int h, const char *str, size_t len)
+{
+    while (len-- > 0) {
+        h = h * 33 + tolower((unsigned char)*str++);
+    }
+    return h;
+}
+
+/* Returns the child of 'node' with segment 'seg' of length 'len'; if
+ * there is none, returns NULL or, if 'create' is non-zero, creates
+ * it. */
+static struct lock_node *child_node(ne_lock_store *store, 
+                                    struct lock_node *node,
+                                    const char *seg, size_t len, int create)
+{
+    unsigned int hash = hash_string(node->hash * 31 + 1, seg, len);
+    struct lock_node *child;
+
+    for (child = store->nodes[hash & (store->nodes_size - 1)];
+         child != NULL; child = child->hnext) {
+        if (child->hash == hash && child->parent == node
+            && strncasecmp(child->name, seg, len) == 0
+            && child->name[len] == '\0')
+            return child;
+    }
+
+    if (!create) return NULL;
+
+    /* grow the table to keep the chains short. */
+    if (store->nnodes == store->nodes_size) {
+        unsigned int size = store->nodes_size * 2, n;
+        struct lock_node **nodes = ne_calloc(size * sizeof *nodes);
+
+        for (n = 0; n < store->nodes_size; n++) {
+            struct lock_node *next;
+
+            for (child = store->nodes[n]; child != NULL; child = next) {
+                next = child->hnext;
+                child->hnext = nodes[child->hash & (size - 1)];
+                nodes[child->hash & (size - 1)] = child;
+            }
+        }
+
+        ne_free(store->nodes);
+        store->nodes = nodes;
+        store->nodes_size = size;
+    }
+
+    child = ne_calloc(sizeof *child);
+    child->name = ne_strndup(seg, len);
+    child->hash = hash;
+    child->parent = node;
+    child->hnext = store->nodes[hash & (store->nodes_size - 1)];
+    store->nodes[hash & (store->nodes_size - 1)] = child;
+    store->nnodes++;
+
+    child->sibling = node->children;
+    if (node->children) node->children->prev_sibling = child;
+    node->children = child;
+
+    return child;
+}
+
+/* Returns the node for 'path', or NULL if there is none; if 'create'
+ * is non-zero, creates it as necessary. */
+static struct lock_node *find_node(ne_lock_store *store, const char *path,
+                                   int create)
+{
+    struct lock_node *node = &store->root;
+    const char *seg;
+    size_t len;
+
+    while (node != NULL && (len = next_segment(&path, &seg)) > 0) {
+        node = child_node(store, node, seg, len, create);
+    }
+
+    return node;
+}
+
+/* Remove 'node', and any of its parents which are no longer needed,
+ * if it has no locks or children. */
+static void prune_node(ne_lock_store *store, struct lock_node *node)
+{
+    while (node->parent != NULL && node->locks == NULL 
+           && node->children == NULL) {
+        struct lock_node *parent = node->parent, **pnt;
+
+        for (pnt = &store->nodes[node->hash & (store->nodes_size - 1)];
+             *pnt != node; pnt = &(*pnt)->hnext)
+            /* nullop */;
+        *pnt = node->hnext;
+        store->nnodes--;
+
+        if (node->prev_sibling)
+            node->prev_sibling->sibling = node->sibling;
+        else
+            parent->children = node->sibling;
+        if (node->sibling)
+            node->sibling->prev_sibling = node->prev_sibling;
+
+        ne_free(node->name);
+        ne_free(node);
+        node = parent;
+    }
+}
+
+/* Returns the hash chain of the token table for 'token'. */
+static struct lock_list **token_chain(ne_lock_store *store, 
+                                      const char *token)
+{
+    unsigned int hash = hash_string(0, token, strlen(token));
+    return &store->tokens[hash & (store->tokens_size - 1)];
+}
+
 struct ne_lock *ne_lockstore_findbyuri(ne_lock_store *store,
 				       const ne_uri *uri)
 {
+    struct lock_node *node = find_node(store, uri->path, 0);
     struct lock_list *cur;
 
-    for (cur = store->locks; cur != NULL; cur = cur->next) {
+    if (node == NULL) return NULL;
+
+    for (cur = node->locks; cur != NULL; cur = cur->same) {
 	if (ne_uri_cmp(&cur->lock->uri, uri) == 0) {
 	    return cur->lock;
 	}
@@ -240,12 +422,30 @@ struct ne_lock *ne_lockstore_findbyuri(ne_lock_store *store,
     return NULL;
 }
 
+struct ne_lock *ne_lockstore_findbytoken(ne_lock_store *store,
+                                         const char *token)
+{
+    struct lock_list *cur;
+
+    for (cur = *token_chain(store, token); cur != NULL; cur = cur->tnext) {
+        if (strcasecmp(cur->lock->token, token) == 0) {
+            return cur->lock;
+        }
+    }
+
+    return NULL;
+}
+
 void ne_lock_using_parent(ne_request *req, const char *path)
 {
     struct lh_req_cookie *lrc = ne_get_request_private(req, HOOK_ID);
-    ne_uri u;
+    ne_lock_store *store;
+    struct lock_node *node;
     struct lock_list *item;
+    const char *pnt, *seg;
+    ne_uri u;
     char *parent;
+    size_t len;
 
     if (lrc == NULL)
 	return;
@@ -257,83 +457,152 @@ void ne_lock_using_parent(ne_request *req, const char *path)
     u.authinfo = NULL;
     ne_fill_server_uri(ne_get_session(req), &u);
 
-    for (item = lrc->store->locks; item != NULL; item = item->next) {
+    /* The store is not modified, only its locks submitted. */
+    store = (ne_lock_store *)lrc->store;
+    node = &store->root;
+    pnt = parent;
+
+    /* This lock is needed if it is an infinite depth lock which
+     * covers the parent, or a lock on the parent itself; walk down
+     * the trie from the root to the parent. */
+    do {
+        len = next_segment(&pnt, &seg);
+
+        for (item = node->locks; item != NULL; item = item->same) {
+            /* Only care about locks which are on this server. */
+            u.path = item->lock->uri.path;
+            if (ne_uri_cmp(&u, &item->lock->uri))
+                continue;
+
+            if (len == 0 || item->lock->depth == NE_DEPTH_INFINITE) {
+                NE_DEBUG(NE_DBG_LOCKS, "Locked parent, %s on %s\n",
+                         item->lock->token, item->lock->uri.path);
+                submit_lock(lrc, item->lock);
+            }
+        }
 
-	/* Only care about locks which are on this server. */
-	u.path = item->lock->uri.path;
-	if (ne_uri_cmp(&u, &item->lock->uri))
-	    continue;
-	
-	/* This lock is needed if it is an infinite depth lock which
-	 * covers the parent, or a lock on the parent itself. */
-	if ((item->lock->depth == NE_DEPTH_INFINITE && 
-	     ne_path_childof(item->lock->uri.path, parent)) ||
-	    ne_path_compare(item->lock->uri.path, parent) == 0) {
-	    NE_DEBUG(NE_DBG_LOCKS, "Locked parent, %s on %s\n",
-		     item->lock->token, item->lock->uri.path);
-	    submit_lock(lrc, item->lock);
-	}
-    }
+        node = len ? child_node(store, node, seg, len, 0) : NULL;
+    } while (node != NULL);
 
     u.path = parent; /* handy: makes u.path valid and ne_free(parent). */
     ne_uri_free(&u);
 }
 
+/* Submit all the locks beneath 'node'. */
+static void submit_children(struct lh_req_cookie *lrc, 
+                            struct lock_node *node)
+{
+    struct lock_node *child;
+    struct lock_list *item;
+
+    for (child = node->children; child != NULL; child = child->sibling) {
+        for (item = child->locks; item != NULL; item = item->same) {
+            NE_DEBUG(NE_DBG_LOCKS, "Has child: %s\n", item->lock->token);
+            submit_lock(lrc, item->lock);
+        }
+        submit_children(lrc, child);
+    }
+}
+
 void ne_lock_using_resource(ne_request *req, const char *uri, int depth)
 {
     struct lh_req_cookie *lrc = ne_get_request_private(req, HOOK_ID);
+    ne_lock_store *store;
+    struct lock_node *node;
     struct lock_list *item;
-    int match;
+    const char *seg;
+    size_t len;
 
     if (lrc == NULL)
 	return;	
 
-    /* Iterate over the list of stored locks to see if any of them
-     * apply to this resource */
-    for (item = lrc->store->locks; item != NULL; item = item->next) {
-	
-	match = 0;
-	
-	if (depth == NE_DEPTH_INFINITE &&
-	    ne_path_childof(uri, item->lock->uri.path)) {
-	    /* Case 1: this is a depth-infinity request which will 
-	     * modify a lock somewhere inside the collection. */
-	    NE_DEBUG(NE_DBG_LOCKS, "Has child: %s\n", item->lock->token);
-	    match = 1;
-	} 
-	else if (ne_path_compare(uri, item->lock->uri.path) == 0) {
-	    /* Case 2: this request is directly on a locked resource */
-	    NE_DEBUG(NE_DBG_LOCKS, "Has direct lock: %s\n", item->lock->token);
-	    match = 1;
-	}
-	else if (item->lock->depth == NE_DEPTH_INFINITE && 
-		 ne_path_childof(item->lock->uri.path, uri)) {
-	    /* Case 3: there is a higher-up infinite-depth lock which
-	     * covers the resource that this request will modify. */
-	    NE_DEBUG(NE_DBG_LOCKS, "Is child of: %s\n", item->lock->token);
-	    match = 1;
-	}
-	
-	if (match) {
-	    submit_lock(lrc, item->lock);
-	}
+    store = (ne_lock_store *)lrc->store;
+    node = &store->root;
+
+    /* Walk down the trie from the root to the resource. */
+    for (;;) {
+        len = next_segment(&uri, &seg);
+        if (len == 0) break;
+
+        /* There may be a higher-up infinite-depth lock which covers
+         * the resource that this request will modify. */
+        for (item = node->locks; item != NULL; item = item->same) {
+            if (item->lock->depth == NE_DEPTH_INFINITE) {
+                NE_DEBUG(NE_DBG_LOCKS, "Is child of: %s\n", 
+                         item->lock->token);
+                submit_lock(lrc, item->lock);
+            }
+        }
+
+        node = child_node(store, node, seg, len, 0);
+        if (node == NULL) return;
+    }
+
+    /* This request may be directly on a locked resource. */
+    for (item = node->locks; item != NULL; item = item->same) {
+        NE_DEBUG(NE_DBG_LOCKS, "Has direct lock: %s\n", item->lock->token);
+        submit_lock(lrc, item->lock);
     }
 
+    /* A depth-infinity request will modify any locks somewhere inside
+     * the collection. */
+    if (depth == NE_DEPTH_INFINITE) {
+        submit_children(lrc, node);
+    }
 }
 
 void ne_lockstore_add(ne_lock_store *store, struct ne_lock *lock)
 {
+    struct lock_list **chain;
+
     insert_lock(&store->locks, lock);
+
+    store->locks->node = find_node(store, lock->uri.path, 1);
+    store->locks->same = store->locks->node->locks;
+    store->locks->node->locks = store->locks;
+
+    if (store->ntokens == store->tokens_size) {
+        struct lock_list **old = store->tokens, *item, *next;
+        unsigned int n, size = store->tokens_size;
+
+        store->tokens_size *= 2;
+        store->tokens = ne_calloc(store->tokens_size * sizeof *old);
+
+        for (n = 0; n < size; n++) {
+            for (item = old[n]; item != NULL; item = next) {
+                next = item->tnext;
+                chain = token_chain(store, item->lock->token);
+                item->tnext = *chain;
+                *chain = item;
+            }
+        }
+
+        ne_free(old);
+    }
+
+    chain = token_chain(store, lock->token);
+    store->locks->tnext = *chain;
+    *chain = store->locks;
+    store->ntokens++;
 }
 
 void ne_lockstore_remove(ne_lock_store *store, struct ne_lock *lock)
 {
-    struct lock_list *item;
+    struct lock_node *node = find_node(store, lock->uri.path, 0);
+    struct lock_list *item, **pnt;
 
     /* Find the lock */
-    for (item = store->locks; item != NULL; item = item->next)
-	if (item->lock == lock)
-	    break;
+    for (pnt = &node->locks; (*pnt)->lock != lock; pnt = &(*pnt)->same)
+        /* nullop */;
+    item = *pnt;
+    *pnt = item->same;
+    prune_node(store, node);
+
+    for (pnt = token_chain(store, lock->token); *pnt != item; 
+         pnt = &(*pnt)->tnext)
+        /* nullop */;
+    *pnt = item->tnext;
+    store->ntokens--;
     
     if (item->prev != NULL) {
 	item->prev->next = item->next;
@@ -95,6 +95,8 @@ void ne_lockstore_destroy(ne_lock_store *store);
  *  - a completed URI structure: scheme, host, port, and path all set
  *  - a valid lock token
  *  - a valid depth
+ * The store is indexed by the path and token of each lock, which must
+ * not be changed while the lock is in the store.
  */
 void ne_lockstore_add(ne_lock_store *store, struct ne_lock *lock);
 
@@ -118,6 +120,10 @@ struct ne_lock *ne_lockstore_next(ne_lock_store *store);
 struct ne_lock *ne_lockstore_findbyuri(ne_lock_store *store, 
 				       const ne_uri *uri);
 
+/* Find a lock in the store with the given lock token. */
+struct ne_lock *ne_lockstore_findbytoken(ne_lock_store *store,
+                                         const char *token);
+
 /* Issue a LOCK request for the given lock.  Requires that the uri,
  * depth, type, scope, and timeout members of 'lock' are filled in.
  * owner and token must be malloc-allocated if not NULL; and may be
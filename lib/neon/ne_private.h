@@ -50,6 +50,22 @@ struct hook {
 #define HAVE_HOOK(st,func) (st->hook->hooks->func != NULL)
 #define HOOK_FUNC(st, func) (*st->hook->hooks->func)
 
+/* A connection which is not the active connection of the session:
+ * either idle, or parked by a request whose response has not yet
+ * been read. */
+struct ne_conn {
+    ne_socket *socket;
+    int persisted;
+    struct ne_conn *next;
+};
+
+/* A block of storage for response header fields, followed by 'size'
+ * bytes of which 'used' are in use; see ne_request.c. */
+struct hdr_block {
+    struct hdr_block *next;
+    size_t size, used;
+};
+
 /* Session support. */
 struct ne_session_s {
     /* Connection information */
@@ -64,6 +80,16 @@ struct ne_session_s {
     int is_http11; /* >0 if connected server is known to be
 		    * HTTP/1.1 compliant. */
 
+    /* Connection pool: the request using the active connection, if
+     * any; a list of idle persistent connections; a list of the
+     * connections parked by requests; the number of idle connections
+     * and of all open connections; and the limits on each (max_conns
+     * is zero if unlimited). */
+    ne_request *conn_owner;
+    struct ne_conn *idle, *parked;
+    int nidle, nconns;
+    int max_idle, max_conns;
+
     char *scheme;
     struct host_info server, proxy;
 
@@ -84,8 +110,17 @@ struct ne_session_s {
     void *notify_ud;
 
     int rdtimeout; /* read timeout. */
+    size_t rdbufsize; /* socket read buffer size, or zero for default. */
+
+    /* statistics for requests made so far; the byte counts exclude
+     * those of the current connection. */
+    ne_session_stats stats;
+
+    /* response header storage block kept for the next request. */
+    struct hdr_block *hdr_spare;
 
     struct hook *create_req_hooks, *pre_send_hooks, *post_send_hooks;
+    struct hook *timing_hooks;
     struct hook *destroy_req_hooks, *destroy_sess_hooks, *private;
 
     char *user_agent; /* full User-Agent: header field */
@@ -111,6 +146,9 @@ struct ne_session_s {
  * error. */
 typedef int (*ne_push_fn)(void *userdata, const char *buf, size_t count);
 
+/* Closes the non-active connection 'conn', and frees it. */
+void ne__close_conn(ne_session *sess, struct ne_conn *conn);
+
 /* Do the SSL negotiation. */
 int ne__negotiate_ssl(ne_request *req);
 
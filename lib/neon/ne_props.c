@@ -40,6 +40,17 @@
 
 #define EOL "\r\n"
 
+/* Number of buckets in the table of interned namespaces. */
+#define NSPACE_BUCKETS (32)
+
+/* An interned namespace URI; shared by all the properties in that
+ * namespace across every response parsed by a handler. */
+struct nspace {
+    char *uri;
+    unsigned int hash;
+    struct nspace *next;
+};
+
 struct ne_propfind_handler_s {
     ne_session *sess;
     ne_request *request;
@@ -63,16 +74,20 @@ struct ne_propfind_handler_s {
 
     ne_props_result callback;
     void *userdata;
+
+    struct nspace *nspaces[NSPACE_BUCKETS]; /* interned namespaces */
 };
 
 #define ELM_flatprop (NE_207_STATE_TOP - 1)
 
 /* We build up the results of one 'response' element in memory. */
 struct prop {
-    char *name, *nspace, *value, *lang;
+    char *name, *value, *lang;
+    const char *nspace; /* interned in the handler; NULL if empty */
     /* Store a ne_propname here too, for convienience.  pname.name =
      * name, pname.nspace = nspace, but they are const'ed in pname. */
     ne_propname pname;
+    unsigned int hash; /* of the namespace and name */
 };
 
 #define NSPACE(x) ((x) ? (x) : "")
@@ -83,14 +98,28 @@ struct propstat {
     ne_status status;
 };
 
+/* Reference to a property in a results set, by the index of its
+ * propstat and its index in that propstat; pstat is -1 for an
+ * unused slot in the index. */
+struct propref {
+    int pstat, prop;
+};
+
 /* Results set. */
 struct ne_prop_result_set_s {
     struct propstat *pstats;
     int numpstats, counter;
     void *private;
     char *href;
+    /* Open-addressed hash index of the properties by name; 'size' is
+     * zero or a power of two, and at most half the slots are used. */
+    struct propref *index;
+    unsigned int size, used;
 };
 
+/* Initial size of the property index. */
+#define INDEX_SIZE (16)
+
 #define MAX_PROP_COUNTER (1024)
 
 static int 
@@ -120,10 +149,11 @@ ne_request *ne_propfind_get_request(ne_propfind_handler *handler)
     return handler->request;
 }
 
-static int propfind(ne_propfind_handler *handler, 
-		    ne_props_result results, void *userdata)
+/* Prepares the handler's request for dispatch, once the body has
+ * been built. */
+static void propfind_prepare(ne_propfind_handler *handler, 
+                             ne_props_result results, void *userdata)
 {
-    int ret;
     ne_request *req = handler->request;
 
     /* Register the flat property handler to catch any properties 
@@ -140,10 +170,13 @@ static int propfind(ne_propfind_handler *handler,
     
     ne_add_response_body_reader(req, ne_accept_207, ne_xml_parse_v, 
 				  handler->parser);
+}
 
-    ret = ne_request_dispatch(req);
-
-    if (ret == NE_OK && ne_get_status(req)->klass != 2) {
+/* Returns the result of the PROPFIND, given the return value 'ret'
+ * from dispatching the request. */
+static int propfind_result(ne_propfind_handler *handler, int ret)
+{
+    if (ret == NE_OK && ne_get_status(handler->request)->klass != 2) {
 	ret = NE_ERROR;
     } else if (ne_xml_failed(handler->parser)) {
 	ne_set_error(handler->sess, "%s", ne_xml_get_error(handler->parser));
@@ -153,6 +186,13 @@ static int propfind(ne_propfind_handler *handler,
     return ret;
 }
 
+static int propfind(ne_propfind_handler *handler, 
+		    ne_props_result results, void *userdata)
+{
+    propfind_prepare(handler, results, userdata);
+    return propfind_result(handler, ne_request_dispatch(handler->request));
+}
+
 static void set_body(ne_propfind_handler *hdl, const ne_propname *names)
 {
     ne_buffer *body = hdl->body;
@@ -201,6 +241,29 @@ int ne_propfind_named(ne_propfind_handler *handler, const ne_propname *props,
     return propfind(handler, results, userdata);
 }
 
+int ne_propfind_named_pipeline(ne_propfind_handler **handlers, int count,
+                               const ne_propname *props,
+                               ne_props_result results, void *userdata)
+{
+    ne_request **reqs = ne_malloc(count * sizeof *reqs);
+    int n, ret;
+
+    for (n = 0; n < count; n++) {
+        set_body(handlers[n], props);
+        ne_buffer_zappend(handlers[n]->body, "</prop></propfind>" EOL);
+        propfind_prepare(handlers[n], results, userdata);
+        reqs[n] = handlers[n]->request;
+    }
+
+    ret = ne_request_dispatch_pipeline(reqs, count);
+    ne_free(reqs);
+
+    for (n = 0; n < count && ret == NE_OK; n++)
+        ret = propfind_result(handlers[n], NE_OK);
+
+    return ret;
+}
+
 int ne_propfind(ne_propfind_handler *handler,const char *xmlbody, 
 		ne_props_result results, void *userdata, enum ne_prop_method method)
 {
@@ -321,30 +384,135 @@ static int pnamecmp(const ne_propname *pn1, const ne_propname *pn2)
     }
 }
 
+/* Hash a string, continuing from hash 'h' (FNV-1a). */
+static unsigned int hash_string(unsigned int h, const char *str)
+{
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)str; *p; p++)
+        h = (h ^ *p) * 16777619U;
+
+    return h;
+}
+
+#define HASH_INIT (2166136261U)
+
+/* Hash the namespace hash 'nshash' with the property 'name'; the
+ * separator ensures {ab}c and {a}bc differ. */
+static unsigned int hash_pname(unsigned int nshash, const char *name)
+{
+    return hash_string((nshash ^ '}') * 16777619U, name);
+}
+
+/* Returns the slot in the index of 'set' for the property named
+ * 'pname' with hash 'hash'; the slot is unused if there is no such
+ * property.  The index must not be empty. */
+static struct propref *index_slot(const ne_prop_result_set *set,
+                                  const ne_propname *pname, unsigned int hash)
+{
+    unsigned int mask = set->size - 1, n = hash & mask;
+
+    while (set->index[n].pstat != -1) {
+        struct prop *prop = 
+            &set->pstats[set->index[n].pstat].props[set->index[n].prop];
+
+        if (prop->hash == hash && pnamecmp(&prop->pname, pname) == 0)
+            break;
+
+        n = (n + 1) & mask;
+    }
+
+    return &set->index[n];
+}
+
+/* Resize the index of 'set' to 'size' slots. */
+static void index_resize(ne_prop_result_set *set, unsigned int size)
+{
+    struct propref *old = set->index;
+    unsigned int n, oldsize = set->size;
+
+    set->index = ne_malloc(size * sizeof *set->index);
+    set->size = size;
+    for (n = 0; n < size; n++)
+        set->index[n].pstat = -1;
+
+    for (n = 0; n < oldsize; n++) {
+        if (old[n].pstat != -1) {
+            struct prop *prop = &set->pstats[old[n].pstat].props[old[n].prop];
+            *index_slot(set, &prop->pname, prop->hash) = old[n];
+        }
+    }
+
+    if (old) ne_free(old);
+}
+
+/* Add property 'prop' of propstat 'pstat' to the index of 'set'.  If
+ * a property of the same name is already indexed, the index is
+ * unchanged, so lookups find the first, as a linear search would. */
+static void index_add(ne_prop_result_set *set, int pstat, int prop)
+{
+    struct prop *p = &set->pstats[pstat].props[prop];
+    struct propref *slot;
+
+    if (set->used * 2 >= set->size)
+        index_resize(set, set->size ? set->size * 2 : INDEX_SIZE);
+
+    slot = index_slot(set, &p->pname, p->hash);
+    if (slot->pstat == -1) {
+        slot->pstat = pstat;
+        slot->prop = prop;
+        set->used++;
+    }
+}
+
 /* Find property in 'set' with name 'pname'.  If found, set pstat_ret
  * to the containing propstat, likewise prop_ret, and returns zero.
  * If not found, returns non-zero.  */
 static int findprop(const ne_prop_result_set *set, const ne_propname *pname,
 		    struct propstat **pstat_ret, struct prop **prop_ret)
 {
-    
-    int ps, p;
+    struct propref *ref;
+    unsigned int hash;
 
-    for (ps = 0; ps < set->numpstats; ps++) {
-	for (p = 0; p < set->pstats[ps].numprops; p++) {
-	    struct prop *prop = &set->pstats[ps].props[p];
+    if (set->used == 0)
+        return -1;
 
-	    if (pnamecmp(&prop->pname, pname) == 0) {
-		if (pstat_ret != NULL)
-		    *pstat_ret = &set->pstats[ps];
-		if (prop_ret != NULL)
-		    *prop_ret = prop;
-		return 0;
-	    }
-	}
+    hash = hash_pname(pname->nspace ? hash_string(HASH_INIT, pname->nspace)
+                      : HASH_INIT, pname->name);
+    ref = index_slot(set, pname, hash);
+    if (ref->pstat == -1)
+        return -1;
+
+    if (pstat_ret != NULL)
+        *pstat_ret = &set->pstats[ref->pstat];
+    if (prop_ret != NULL)
+        *prop_ret = &set->pstats[ref->pstat].props[ref->prop];
+    return 0;
+}
+
+/* Returns the interned copy of namespace URI 'uri' for handler 'hdl',
+ * and sets *hash to its hash. */
+static const char *intern_nspace(ne_propfind_handler *hdl, const char *uri,
+                                 unsigned int *hash)
+{
+    unsigned int h = hash_string(HASH_INIT, uri);
+    struct nspace **bucket = &hdl->nspaces[h % NSPACE_BUCKETS], *ns;
+
+    for (ns = *bucket; ns; ns = ns->next) {
+        if (ns->hash == h && strcmp(ns->uri, uri) == 0)
+            break;
+    }
+
+    if (ns == NULL) {
+        ns = ne_malloc(sizeof *ns);
+        ns->uri = ne_strdup(uri);
+        ns->hash = h;
+        ns->next = *bucket;
+        *bucket = ns;
     }
 
-    return -1;
+    *hash = h;
+    return ns->uri;
 }
 
 const char *ne_propset_value(const ne_prop_result_set *set,
@@ -462,6 +630,7 @@ static int startelm(void *userdata, int parent,
     struct propstat *pstat = ne_207_get_current_propstat(hdl->parser207);
     struct prop *prop;
     int n;
+    unsigned int nshash;
     const char *lang;
 
     /* Just handle all children of propstat and their descendants. */
@@ -496,11 +665,15 @@ static int startelm(void *userdata, int parent,
     prop->pname.name = prop->name = ne_strdup(name);
     if (nspace[0] == '\0') {
 	prop->pname.nspace = prop->nspace = NULL;
+        nshash = HASH_INIT;
     } else {
-	prop->pname.nspace = prop->nspace = ne_strdup(nspace);
+	prop->pname.nspace = prop->nspace = intern_nspace(hdl, nspace, &nshash);
     }
+    prop->hash = hash_pname(nshash, name);
     prop->value = NULL;
 
+    index_add(hdl->current, pstat - hdl->current->pstats, n);
+
     NE_DEBUG(NE_DBG_XML, "Got property #%d: {%s}%s.\n", n, 
 	     NSPACE(prop->nspace), prop->name);
 
@@ -588,7 +761,6 @@ static void free_propset(ne_prop_result_set *set)
 	struct propstat *p = &set->pstats[n];
 
 	for (m = 0; m < p->numprops; m++) {
-	    NE_FREE(p->props[m].nspace);
 	    ne_free(p->props[m].name);
 	    NE_FREE(p->props[m].lang);
 	    NE_FREE(p->props[m].value);
@@ -602,6 +774,8 @@ static void free_propset(ne_prop_result_set *set)
 
     if (set->pstats)
 	ne_free(set->pstats);
+    if (set->index)
+        ne_free(set->index);
     ne_free(set->href);
     ne_free(set);
 }
@@ -683,9 +857,19 @@ ne_propfind_create(ne_session *sess, const char *uri, int depth,char *method)
 /* Destroy a propfind handler */
 void ne_propfind_destroy(ne_propfind_handler *handler)
 {
+    int n;
+
     ne_buffer_destroy(handler->value);
     if (handler->current)
         free_propset(handler->current);
+    for (n = 0; n < NSPACE_BUCKETS; n++) {
+        while (handler->nspaces[n]) {
+            struct nspace *ns = handler->nspaces[n];
+            handler->nspaces[n] = ns->next;
+            ne_free(ns->uri);
+            ne_free(ns);
+        }
+    }
     ne_207_destroy(handler->parser207);
     ne_xml_destroy(handler->parser);
     ne_buffer_destroy(handler->body);
@@ -262,6 +262,17 @@ int ne_reportfind_named(ne_propfind_handler *handler,
 		      const ne_propname *names,
 		      ne_props_result result, void *userdata);
 
+/* As ne_propfind_named, but for each of the 'count' handlers in
+ * 'handlers', which must all use the same session; the requests are
+ * dispatched using HTTP/1.1 pipelining (see
+ * ne_request_dispatch_pipeline).  The result callback is invoked for
+ * each resource in each response.
+ *
+ * Returns NE_*. */
+int ne_propfind_named_pipeline(ne_propfind_handler **handlers, int count,
+                               const ne_propname *names,
+                               ne_props_result result, void *userdata);
+
 /* propfind with an xml body supplied by the caller.
 * xmlbody should be a valid xml else you will get a 400 - Bad request response.
 * pass a NULL xmlbody for an empty body, takes care for the xml header
@@ -26,6 +26,9 @@
 #include "config.h"
 
 #include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #ifdef HAVE_LIMITS_H
 #include <limits.h> /* for UINT_MAX etc */
@@ -34,6 +37,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
@@ -47,6 +51,12 @@
 #include <unistd.h>
 #endif
 
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#include <sys/poll.h>
+
 #include "ne_i18n.h"
 
 #include "ne_alloc.h"
@@ -110,9 +120,19 @@ typedef off_t ne_off_t;
 struct field {
     char *name, *value;
     size_t vlen;
+    unsigned int hash; /* full (unreduced) hash value of the name */
     struct field *next;
 };
 
+/* Response header fields, and their names and values, are allocated
+ * from a chain of hdr_blocks owned by the request, which is reset
+ * rather than freed between responses.  When the request is
+ * destroyed, its first block is kept by the session for use by the
+ * next request. */
+#define HDR_BLOCKSIZ (2048)
+#define HDR_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define HDR_DATA(b) ((char *)(b) + HDR_ALIGN(sizeof(struct hdr_block)))
+
 /* Maximum number of header fields per response: */
 #define MAX_HEADER_FIELDS (100)
 /* Size of hash table; 43 is the smallest prime for which the common
@@ -120,6 +140,8 @@ struct field {
 #define HH_HASHSIZE (43)
 /* Hash iteration step: *33 known to be a good hash for ASCII, see RSE. */
 #define HH_ITERATE(hash, ch) (((hash)*33 + (unsigned char)(ch)) % HH_HASHSIZE)
+/* The same, without reduction to the table size. */
+#define HH_FULL(hash, ch) ((hash)*33 + (unsigned char)(ch))
 
 /* pre-calculated hash values for given header names: */
 #define HH_HV_CONNECTION        (0x14)
@@ -172,9 +194,12 @@ struct ne_request_s {
                 ne_off_t total, remain;
             } clen;
             /* chunk: used if mode == R_CHUNKED; total and bytes
-             * remaining to be read of current chunk */
+             * remaining to be read of current chunk; 'delim' is
+             * non-zero if the CRLF following the chunk is still to
+             * be read, and 'last' once the last chunk is read. */
             struct {
                 size_t total, remain;
+                int delim, last;
             } chunk;
         } body;
         ne_off_t progress; /* number of bytes read of response */
@@ -187,9 +212,22 @@ struct ne_request_s {
     
     unsigned int current_index; /* response_headers cursor for iterator */
 
+    /* storage for the response header fields: the first and the
+     * current block. */
+    struct hdr_block *hdr_blocks, *hdr_block;
+
     /* List of callbacks which are passed response body blocks */
     struct body_reader *body_readers;
 
+    /* timing breakdown; 'begun' is the time at which the request
+     * was begun. */
+    ne_request_timing timing;
+    double begun;
+
+    /* connection parked whilst another request uses the session, if
+     * the response to this request has not been read. */
+    struct ne_conn *parked;
+
     /*** Miscellaneous ***/
     unsigned int method_is_head:1;
     unsigned int use_expect100:1;
@@ -201,21 +239,195 @@ struct ne_request_s {
 
 static int open_connection(ne_request *req);
 
+/* Moves the active connection of the session into a new ne_conn,
+ * which is returned; the session is left disconnected. */
+static struct ne_conn *save_conn(ne_session *sess)
+{
+    struct ne_conn *conn = ne_malloc(sizeof *conn);
+
+    conn->socket = sess->socket;
+    conn->persisted = sess->persisted;
+    conn->next = NULL;
+
+    sess->socket = NULL;
+    sess->connected = sess->persisted = 0;
+    return conn;
+}
+
+/* Makes 'conn' the active connection of the session, which must be
+ * disconnected, and frees it. */
+static void load_conn(ne_session *sess, struct ne_conn *conn)
+{
+    sess->socket = conn->socket;
+    sess->persisted = conn->persisted;
+    sess->connected = 1;
+    ne_free(conn);
+}
+
+/* Removes parked connection 'conn' from the session's list. */
+static void unpark_conn(ne_session *sess, struct ne_conn *conn)
+{
+    struct ne_conn **pos;
+
+    for (pos = &sess->parked; *pos != conn; pos = &(*pos)->next)
+        /* nothing */;
+    *pos = conn->next;
+    conn->next = NULL;
+}
+
+/* Frees up the active connection of the session: if a request is
+ * using it, it is parked with that request; otherwise it is added to
+ * the idle pool, or closed if the pool is full. */
+static void release_conn(ne_session *sess)
+{
+    if (!sess->connected) {
+        /* nothing to do. */
+    } else if (sess->conn_owner) {
+        struct ne_conn *conn = save_conn(sess);
+
+        NE_DEBUG(NE_DBG_HTTP, "Parking connection.\n");
+        conn->next = sess->parked;
+        sess->parked = conn;
+        sess->conn_owner->parked = conn;
+    } else if (sess->nidle < sess->max_idle) {
+        struct ne_conn *conn = save_conn(sess);
+
+        NE_DEBUG(NE_DBG_HTTP, "Adding connection to idle pool.\n");
+        conn->next = sess->idle;
+        sess->idle = conn;
+        sess->nidle++;
+    } else {
+        ne_close_connection(sess);
+    }
+
+    sess->conn_owner = NULL;
+}
+
+/* Makes the connection used by 'req' the active connection of the
+ * session: one which was parked by the request, otherwise the
+ * active connection if no other request is using it, otherwise an
+ * idle connection if there is one.  If none is available, the
+ * session is left disconnected so a new connection will be opened. */
+static void use_conn(ne_request *req)
+{
+    ne_session *const sess = req->session;
+
+    /* The CONNECT request to a proxy uses the connection being
+     * opened for another request. */
+    if (sess->in_connect || sess->conn_owner == req) return;
+
+    if (req->parked || sess->conn_owner) {
+        release_conn(sess);
+
+        if (req->parked) {
+            NE_DEBUG(NE_DBG_HTTP, "Resuming parked connection.\n");
+            unpark_conn(sess, req->parked);
+            load_conn(sess, req->parked);
+            req->parked = NULL;
+        } else if (sess->idle) {
+            struct ne_conn *conn = sess->idle;
+
+            NE_DEBUG(NE_DBG_HTTP, "Using idle connection.\n");
+            sess->idle = conn->next;
+            sess->nidle--;
+            load_conn(sess, conn);
+        }
+    }
+
+    sess->conn_owner = req;
+}
+
+/* Returns a timestamp in seconds, from a monotonic clock if
+ * available. */
+static double timestamp(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+#ifdef HAVE_SYS_TIME_H
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+#else
+    return time(NULL);
+#endif
+}
+
 /* Returns hash value for header 'name', converting it to lower-case
- * in-place. */
-static inline unsigned int hash_and_lower(char *name)
+ * in-place; the unreduced hash value is placed in *full. */
+static inline unsigned int hash_and_lower(char *name, unsigned int *full)
 {
     char *pnt;
-    unsigned int hash = 0;
+    unsigned int hash = 0, fh = 0;
 
     for (pnt = name; *pnt != '\0'; pnt++) {
 	*pnt = tolower(*pnt);
 	hash = HH_ITERATE(hash,*pnt);
+        fh = HH_FULL(fh,*pnt);
     }
 
+    *full = fh;
     return hash;
 }
 
+/* Returns a new header storage block which can hold at least 'len'
+ * bytes: the session's spare block if that is large enough. */
+static struct hdr_block *new_hdr_block(ne_session *sess, size_t len)
+{
+    struct hdr_block *b;
+
+    if (sess->hdr_spare && sess->hdr_spare->size >= len) {
+        b = sess->hdr_spare;
+        sess->hdr_spare = NULL;
+    } else {
+        size_t size = len > HDR_BLOCKSIZ ? len : HDR_BLOCKSIZ;
+
+        b = ne_malloc(HDR_ALIGN(sizeof *b) + size);
+        b->size = size;
+    }
+
+    b->next = NULL;
+    b->used = 0;
+    return b;
+}
+
+/* Allocate 'len' bytes of response header storage for 'req'. */
+static void *hdr_alloc(ne_request *req, size_t len)
+{
+    struct hdr_block *b = req->hdr_block;
+    void *ret;
+
+    len = HDR_ALIGN(len);
+
+    while (b == NULL || b->used + len > b->size) {
+        struct hdr_block **next = b ? &b->next : &req->hdr_blocks;
+
+        if (*next == NULL)
+            *next = new_hdr_block(req->session, len);
+        b = *next;
+    }
+
+    req->hdr_block = b;
+    ret = HDR_DATA(b) + b->used;
+    b->used += len;
+    return ret;
+}
+
+/* Duplicate the 'len' bytes at 's', and a NUL terminator, into the
+ * response header storage for 'req'. */
+static char *hdr_strndup(ne_request *req, const char *s, size_t len)
+{
+    char *ret = hdr_alloc(req, len + 1);
+
+    memcpy(ret, s, len);
+    ret[len] = '\0';
+    return ret;
+}
+
 /* Abort a request due to an non-recoverable HTTP protocol error,
  * whilst doing 'doing'.  'code', if non-zero, is the socket error
  * code, NE_SOCK_*, or if zero, is ignored. */
@@ -319,6 +531,12 @@ void ne_hook_post_send(ne_session *sess, ne_post_send_fn fn, void *userdata)
     ADD_HOOK(sess->post_send_hooks, fn, userdata);
 }
 
+void ne_hook_request_timing(ne_session *sess, ne_timing_fn fn, 
+                            void *userdata)
+{
+    ADD_HOOK(sess->timing_hooks, fn, userdata);
+}
+
 void ne_hook_destroy_request(ne_session *sess,
 			     ne_destroy_req_fn fn, void *userdata)
 {
@@ -372,11 +590,16 @@ static ssize_t body_fd_send(void *userdata, char *buffer, size_t count)
     ne_request *req = userdata;
 
     if (count) {
+        ssize_t ret;
+
         if (req->body.file.remain == 0)
             return 0;
         if ((off_t)count > req->body.file.remain)
             count = req->body.file.remain;
-	return read(req->body.file.fd, buffer, count);
+	ret = read(req->body.file.fd, buffer, count);
+        if (ret > 0)
+            req->body.file.remain -= ret;
+        return ret;
     } else {
         ne_off_t newoff;
 
@@ -418,6 +641,46 @@ static ssize_t body_fd_send(void *userdata, char *buffer, size_t count)
 ((((code) == NE_SOCK_CLOSED || (code) == NE_SOCK_RESET || \
  (code) == NE_SOCK_TRUNC) && retry) ? NE_RETRY : (acode))
 
+/* Maximum number of bytes of a file request body passed to
+ * ne_sock_sendfile at once; the progress callback is invoked after
+ * each block. */
+#define FILE_BLOCKSIZ (256 * 1024)
+
+/* Sends the request body from a file descriptor, avoiding a copy
+ * through user space where possible.  Arguments and return value as
+ * for send_request_body, which must first rewind the file. */
+static int send_file_body(ne_request *req, int retry)
+{
+    ne_session *const sess = req->session;
+    ne_off_t progress = 0;
+
+    while (req->body.file.remain > 0) {
+        size_t count = FILE_BLOCKSIZ;
+        ssize_t ret;
+
+        if (req->body.file.remain < FILE_BLOCKSIZ)
+            count = req->body.file.remain;
+
+        ret = ne_sock_sendfile(sess->socket, req->body.file.fd, count);
+        if (ret < 0) {
+            int aret = aborted(req, _("Could not send request body"), ret);
+            return RETRY_RET(retry, ret, aret);
+        }
+
+        NE_DEBUG(NE_DBG_HTTPBODY, "Body block (%" NE_FMT_SSIZE_T 
+                 " bytes) sent from file.\n", ret);
+
+        req->body.file.remain -= ret;
+
+        if (sess->progress_cb) {
+            progress += ret;
+            sess->progress_cb(sess->progress_ud, progress, req->body_length);
+        }
+    }
+
+    return NE_OK;
+}
+
 /* Sends the request body; returns 0 on success or an NE_* error code.
  * If retry is non-zero; will return NE_RETRY on persistent connection
  * timeout.  On error, the session error string is set and the
@@ -428,6 +691,7 @@ static int send_request_body(ne_request *req, int retry)
     ne_off_t progress = 0;
     char buffer[NE_BUFSIZ];
     ssize_t bytes;
+    double start = timestamp();
 
     NE_DEBUG(NE_DBG_HTTP, "Sending request body:\n");
     
@@ -436,6 +700,12 @@ static int send_request_body(ne_request *req, int retry)
         ne_close_connection(sess);
         return NE_ERROR;
     }
+
+    if (req->body_cb == body_fd_send) {
+        int ret = send_file_body(req, retry);
+        req->timing.send_body += timestamp() - start;
+        return ret;
+    }
     
     while ((bytes = req->body_cb(req->body_ud, buffer, sizeof buffer)) > 0) {
 	int ret = ne_sock_fullwrite(sess->socket, buffer, bytes);
@@ -457,6 +727,8 @@ static int send_request_body(ne_request *req, int retry)
         }
     }
 
+    req->timing.send_body += timestamp() - start;
+
     if (bytes == 0) {
         return NE_OK;
     } else {
@@ -637,11 +909,26 @@ static inline char *get_response_header_hv(ne_request *req, unsigned int h,
 
 const char *ne_get_response_header(ne_request *req, const char *name)
 {
-    char *lcname = ne_strdup(name);
-    unsigned int hash = hash_and_lower(lcname);
-    char *value = get_response_header_hv(req, hash, lcname);
-    ne_free(lcname);
-    return value;
+    char buf[64], *lcname;
+    size_t len = strlen(name);
+    unsigned int hash, full;
+    struct field *f;
+
+    /* Lower-case the name into a local buffer where it fits. */
+    if (len < sizeof buf) {
+        lcname = memcpy(buf, name, len + 1);
+    } else {
+        lcname = ne_strdup(name);
+    }
+
+    hash = hash_and_lower(lcname, &full);
+
+    for (f = req->response_headers[hash]; f; f = f->next)
+        if (f->hash == full && strcmp(f->name, lcname) == 0)
+            break;
+
+    if (lcname != buf) ne_free(lcname);
+    return f ? f->value : NULL;
 }
 
 /* The return value of the iterator function is a pointer to the
@@ -683,9 +970,6 @@ static void remove_response_header(ne_request *req, const char *name,
 
         if (strcmp(f->name, name) == 0) {
             *ptr = f->next;
-            ne_free(f->name);
-            ne_free(f->value);
-            ne_free(f);
             return;
         }
         
@@ -693,22 +977,36 @@ static void remove_response_header(ne_request *req, const char *name,
     }
 }
 
-/* Free all stored response headers. */
+/* Free all stored response headers; the storage is kept for reuse. */
 static void free_response_headers(ne_request *req)
 {
-    int n;
+    struct hdr_block *b;
 
-    for (n = 0; n < HH_HASHSIZE; n++) {
-        struct field **ptr = req->response_headers + n;
+    memset(req->response_headers, 0, sizeof req->response_headers);
 
-        while (*ptr) {
-            struct field *const f = *ptr;
-            *ptr = f->next;
-            ne_free(f->name);
-            ne_free(f->value);
-            ne_free(f);
-	}
+    for (b = req->hdr_blocks; b; b = b->next)
+        b->used = 0;
+    req->hdr_block = req->hdr_blocks;
+}
+
+/* Release the response header storage of 'req', giving its first
+ * block to the session if it has none spare. */
+static void release_hdr_blocks(ne_request *req)
+{
+    ne_session *const sess = req->session;
+    struct hdr_block *b = req->hdr_blocks, *next;
+
+    if (b && sess->hdr_spare == NULL) {
+        sess->hdr_spare = b;
+        b = b->next;
     }
+
+    for (; b; b = next) {
+        next = b->next;
+        ne_free(b);
+    }
+
+    req->hdr_blocks = req->hdr_block = NULL;
 }
 
 void ne_add_response_body_reader(ne_request *req, ne_accept_response acpt,
@@ -736,6 +1034,7 @@ void ne_request_destroy(ne_request *req)
     }
 
     free_response_headers(req);
+    release_hdr_blocks(req);
 
     ne_buffer_destroy(req->headers);
 
@@ -757,19 +1056,174 @@ void ne_request_destroy(ne_request *req)
     if (req->status.reason_phrase)
 	ne_free(req->status.reason_phrase);
 
+    /* A connection on which the response was not read in full
+     * cannot be reused. */
+    if (req->parked) {
+        unpark_conn(req->session, req->parked);
+        ne__close_conn(req->session, req->parked);
+    } else if (req->session->conn_owner == req) {
+        ne_close_connection(req->session);
+        req->session->conn_owner = NULL;
+    }
+
     NE_DEBUG(NE_DBG_HTTP, "Request ends.\n");
     ne_free(req);
 }
 
 
-/* Reads a block of the response into BUFFER, which is of size
- * *BUFLEN.  Returns zero on success or non-zero on error.  On
- * success, *BUFLEN is updated to be the number of bytes read into
- * BUFFER (which will be 0 to indicate the end of the repsonse).  On
- * error, the connection is closed and the session error string is
- * set.  */
+/* Reads up to 'len' bytes from 'sock' as a view of its read buffer,
+ * placing a pointer to the data in *view.  Returns as ne_sock_read. */
+static ssize_t read_view(ne_socket *sock, const char **view, size_t len)
+{
+    ssize_t ret = ne_sock_peekbuf(sock, view);
+
+    if (ret > 0) {
+        if ((size_t)ret > len) ret = len;
+        ne_sock_consume(sock, ret);
+    }
+    return ret;
+}
+
+/* Parses the chunk-size at the start of the chunk-size line at 'line',
+ * which ends with the LF at 'lf'; places the size in '*len'.
+ * Returns non-zero if the line is invalid. */
+static int parse_chunk_size(const char *line, const char *lf,
+                            unsigned long *len)
+{
+    const char *pnt = line;
+    unsigned long val = 0;
+
+    while (pnt < lf && (*pnt == ' ' || *pnt == '\t'))
+        pnt++;
+
+    line = pnt;
+    for (; pnt < lf && isxdigit((unsigned char)*pnt); pnt++) {
+        /* limit chunk size to <= UINT_MAX, so it will probably fit
+         * in a size_t. */
+        if (val > UINT_MAX / 16)
+            return -1;
+        val = val * 16 + (isdigit((unsigned char)*pnt) ? *pnt - '0'
+                          : tolower((unsigned char)*pnt) - 'a' + 10);
+    }
+
+    *len = val;
+    return pnt == line || val > UINT_MAX;
+}
+
+/* Reads chunked response body data into 'buffer', of length
+ * '*buflen'.  The chunk framing is decoded directly from the socket
+ * read buffer where possible, so that several small chunks can be
+ * read in one call; once some data has been read, the call returns
+ * rather than block for more.  If 'view' is non-NULL, the data of a
+ * single chunk is instead returned as a view of the read buffer in
+ * *view.  Sets *buflen to the number of bytes read, which is zero at
+ * the end of the body.  Returns NE_* code. */
+static int read_chunked(ne_request *req, struct ne_response *resp,
+                        char *buffer, size_t *buflen, const char **view)
+{
+    ne_socket *const sock = req->session->socket;
+    size_t got = 0;
+
+    /* Chunked transfer-encoding: chunk syntax is "SIZE CRLF CHUNK
+     * CRLF SIZE CRLF CHUNK CRLF ..." followed by zero-length chunk:
+     * "CHUNK CRLF 0 CRLF".  resp.chunk.remain contains the number of
+     * bytes left to read in the current chunk. */
+    while (got < *buflen && !resp->body.chunk.last
+           && (got == 0 || ne_sock_pending(sock))) {
+        const char *data, *lf;
+        unsigned long chunk_len;
+        ssize_t avail;
+
+        if (resp->body.chunk.remain) {
+            size_t willread = *buflen - got;
+            ssize_t readlen;
+
+            if (willread > resp->body.chunk.remain)
+                willread = resp->body.chunk.remain;
+            if (view)
+                readlen = read_view(sock, view, willread);
+            else
+                readlen = ne_sock_read(sock, buffer + got, willread);
+            if (readlen < 0)
+                return aborted(req, _("Could not read response body"),
+                               readlen);
+            got += readlen;
+            resp->body.chunk.remain -= readlen;
+            resp->body.chunk.delim = resp->body.chunk.remain == 0;
+            /* the view is valid only until the next socket operation. */
+            if (view) break;
+            continue;
+        }
+
+        avail = ne_sock_peekbuf(sock, &data);
+        if (avail < 0) {
+            return aborted(req, resp->body.chunk.delim 
+                           ? _("Could not read chunk delimiter")
+                           : _("Could not read chunk size"), avail);
+        }
+
+        if (resp->body.chunk.delim) {
+            /* If we've read a whole chunk, read a CRLF */
+            char crlfbuf[2];
+
+            if (avail >= 2) {
+                memcpy(crlfbuf, data, 2);
+                ne_sock_consume(sock, 2);
+            } else if (got) {
+                break;
+            } else {
+                SOCK_ERR(req, ne_sock_fullread(sock, crlfbuf, 2),
+                         _("Could not read chunk delimiter"));
+            }
+            if (crlfbuf[0] != '\r' || crlfbuf[1] != '\n')
+                return aborted(req, _("Chunk delimiter was invalid"), 0);
+            resp->body.chunk.delim = 0;
+            continue;
+        }
+
+        /* Parse the chunk size line in the read buffer if it is
+         * complete, otherwise read it into a temporary buffer. */
+        if ((lf = memchr(data, '\n', avail)) != NULL) {
+            NE_DEBUG(NE_DBG_HTTP, "[chunk] < %.*s", (int)(lf - data + 1),
+                     data);
+            if (parse_chunk_size(data, lf, &chunk_len))
+                return aborted(req, _("Could not parse chunk size"), 0);
+            ne_sock_consume(sock, lf - data + 1);
+        } else if (got) {
+            break;
+        } else {
+            ssize_t len;
+
+            len = ne_sock_readline(sock, req->respbuf, sizeof req->respbuf);
+            if (len < 0)
+                return aborted(req, _("Could not read chunk size"), len);
+            NE_DEBUG(NE_DBG_HTTP, "[chunk] < %s", req->respbuf);
+            if (parse_chunk_size(req->respbuf, req->respbuf + len - 1,
+                                 &chunk_len))
+                return aborted(req, _("Could not parse chunk size"), 0);
+        }
+        NE_DEBUG(NE_DBG_HTTP, "Got chunk size: %lu\n", chunk_len);
+
+        resp->body.chunk.remain = chunk_len;
+        resp->body.chunk.last = chunk_len == 0;
+    }
+
+    NE_DEBUG(NE_DBG_HTTP, "Got %" NE_FMT_SIZE_T " bytes.\n", got);
+    NE_DEBUG(NE_DBG_HTTPBODY,
+	     "Read block (%" NE_FMT_SIZE_T " bytes):\n[%.*s]\n",
+	     got, (int)got, got && view ? *view : buffer);
+    *buflen = got;
+    resp->progress += got;
+    return NE_OK;
+}
+
+/* Reads a block of the response body into 'buffer', of length
+ * '*buflen', or if 'view' is non-NULL, as a view of the socket read
+ * buffer placed in *view.  Sets *buflen to the number of bytes read.
+ * Returns NE_* code. */
 static int read_response_block(ne_request *req, struct ne_response *resp, 
-			       char *buffer, size_t *buflen) 
+			       char *buffer, size_t *buflen,
+                               const char **view) 
 {
     ne_socket *const sock = req->session->socket;
     size_t willread;
@@ -777,32 +1231,7 @@ static int read_response_block(ne_request *req, struct ne_response *resp,
     
     switch (resp->mode) {
     case R_CHUNKED:
-        /* Chunked transfer-encoding: chunk syntax is "SIZE CRLF CHUNK
-         * CRLF SIZE CRLF CHUNK CRLF ..." followed by zero-length
-         * chunk: "CHUNK CRLF 0 CRLF".  resp.chunk.remain contains the
-         * number of bytes left to read in the current chunk. */
-	if (resp->body.chunk.remain == 0) {
-	    unsigned long chunk_len;
-	    char *ptr;
-
-            /* Read the chunk size line into a temporary buffer. */
-            SOCK_ERR(req,
-                     ne_sock_readline(sock, req->respbuf, sizeof req->respbuf),
-                     _("Could not read chunk size"));
-            NE_DEBUG(NE_DBG_HTTP, "[chunk] < %s", req->respbuf);
-            chunk_len = strtoul(req->respbuf, &ptr, 16);
-	    /* limit chunk size to <= UINT_MAX, so it will probably
-	     * fit in a size_t. */
-	    if (ptr == req->respbuf || 
-		chunk_len == ULONG_MAX || chunk_len > UINT_MAX) {
-		return aborted(req, _("Could not parse chunk size"), 0);
-	    }
-	    NE_DEBUG(NE_DBG_HTTP, "Got chunk size: %lu\n", chunk_len);
-	    resp->body.chunk.remain = chunk_len;
-	}
-	willread = resp->body.chunk.remain > *buflen
-            ? *buflen : resp->body.chunk.remain;
-	break;
+        return read_chunked(req, resp, buffer, buflen, view);
     case R_CLENGTH:
 	willread = resp->body.clen.remain > (off_t)*buflen 
             ? *buflen : (size_t)resp->body.clen.remain;
@@ -821,7 +1250,10 @@ static int read_response_block(ne_request *req, struct ne_response *resp,
     }
     NE_DEBUG(NE_DBG_HTTP,
 	     "Reading %" NE_FMT_SIZE_T " bytes of response body.\n", willread);
-    readlen = ne_sock_read(sock, buffer, willread);
+    if (view)
+        readlen = read_view(sock, view, willread);
+    else
+        readlen = ne_sock_read(sock, buffer, willread);
 
     /* EOF is only valid when response body is delimited by it.
      * Strictly, an SSL truncation should not be treated as an EOF in
@@ -840,42 +1272,42 @@ static int read_response_block(ne_request *req, struct ne_response *resp,
     *buflen = (size_t)readlen;
     NE_DEBUG(NE_DBG_HTTPBODY,
 	     "Read block (%" NE_FMT_SSIZE_T " bytes):\n[%.*s]\n",
-	     readlen, (int)readlen, buffer);
-    if (resp->mode == R_CHUNKED) {
-	resp->body.chunk.remain -= readlen;
-	if (resp->body.chunk.remain == 0) {
-	    char crlfbuf[2];
-	    /* If we've read a whole chunk, read a CRLF */
-	    readlen = ne_sock_fullread(sock, crlfbuf, 2);
-            if (readlen < 0)
-                return aborted(req, _("Could not read chunk delimiter"),
-                               readlen);
-            else if (crlfbuf[0] != '\r' || crlfbuf[1] != '\n')
-                return aborted(req, _("Chunk delimiter was invalid"), 0);
-	}
-    } else if (resp->mode == R_CLENGTH) {
+	     readlen, (int)readlen, readlen && view ? *view : buffer);
+    if (resp->mode == R_CLENGTH) {
 	resp->body.clen.remain -= readlen;
     }
     resp->progress += readlen;
     return NE_OK;
 }
 
-ssize_t ne_read_response_block(ne_request *req, char *buffer, size_t buflen)
+/* Reads a block of the response body, as for ne_read_response_block
+ * if 'view' is NULL, otherwise as for ne_read_response_view, and
+ * passes it to the body readers. */
+static ssize_t read_body(ne_request *req, char *buffer, size_t buflen,
+                         const char **view)
 {
     struct body_reader *rdr;
     size_t readlen = buflen;
     struct ne_response *const resp = &req->resp;
+    const char *data;
+    double start = timestamp();
 
-    if (read_response_block(req, resp, buffer, &readlen))
+    use_conn(req);
+
+    if (read_response_block(req, resp, buffer, &readlen, view))
 	return -1;
 
+    data = view ? *view : buffer;
+
+    req->timing.read_body += timestamp() - start;
+
     if (req->session->progress_cb) {
 	req->session->progress_cb(req->session->progress_ud, resp->progress, 
 				  resp->mode==R_CLENGTH ? resp->body.clen.total:-1);
     }
 
     for (rdr = req->body_readers; rdr!=NULL; rdr=rdr->next) {
-	if (rdr->use && rdr->handler(rdr->userdata, buffer, readlen) != 0) {
+	if (rdr->use && rdr->handler(rdr->userdata, data, readlen) != 0) {
             ne_close_connection(req->session);
             return -1;
         }
@@ -884,6 +1316,17 @@ ssize_t ne_read_response_block(ne_request *req, char *buffer, size_t buflen)
     return readlen;
 }
 
+ssize_t ne_read_response_block(ne_request *req, char *buffer, size_t buflen)
+{
+    return read_body(req, buffer, buflen, NULL);
+}
+
+ssize_t ne_read_response_view(ne_request *req, const char **data)
+{
+    *data = "";
+    return read_body(req, NULL, INT_MAX, data);
+}
+
 /* Build the request string, returning the buffer. */
 static ne_buffer *build_request(ne_request *req) 
 {
@@ -991,52 +1434,79 @@ static int discard_headers(ne_request *req)
     return NE_OK;
 }
 
-/* Send the request, and read the response Status-Line. Returns:
- *   NE_RETRY   connection closed by server; persistent connection
- *		timeout
- *   NE_OK	success
- *   NE_*	error
- * On NE_RETRY and NE_* responses, the connection will have been 
- * closed already.
- */
-static int send_request(ne_request *req, const ne_buffer *request)
+/* Writes the Request-Line, headers and (unless 100-continue is used)
+ * the body of the request to the connection, which must be open;
+ * returns NE_OK, or an NE_* error code, which is NE_RETRY if 'retry'
+ * is non-zero and the connection was found to have timed out. */
+static int write_request(ne_request *req, const ne_buffer *request,
+                         int retry)
 {
     ne_session *const sess = req->session;
-    ne_status *const status = &req->status;
     int sentbody = 0; /* zero until body has been sent. */
-    int ret, retry; /* retry non-zero whilst the request should be retried */
     ssize_t sret;
+    double start;
 
-    /* Send the Request-Line and headers */
-    NE_DEBUG(NE_DBG_HTTP, "Sending request-line and headers:\n");
-    /* Open the connection if necessary */
-    ret = open_connection(req);
-    if (ret) return ret;
+    start = timestamp();
+    if (!req->use_expect100 && req->body_length > 0
+        && req->body_cb == body_string_send) {
+        ne_iovec vec[2];
 
-    /* Allow retry if a persistent connection has been used. */
-    retry = sess->persisted;
-    
-    sret = ne_sock_fullwrite(req->session->socket, request->data, 
-                             ne_buffer_size(request));
+        /* Send a buffered body along with the headers, in a single
+         * write where possible. */
+        vec[0].base = request->data;
+        vec[0].len = ne_buffer_size(request);
+        vec[1].base = req->body.buf.buffer;
+        vec[1].len = req->body.buf.length;
+
+        NE_DEBUG(NE_DBG_HTTPBODY, "Request body:\n[%.*s]\n",
+                 (int)req->body.buf.length, req->body.buf.buffer);
+
+        sret = ne_sock_fullwritev(sess->socket, vec, 2);
+        sentbody = 1;
+    } else {
+        sret = ne_sock_fullwrite(sess->socket, request->data, 
+                                 ne_buffer_size(request));
+    }
     if (sret < 0) {
-	int aret = aborted(req, _("Could not send request"), ret);
+	int aret = aborted(req, _("Could not send request"), sret);
 	return RETRY_RET(retry, sret, aret);
     }
+    req->timing.send_headers += timestamp() - start;
+
+    sess->stats.requests++;
+
+    if (sentbody && sess->progress_cb) {
+        sess->progress_cb(sess->progress_ud, req->body_length,
+                          req->body_length);
+    }
     
-    if (!req->use_expect100 && req->body_length > 0) {
+    if (!req->use_expect100 && req->body_length > 0 && !sentbody) {
 	/* Send request body, if not using 100-continue. */
-	ret = send_request_body(req, retry);
-	if (ret) {
-            return ret;
-	}
+	return send_request_body(req, retry);
     }
-    
-    NE_DEBUG(NE_DBG_HTTP, "Request sent; retry is %d.\n", retry);
+
+    return NE_OK;
+}
+
+/* Reads the status-line of the response, skipping any interim 1xx
+ * responses, and sending the request body after a 100-continue
+ * response if necessary.  Returns NE_OK or an NE_* error code; which
+ * is NE_RETRY if 'retry' is non-zero and the connection was found to
+ * have timed out. */
+static int read_status(ne_request *req, int retry)
+{
+    ne_status *const status = &req->status;
+    int sentbody = 0; /* zero until body has been sent. */
+    int ret;
+    double start;
+
+    start = timestamp();
+    ret = read_status_line(req, status, retry);
+    req->timing.first_byte += timestamp() - start;
 
     /* Loop eating interim 1xx responses (RFC2616 says these MAY be
      * sent by the server, even if 100-continue is not used). */
-    while ((ret = read_status_line(req, status, retry)) == NE_OK 
-	   && status->klass == 1) {
+    while (ret == NE_OK && status->klass == 1) {
 	NE_DEBUG(NE_DBG_HTTP, "Interim %d response.\n", status->code);
 	retry = 0; /* successful read() => never retry now. */
 	/* Discard headers with the interim response. */
@@ -1048,11 +1518,42 @@ static int send_request(ne_request *req, const ne_buffer *request)
 	    if ((ret = send_request_body(req, 0)) != NE_OK) break;	    
 	    sentbody = 1;
 	}
+
+        ret = read_status_line(req, status, retry);
     }
 
     return ret;
 }
 
+/* Send the request, and read the response Status-Line. Returns:
+ *   NE_RETRY   connection closed by server; persistent connection
+ *		timeout
+ *   NE_OK	success
+ *   NE_*	error
+ * On NE_RETRY and NE_* responses, the connection will have been 
+ * closed already.
+ */
+static int send_request(ne_request *req, const ne_buffer *request)
+{
+    int ret, retry; /* retry non-zero whilst the request should be retried */
+
+    /* Send the Request-Line and headers */
+    NE_DEBUG(NE_DBG_HTTP, "Sending request-line and headers:\n");
+    /* Open the connection if necessary */
+    ret = open_connection(req);
+    if (ret) return ret;
+
+    /* Allow retry if a persistent connection has been used. */
+    retry = req->session->persisted;
+
+    ret = write_request(req, request, retry);
+    if (ret) return ret;
+    
+    NE_DEBUG(NE_DBG_HTTP, "Request sent; retry is %d.\n", retry);
+
+    return read_status(req, retry);
+}
+
 /* Read a message header from sock into buf, which has size 'buflen'.
  *
  * Returns:
@@ -1120,21 +1621,25 @@ static int read_message_header(ne_request *req, char *buf, size_t buflen)
 #define MAX_HEADER_LEN (8192)
 
 /* Add a respnose header field for the given request, using
- * precalculated hash value. */
+ * precalculated hash values. */
 static void add_response_header(ne_request *req, unsigned int hash,
-                                char *name, char *value)
+                                unsigned int full, char *name, char *value)
 {
-    struct field **nextf = &req->response_headers[hash];
+    struct field **nextf = &req->response_headers[hash], *nf;
     size_t vlen = strlen(value);
 
     while (*nextf) {
         struct field *const f = *nextf;
-        if (strcmp(f->name, name) == 0) {
+        if (f->hash == full && strcmp(f->name, name) == 0) {
             if (vlen + f->vlen < MAX_HEADER_LEN) {
-                /* merge the header field */
-                f->value = ne_realloc(f->value, f->vlen + vlen + 3);
-                memcpy(f->value + f->vlen, ", ", 2);
-                memcpy(f->value + f->vlen + 2, value, vlen + 1);
+                /* merge the header field; the old value is left
+                 * until the storage is reset. */
+                char *merged = hdr_alloc(req, f->vlen + vlen + 3);
+
+                memcpy(merged, f->value, f->vlen);
+                memcpy(merged + f->vlen, ", ", 2);
+                memcpy(merged + f->vlen + 2, value, vlen + 1);
+                f->value = merged;
                 f->vlen += vlen + 2;
             }
             return;
@@ -1142,65 +1647,139 @@ static void add_response_header(ne_request *req, unsigned int hash,
         nextf = &f->next;
     }
     
-    (*nextf) = ne_malloc(sizeof **nextf);
-    (*nextf)->name = ne_strdup(name);
-    (*nextf)->value = ne_strdup(value);
-    (*nextf)->vlen = vlen;
-    (*nextf)->next = NULL;
+    nf = hdr_alloc(req, sizeof *nf);
+    nf->name = hdr_strndup(req, name, strlen(name));
+    nf->value = hdr_strndup(req, value, vlen);
+    nf->vlen = vlen;
+    nf->hash = full;
+    nf->next = NULL;
+    *nextf = nf;
 }
 
-/* Read response headers.  Returns NE_* code, sets session error and
- * closes connection on error. */
-static int read_response_headers(ne_request *req) 
+/* Add the header field in the NUL-terminated 'hdr', which excludes
+ * the line terminator, to the response headers of 'req'.  'hdr' is
+ * modified. */
+static void process_header(ne_request *req, char *hdr)
 {
-    char hdr[MAX_HEADER_LEN];
-    int ret, count = 0;
-    
-    while ((ret = read_message_header(req, hdr, sizeof hdr)) == NE_RETRY 
-	   && ++count < MAX_HEADER_FIELDS) {
-	char *pnt;
-	unsigned int hash = 0;
+    char *pnt;
+    unsigned int hash = 0, full = 0;
 	
-	/* Strip any trailing whitespace */
-	pnt = hdr + strlen(hdr) - 1;
-	while (pnt > hdr && (*pnt == ' ' || *pnt == '\t'))
-	    *pnt-- = '\0';
-
-	/* Convert the header name to lower case and hash it. */
-	for (pnt = hdr; (*pnt != '\0' && *pnt != ':' && 
-			 *pnt != ' ' && *pnt != '\t'); pnt++) {
-	    *pnt = tolower(*pnt);
-	    hash = HH_ITERATE(hash,*pnt);
-	}
+    /* Strip any trailing whitespace */
+    pnt = hdr + strlen(hdr) - 1;
+    while (pnt > hdr && (*pnt == ' ' || *pnt == '\t'))
+        *pnt-- = '\0';
+
+    /* Convert the header name to lower case and hash it. */
+    for (pnt = hdr; (*pnt != '\0' && *pnt != ':' && 
+                     *pnt != ' ' && *pnt != '\t'); pnt++) {
+        *pnt = tolower(*pnt);
+        hash = HH_ITERATE(hash,*pnt);
+        full = HH_FULL(full,*pnt);
+    }
 
-	/* Skip over any whitespace before the colon. */
-	while (*pnt == ' ' || *pnt == '\t')
-	    *pnt++ = '\0';
+    /* Skip over any whitespace before the colon. */
+    while (*pnt == ' ' || *pnt == '\t')
+        *pnt++ = '\0';
 
-	/* ignore header lines which lack a ':'. */
-	if (*pnt != ':')
-	    continue;
+    /* ignore header lines which lack a ':'. */
+    if (*pnt != ':')
+        return;
 	
-	/* NUL-terminate at the colon (when no whitespace before) */
-	*pnt++ = '\0';
+    /* NUL-terminate at the colon (when no whitespace before) */
+    *pnt++ = '\0';
 
-	/* Skip any whitespace after the colon... */
-	while (*pnt == ' ' || *pnt == '\t')
-	    pnt++;
+    /* Skip any whitespace after the colon... */
+    while (*pnt == ' ' || *pnt == '\t')
+        pnt++;
 
-	/* pnt now points to the header value. */
-	NE_DEBUG(NE_DBG_HTTP, "Header Name: [%s], Value: [%s]\n", hdr, pnt);
-        add_response_header(req, hash, hdr, pnt);
-    }
+    /* pnt now points to the header value. */
+    NE_DEBUG(NE_DBG_HTTP, "Header Name: [%s], Value: [%s]\n", hdr, pnt);
+    add_response_header(req, hash, full, hdr, pnt);
+}
 
-    if (count == MAX_HEADER_FIELDS)
-	ret = aborted(
-	    req, _("Response exceeded maximum number of header fields."), 0);
+/* Parse the 'len' bytes at 'block', a complete header block ending
+ * with an empty line, into the response headers of 'req'.  Each
+ * field is joined with any continuation lines and NUL-terminated in
+ * place.  Returns NE_* code. */
+static int parse_header_block(ne_request *req, char *block, size_t len)
+{
+    char *const end = block + len;
+    char *pnt = block;
+    int count = 0;
 
-    return ret;
-}
+    for (;;) {
+        char *field = pnt, *dst = pnt, *lf;
 
-/* Perform any necessary DNS lookup for the host given by *info;
+        /* Copy down each line of the field, joining continuation
+         * lines with a space (2616 says we MAY do this). */
+        do {
+            size_t n;
+
+            /* a complete block always ends in LF. */
+            lf = memchr(pnt, '\n', end - pnt);
+            n = lf - pnt;
+            if (n && pnt[n-1] == '\r') n--;
+
+            if (dst != field && n) {
+                pnt[0] = ' ';
+            }
+            if (dst != pnt) memmove(dst, pnt, n);
+            dst += n;
+            pnt = lf + 1;
+        } while (dst != field && (*pnt == ' ' || *pnt == '\t'));
+
+        if (dst == field) {
+            NE_DEBUG(NE_DBG_HTTP, "End of headers.\n");
+            return NE_OK;
+        }
+
+        if (dst - field >= MAX_HEADER_LEN) {
+            ne_set_error(req->session, _("Response header too long"));
+            return NE_ERROR;
+        }
+
+        if (++count == MAX_HEADER_FIELDS) {
+            return aborted(req, _("Response exceeded maximum number "
+                                  "of header fields."), 0);
+        }
+
+        /* the terminator of the last line is always overwritten. */
+        *dst = '\0';
+        process_header(req, field);
+    }
+}
+
+/* Read response headers.  Returns NE_* code, sets session error and
+ * closes connection on error. */
+static int read_response_headers(ne_request *req) 
+{
+    char hdr[MAX_HEADER_LEN], *block;
+    int ret, count = 0;
+    ssize_t len;
+
+    /* Parse the header block in the socket read buffer if it will
+     * fit, otherwise read each field in turn. */
+    len = ne_sock_readblock(req->session->socket, &block);
+    if (len < 0) {
+        return aborted(req, _("Error reading response headers"), len);
+    } else if (len > 0) {
+        NE_DEBUG(NE_DBG_HTTP, "[hdr] %.*s", (int)len, block);
+        return parse_header_block(req, block, len);
+    }
+    
+    while ((ret = read_message_header(req, hdr, sizeof hdr)) == NE_RETRY 
+	   && ++count < MAX_HEADER_FIELDS) {
+        process_header(req, hdr);
+    }
+
+    if (count == MAX_HEADER_FIELDS)
+	ret = aborted(
+	    req, _("Response exceeded maximum number of header fields."), 0);
+
+    return ret;
+}
+
+/* Perform any necessary DNS lookup for the host given by *info;
  * return NE_ code. */
 static int lookup_host(ne_session *sess, struct host_info *info)
 {
@@ -1223,33 +1802,38 @@ static int lookup_host(ne_session *sess, struct host_info *info)
     }
 }
 
-int ne_begin_request(ne_request *req)
+/* Prepares to send the request: resets the timing information and
+ * resolves the server hostname if necessary.  Returns NE_OK or an
+ * NE_* error code. */
+static int prepare_request(ne_request *req)
 {
-    struct body_reader *rdr;
     struct host_info *host;
-    ne_buffer *data;
-    const ne_status *const st = &req->status;
-    const char *value;
     int ret;
 
+    memset(&req->timing, 0, sizeof req->timing);
+    req->begun = timestamp();
+
     /* Resolve hostname if necessary. */
     host = req->session->use_proxy?&req->session->proxy:&req->session->server;
     if (host->address == NULL) {
         ret = lookup_host(req->session, host);
+        req->timing.lookup = timestamp() - req->begun;
         if (ret) return ret;
     }    
-    
-    /* Build the request string, and send it */
-    data = build_request(req);
-    DEBUG_DUMP_REQUEST(data->data);
-    ret = send_request(req, data);
-    /* Retry this once after a persistent connection timeout. */
-    if (ret == NE_RETRY && !req->session->no_persist) {
-	NE_DEBUG(NE_DBG_HTTP, "Persistent connection timed out, retrying.\n");
-	ret = send_request(req, data);
-    }
-    ne_buffer_destroy(data);
-    if (ret != NE_OK) return ret == NE_RETRY ? NE_ERROR : ret;
+
+    return NE_OK;
+}
+
+/* Reads the response headers, once the status-line has been read,
+ * and prepares to read the response body.  Returns NE_OK or an NE_*
+ * error code. */
+static int read_response_head(ne_request *req)
+{
+    struct body_reader *rdr;
+    const ne_status *const st = &req->status;
+    const char *value;
+    int ret;
+    double start;
 
     /* Determine whether server claims HTTP/1.1 compliance. */
     req->session->is_http11 = (st->major_version == 1 && 
@@ -1265,8 +1849,10 @@ int ne_begin_request(ne_request *req)
     free_response_headers(req);
 
     /* Read the headers */
+    start = timestamp();
     ret = read_response_headers(req);
     if (ret) return ret;
+    req->timing.read_headers = timestamp() - start;
 
     /* check the Connection header */
     value = get_response_header_hv(req, HH_HV_CONNECTION, "connection");
@@ -1275,7 +1861,7 @@ int ne_begin_request(ne_request *req)
 
         do {
             char *token = ne_shave(ne_token(&ptr, ','), " \t");
-            unsigned int hash = hash_and_lower(token);
+            unsigned int full, hash = hash_and_lower(token, &full);
 
             if (strcmp(token, "close") == 0) {
                 req->can_persist = 0;
@@ -1314,6 +1900,7 @@ int ne_begin_request(ne_request *req)
          * statement in the manual. */
         req->resp.mode = R_CHUNKED;
         req->resp.body.chunk.remain = 0;
+        req->resp.body.chunk.delim = req->resp.body.chunk.last = 0;
     } else if ((value = get_response_header_hv(req, HH_HV_CONTENT_LENGTH,
                                                "content-length")) != NULL) {
         ne_off_t len = ne_strtoff(value, NULL, 10);
@@ -1338,11 +1925,38 @@ int ne_begin_request(ne_request *req)
     return NE_OK;
 }
 
+int ne_begin_request(ne_request *req)
+{
+    ne_buffer *data;
+    int ret;
+
+    use_conn(req);
+
+    ret = prepare_request(req);
+    if (ret) return ret;
+    
+    /* Build the request string, and send it */
+    data = build_request(req);
+    DEBUG_DUMP_REQUEST(data->data);
+    ret = send_request(req, data);
+    /* Retry this once after a persistent connection timeout. */
+    if (ret == NE_RETRY && !req->session->no_persist) {
+	NE_DEBUG(NE_DBG_HTTP, "Persistent connection timed out, retrying.\n");
+	ret = send_request(req, data);
+    }
+    ne_buffer_destroy(data);
+    if (ret != NE_OK) return ret == NE_RETRY ? NE_ERROR : ret;
+
+    return read_response_head(req);
+}
+
 int ne_end_request(ne_request *req)
 {
     struct hook *hk;
     int ret;
 
+    use_conn(req);
+
     /* Read headers in chunked trailers */
     if (req->resp.mode == R_CHUNKED) {
 	ret = read_response_headers(req);
@@ -1357,6 +1971,12 @@ int ne_end_request(ne_request *req)
 	ne_post_send_fn fn = (ne_post_send_fn)hk->fn;
 	ret = fn(req, hk->userdata, &req->status);
     }
+
+    req->timing.total = timestamp() - req->begun;
+    for (hk = req->session->timing_hooks; hk != NULL; hk = hk->next) {
+        ne_timing_fn fn = (ne_timing_fn)hk->fn;
+        fn(req, hk->userdata, &req->timing);
+    }
     
     /* Close the connection if persistent connections are disabled or
      * not supported by the server. */
@@ -1364,17 +1984,71 @@ int ne_end_request(ne_request *req)
 	ne_close_connection(req->session);
     else
 	req->session->persisted = 1;
+
+    /* the connection is now free for use by another request. */
+    if (req->session->conn_owner == req)
+        req->session->conn_owner = NULL;
     
     return ret;
 }
 
+/* Largest amount of data moved by one ne_sock_splice call. */
+#define SPLICE_MAX (1024 * 1024)
+
+/* Moves part of a Content-Length delimited response body straight
+ * from the connection to 'fd', where no body reader wants it and
+ * none of it is buffered.  Returns the number of bytes moved, zero if
+ * that is not possible, or -1 on error. */
+static ssize_t splice_response(ne_request *req, int fd)
+{
+    struct ne_response *const resp = &req->resp;
+    struct body_reader *rdr;
+    double start = timestamp();
+    ssize_t ret;
+
+    use_conn(req);
+
+    if (resp->mode != R_CLENGTH || resp->body.clen.remain == 0)
+        return 0;
+
+    for (rdr = req->body_readers; rdr != NULL; rdr = rdr->next)
+        if (rdr->use) return 0;
+
+    ret = ne_sock_splice(req->session->socket, fd,
+                         resp->body.clen.remain > SPLICE_MAX 
+                         ? SPLICE_MAX : (size_t)resp->body.clen.remain);
+    if (ret < 0) {
+        aborted(req, _("Could not read response body"), ret);
+        return -1;
+    } else if (ret == 0) {
+        return 0;
+    }
+
+    NE_DEBUG(NE_DBG_HTTP, "Spliced %" NE_FMT_SSIZE_T " bytes.\n", ret);
+    req->timing.read_body += timestamp() - start;
+    resp->body.clen.remain -= ret;
+    resp->progress += ret;
+
+    if (req->session->progress_cb) {
+	req->session->progress_cb(req->session->progress_ud, resp->progress, 
+				  resp->body.clen.total);
+    }
+
+    return ret;
+}
+
 int ne_read_response_to_fd(ne_request *req, int fd)
 {
+    const char *block;
     ssize_t len;
 
-    while ((len = ne_read_response_block(req, req->respbuf, 
-                                         sizeof req->respbuf)) > 0) {
-        const char *block = req->respbuf;
+    for (;;) {
+        len = splice_response(req, fd);
+        if (len > 0) continue;
+        if (len < 0) return NE_ERROR;
+
+        len = ne_read_response_view(req, &block);
+        if (len <= 0) break;
 
         do {
             ssize_t ret = write(fd, block, len);
@@ -1398,10 +2072,11 @@ int ne_read_response_to_fd(ne_request *req, int fd)
 
 int ne_discard_response(ne_request *req)
 {
+    const char *block;
     ssize_t len;
 
     do {
-        len = ne_read_response_block(req, req->respbuf, sizeof req->respbuf);
+        len = ne_read_response_view(req, &block);
     } while (len > 0);
     
     return len == 0 ? NE_OK : NE_ERROR;
@@ -1424,11 +2099,163 @@ int ne_request_dispatch(ne_request *req)
     return ret;
 }
 
+/* Maximum number of pipelined requests sent before their responses
+ * are read, and of the bytes of such requests.  Whilst responses go
+ * unread, the server may stop reading requests once its socket
+ * buffers fill; bounding what is sent ahead keeps the unread
+ * requests within the socket buffers, so that a blocking write
+ * cannot wait indefinitely on a server waiting for the client to
+ * read. */
+#define PIPELINE_DEPTH (8)
+#define PIPELINE_BYTES (32768)
+
+/* Returns the approximate size of request 'req', less any headers
+ * added by the pre_send hooks. */
+static ne_off_t pipeline_size(const ne_request *req)
+{
+    return strlen(req->method) + strlen(req->uri)
+        + ne_buffer_size(req->headers) + req->body_length;
+}
+
+/* Sends pipelined request 'req', which has been prepared, on the
+ * session's connection without reading the response; 'retry' is as
+ * for write_request.  Returns non-zero if it cannot be pipelined (it
+ * uses 100-continue) or was not sent, in which case the connection
+ * may have been closed. */
+static int pipeline_send(ne_request *req, int retry)
+{
+    ne_buffer *data;
+    int ret;
+
+    if (req->use_expect100)
+        return -1;
+
+    data = build_request(req);
+    DEBUG_DUMP_REQUEST(data->data);
+    ret = write_request(req, data, retry);
+    ne_buffer_destroy(data);
+
+    if (ret) {
+        NE_DEBUG(NE_DBG_HTTP, "Pipelined write failed, aborting.\n");
+    }
+    return ret;
+}
+
+int ne_request_dispatch_pipeline(ne_request **reqs, int count)
+{
+    ne_session *sess;
+    unsigned char *redo;
+    ne_off_t *sizes, pending = 0;
+    int n, sent = 0, piping, retry = 0, ret = NE_OK;
+
+    if (count == 0) return NE_OK;
+
+    sess = reqs[0]->session;
+    piping = count > 1 && !sess->no_persist;
+
+    if (piping) {
+        use_conn(reqs[0]);
+        piping = prepare_request(reqs[0]) == NE_OK
+            && open_connection(reqs[0]) == NE_OK;
+        retry = sess->persisted;
+    }
+
+    redo = ne_calloc(count);
+    sizes = ne_calloc(count * sizeof *sizes);
+
+    for (n = 0; ret == NE_OK && n < count; n++) {
+        ne_request *const req = reqs[n];
+
+        /* Send requests ahead of this response, within the limits;
+         * a request is always sent if no responses are outstanding,
+         * whatever its size. */
+        while (piping && sent < count && sent - n < PIPELINE_DEPTH
+               && sess->connected
+               && (sent == n || pending + pipeline_size(reqs[sent])
+                   <= PIPELINE_BYTES)) {
+            sizes[sent] = pipeline_size(reqs[sent]);
+            if ((sent > 0 && prepare_request(reqs[sent]))
+                || pipeline_send(reqs[sent], retry)) {
+                piping = 0;
+            } else {
+                pending += sizes[sent++];
+            }
+        }
+
+        if (n == sent || !sess->connected) break;
+
+        /* The server may close the connection after any response;
+         * remaining requests are then sent again, as for a persistent
+         * connection timeout. */
+        if (n > 0) retry = 1;
+
+        /* all the requests share one connection. */
+        sess->conn_owner = req;
+
+        ret = read_status(req, retry);
+        if (ret == NE_RETRY) {
+            NE_DEBUG(NE_DBG_HTTP, "Pipeline broken after %d responses.\n", n);
+            ret = NE_OK;
+            break;
+        }
+
+        if (ret == NE_OK) ret = read_response_head(req);
+        if (ret == NE_OK) ret = ne_discard_response(req);
+        if (ret == NE_OK) ret = ne_end_request(req);
+
+        if (ret == NE_RETRY) {
+            /* e.g. authentication is needed: send it again later. */
+            redo[n] = 1;
+            ret = NE_OK;
+        }
+        else if (ret) {
+            break;
+        }
+
+        pending -= sizes[n];
+
+        NE_DEBUG(NE_DBG_HTTP | NE_DBG_FLUSH, 
+                 "Pipelined request ends, status %d class %dxx, "
+                 "error line:\n%s\n", req->status.code, req->status.klass,
+                 sess->error);
+    }
+
+    NE_DEBUG(NE_DBG_HTTP, "Pipelined %d of %d requests.\n", sent, count);
+
+    if (ret != NE_OK && n + 1 < sent) {
+        /* The responses to the remaining requests are still to be
+         * read from the connection, so it cannot be used again. */
+        NE_DEBUG(NE_DBG_HTTP, "Pipeline aborted with %d responses "
+                 "unread.\n", sent - n - 1);
+        ne_close_connection(sess);
+    }
+
+    if (ret == NE_OK) {
+        int m;
+
+        /* Any requests for which no response was read, or which need
+         * to be sent again, are dispatched in turn. */
+        for (m = 0; ret == NE_OK && m < count; m++) {
+            if (m >= n || redo[m])
+                ret = ne_request_dispatch(reqs[m]);
+        }
+    }
+
+    ne_free(sizes);
+    ne_free(redo);
+    return ret;
+}
+
 const ne_status *ne_get_status(const ne_request *req)
 {
     return &req->status;
 }
 
+const ne_request_timing *ne_get_request_timing(const ne_request *req)
+{
+    return &req->timing;
+}
+
 ne_session *ne_get_session(const ne_request *req)
 {
     return req->session;
@@ -1501,6 +2328,13 @@ static int do_connect(ne_request *req, struct host_info *host, const char *err)
 {
     ne_session *const sess = req->session;
     int ret;
+    double start = timestamp();
+
+    if (sess->max_conns && sess->nconns >= sess->max_conns) {
+        ne_set_error(sess, _("Could not open connection: limit of %d "
+                             "connections reached"), sess->max_conns);
+        return NE_ERROR;
+    }
 
     if ((sess->socket = ne_sock_create()) == NULL) {
         ne_set_error(sess, _("Could not create socket"));
@@ -1530,11 +2364,15 @@ static int do_connect(ne_request *req, struct host_info *host, const char *err)
     }
 
     notify_status(sess, ne_conn_connected, host->hostport);
+    req->timing.connect += timestamp() - start;
     
     if (sess->rdtimeout)
 	ne_sock_read_timeout(sess->socket, sess->rdtimeout);
+    if (sess->rdbufsize)
+        ne_sock_read_bufsize(sess->socket, sess->rdbufsize);
 
     sess->connected = 1;
+    sess->nconns++;
     /* clear persistent connection flag. */
     sess->persisted = 0;
     return NE_OK;
@@ -1558,6 +2396,8 @@ static int open_connection(ne_request *req)
 #ifdef NE_HAVE_SSL
     /* Negotiate SSL layer if required. */
     if (sess->use_ssl && !sess->in_connect) {
+        double start = timestamp();
+
         /* CONNECT tunnel */
         if (req->session->use_proxy)
             ret = proxy_tunnel(sess);
@@ -1567,8 +2407,884 @@ static int open_connection(ne_request *req)
             if (ret != NE_OK)
                 ne_close_connection(sess);
         }
+        req->timing.secure += timestamp() - start;
     }
 #endif
     
     return ret;
 }
+
+/* Request engine: dispatches many requests at once, across any
+ * number of sessions, as a state machine driven by epoll (or poll
+ * where epoll is not available).  Connections are used in
+ * non-blocking mode: each request moves through the states below as
+ * its connection becomes writable or readable, so a slow server
+ * holds up only its own requests.  The response head is collected
+ * in the socket read buffer until it is complete, and then parsed
+ * from there; the body is read as it arrives.  Each request has its
+ * own timeout, which restarts whenever data is sent or received. */
+
+/* State of a request dispatched by an engine. */
+struct engine_req {
+    ne_request *req;
+    enum {
+        ER_START = 0, /* request must be sent */
+        ER_CONNECT, /* connection being established */
+        ER_WRITE, /* request being written */
+        ER_HEAD, /* awaiting the response status-line and headers */
+        ER_BODY, /* reading the response body */
+        ER_DONE /* response read, or failed */
+    } state;
+    int retried; /* non-zero if resent after connection timeout */
+    int persisted; /* non-zero if sent on a persistent connection */
+    int ret; /* NE_* code, once ER_DONE */
+    int fd; /* descriptor being polled, or -1 */
+    int writing; /* non-zero if polling 'fd' for writing */
+    double deadline; /* time by which the request times out */
+    double phase; /* time the current state was entered */
+    ne_buffer *head; /* request-line and headers */
+    size_t headpos; /* bytes of 'head' written */
+    char *block; /* buffer for request body blocks */
+    const char *body; /* block of request body being written */
+    size_t bodylen, bodypos; /* length of 'body'; bytes written */
+    int bodyend; /* non-zero once the last block has been fetched */
+    ne_off_t progress; /* bytes of request body written */
+    size_t scanned; /* offset of the response head not yet scanned */
+    int msgstart; /* non-zero if the next line is a status-line */
+    int interim; /* non-zero if scanning an interim response */
+    ne_engine_done_fn done;
+    void *userdata;
+    struct engine_req *next;
+};
+
+struct ne_engine_s {
+    struct engine_req *reqs; /* requests in progress */
+    int count; /* number of requests in progress */
+#ifdef USE_EPOLL
+    int epfd; /* epoll descriptor, or -1 to use poll */
+#endif
+};
+
+/* Time to wait for progress on a request before giving up, unless a
+ * read timeout is set for the session. */
+#define ENGINE_TIMEOUT (120)
+
+/* Largest read buffer used to hold a response head, or chunk framing
+ * and trailer fields. */
+#define ENGINE_MAXBUF (1024 * 1024)
+
+/* Maximum number of reads from one connection per event, so that a
+ * fast server cannot starve the others. */
+#define ENGINE_READS (16)
+
+ne_engine *ne_engine_create(void)
+{
+    ne_engine *eng = ne_calloc(sizeof *eng);
+#ifdef USE_EPOLL
+    eng->epfd = epoll_create(64);
+    if (eng->epfd < 0) {
+        char err[200];
+
+        ne_strerror(errno, err, sizeof err);
+        NE_DEBUG(NE_DBG_HTTP, "epoll_create failed, using poll: %s\n", err);
+    }
+#endif
+    return eng;
+}
+
+void ne_engine_dispatch(ne_engine *eng, ne_request *req,
+                        ne_engine_done_fn done, void *userdata)
+{
+    struct engine_req *er = ne_calloc(sizeof *er);
+
+    er->req = req;
+    er->state = ER_START;
+    er->fd = -1;
+    er->done = done;
+    er->userdata = userdata;
+
+    /* append, so requests on a session are sent in order. */
+    if (eng->reqs) {
+        struct engine_req *last;
+        for (last = eng->reqs; last->next; last = last->next)
+            /* nullop */;
+        last->next = er;
+    } else {
+        eng->reqs = er;
+    }
+    eng->count++;
+}
+
+/* Returns the socket used by request 'req', or NULL if it has no
+ * connection. */
+static ne_socket *req_socket(ne_request *req)
+{
+    ne_session *const sess = req->session;
+
+    if (req->parked)
+        return req->parked->socket;
+    else if (sess->conn_owner == req && sess->connected)
+        return sess->socket;
+    else
+        return NULL;
+}
+
+/* Polls the connection used by 'er' for writing if 'writing' is
+ * non-zero, otherwise for reading. */
+static void engine_watch(ne_engine *eng, struct engine_req *er, int writing)
+{
+    int fd = ne_sock_fd(req_socket(er->req));
+
+    if (er->fd == fd && er->writing == writing) return;
+#ifdef USE_EPOLL
+    if (eng->epfd >= 0) {
+        struct epoll_event ev;
+
+        ev.events = writing ? EPOLLOUT : EPOLLIN;
+        ev.data.ptr = er;
+        epoll_ctl(eng->epfd, er->fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  fd, &ev);
+    }
+#endif
+    er->fd = fd;
+    er->writing = writing;
+}
+
+/* Stops polling the connection used by 'er'; must be called before
+ * anything which may close the connection. */
+static void engine_unwatch(ne_engine *eng, struct engine_req *er)
+{
+    if (er->fd < 0) return;
+#ifdef USE_EPOLL
+    if (eng->epfd >= 0) {
+        struct epoll_event ev; /* for kernels < 2.6.9 */
+        epoll_ctl(eng->epfd, EPOLL_CTL_DEL, er->fd, &ev);
+    }
+#endif
+    er->fd = -1;
+}
+
+/* Restarts the timeout for 'er', after progress has been made. */
+static void engine_progress(struct engine_req *er)
+{
+    ne_session *const sess = er->req->session;
+
+    er->deadline = timestamp()
+        + (sess->rdtimeout ? sess->rdtimeout : ENGINE_TIMEOUT);
+}
+
+static void engine_finish(ne_engine *eng, struct engine_req *er, int ret)
+{
+    engine_unwatch(eng, er);
+    er->state = ER_DONE;
+    er->ret = ret;
+}
+
+/* Returns the message prefixed to connection errors for 'sess'. */
+static const char *connect_error(ne_session *sess)
+{
+    return sess->use_proxy ? _("Could not connect to proxy server")
+        : _("Could not connect to server");
+}
+
+/* Handles failure to send or read the response for 'er', with socket
+ * error 'code', whilst doing 'doing'.  The request is sent again on a
+ * new connection if a persistent connection was found to have timed
+ * out, as for ne_begin_request. */
+static void engine_abort(ne_engine *eng, struct engine_req *er,
+                         const char *doing, ssize_t code)
+{
+    ne_request *const req = er->req;
+    int ret;
+
+    engine_unwatch(eng, er);
+    ret = aborted(req, doing, code);
+    if (RETRY_RET(er->persisted && !er->retried
+                  && !req->session->no_persist, code, ret) == NE_RETRY) {
+        NE_DEBUG(NE_DBG_HTTP, "Persistent connection timed out, retrying.\n");
+        er->retried = 1;
+        er->state = ER_START;
+    } else {
+        engine_finish(eng, er, ret);
+    }
+}
+
+static void engine_write(ne_engine *eng, struct engine_req *er);
+
+/* Starts to write the request for 'er', once connected. */
+static void engine_send(ne_engine *eng, struct engine_req *er)
+{
+    er->state = ER_WRITE;
+    er->phase = timestamp();
+    engine_progress(er);
+    engine_write(eng, er);
+}
+
+/* Completes the connection for 'er', once established. */
+static void engine_opened(ne_engine *eng, struct engine_req *er)
+{
+    ne_request *const req = er->req;
+    ne_session *const sess = req->session;
+    struct host_info *host = sess->use_proxy ? &sess->proxy : &sess->server;
+
+    notify_status(sess, ne_conn_connected, host->hostport);
+    req->timing.connect += timestamp() - er->phase;
+
+    if (sess->rdtimeout)
+	ne_sock_read_timeout(sess->socket, sess->rdtimeout);
+    if (sess->rdbufsize)
+        ne_sock_read_bufsize(sess->socket, sess->rdbufsize);
+
+    engine_send(eng, er);
+}
+
+/* Starts to connect to the current address of the server (or
+ * proxy) for 'er', or to the next addresses in turn if that fails at
+ * once. */
+static void engine_connect(ne_engine *eng, struct engine_req *er)
+{
+    ne_session *const sess = er->req->session;
+    struct host_info *host = sess->use_proxy ? &sess->proxy : &sess->server;
+
+    while (host->current) {
+        int ret;
+
+	notify_status(sess, ne_conn_connecting, host->hostport);
+#ifdef NE_DEBUGGING
+	if (ne_debug_mask & NE_DBG_HTTP) {
+	    char buf[150];
+	    NE_DEBUG(NE_DBG_HTTP, "Connecting to %s\n",
+		     ne_iaddr_print(host->current, buf, sizeof buf));
+	}
+#endif
+        ret = ne_sock_connect_start(sess->socket, host->current, host->port);
+        if (ret == 0) {
+            engine_opened(eng, er);
+            return;
+        } else if (ret == NE_SOCK_RETRY) {
+            /* completed once the socket is writable. */
+            er->state = ER_CONNECT;
+            engine_watch(eng, er, 1);
+            return;
+        }
+
+        host->current = resolve_next(sess, host);
+    }
+
+    ne_set_error(sess, "%s: %s", connect_error(sess),
+                 ne_sock_error(sess->socket));
+    ne_close_connection(sess);
+    engine_finish(eng, er, NE_CONNECT);
+}
+
+/* Opens a new connection for 'er', as for do_connect. */
+static void engine_open(ne_engine *eng, struct engine_req *er)
+{
+    ne_session *const sess = er->req->session;
+    struct host_info *host = sess->use_proxy ? &sess->proxy : &sess->server;
+
+    if (sess->max_conns && sess->nconns >= sess->max_conns) {
+        ne_set_error(sess, _("Could not open connection: limit of %d "
+                             "connections reached"), sess->max_conns);
+        engine_finish(eng, er, NE_ERROR);
+        return;
+    }
+
+    if ((sess->socket = ne_sock_create()) == NULL) {
+        ne_set_error(sess, _("Could not create socket"));
+        engine_finish(eng, er, NE_ERROR);
+        return;
+    }
+
+    /* The connection is counted whilst it is being established, so
+     * that it can be parked if another request uses the session. */
+    sess->connected = 1;
+    sess->nconns++;
+    sess->persisted = 0;
+
+    if (host->current == NULL)
+	host->current = resolve_first(sess, host);
+
+    er->phase = timestamp();
+    engine_progress(er);
+    engine_connect(eng, er);
+}
+
+/* Completes a connection in progress for 'er', once the socket is
+ * writable; tries the next address if it failed. */
+static void engine_connected(ne_engine *eng, struct engine_req *er)
+{
+    ne_session *const sess = er->req->session;
+    struct host_info *host = sess->use_proxy ? &sess->proxy : &sess->server;
+
+    /* the descriptor is closed if the connection failed. */
+    engine_unwatch(eng, er);
+
+    if (ne_sock_connect_finish(sess->socket) == 0) {
+        engine_opened(eng, er);
+    } else {
+        host->current = resolve_next(sess, host);
+        engine_connect(eng, er);
+    }
+}
+
+/* Starts the request for 'er', which must be in state ER_START:
+ * builds the request, then writes it on a connection from the
+ * session's pool, or on a new connection. */
+static void engine_start(ne_engine *eng, struct engine_req *er)
+{
+    ne_request *const req = er->req;
+    ne_session *const sess = req->session;
+    int ret;
+
+    use_conn(req);
+
+    if (sess->use_ssl) {
+        /* SSL negotiation and I/O are blocking, so secure requests
+         * are dispatched in turn. */
+        engine_finish(eng, er, ne_request_dispatch(req));
+        return;
+    }
+
+    ret = prepare_request(req);
+    if (ret) {
+        engine_finish(eng, er, ret);
+        return;
+    }
+
+    /* There is no waiting for a 100-continue response: the body is
+     * written straight after the headers. */
+    req->use_expect100 = 0;
+
+    /* tell the source to start again from the beginning. */
+    if (req->body_length > 0 && req->body_cb(req->body_ud, NULL, 0) != 0) {
+        engine_finish(eng, er, NE_ERROR);
+        return;
+    }
+
+    if (er->head) ne_buffer_destroy(er->head);
+    er->head = build_request(req);
+    DEBUG_DUMP_REQUEST(er->head->data);
+    er->headpos = er->bodylen = er->bodypos = 0;
+    er->bodyend = 0;
+    er->progress = 0;
+    er->scanned = 0;
+    er->msgstart = 1;
+    er->interim = 0;
+
+    if (!sess->connected) {
+        er->persisted = 0;
+        engine_open(eng, er);
+    } else if (ne_sock_nonblock(sess->socket, 1)) {
+        ne_set_error(sess, "%s", ne_sock_error(sess->socket));
+        ne_close_connection(sess);
+        engine_finish(eng, er, NE_ERROR);
+    } else {
+        er->persisted = sess->persisted;
+        engine_send(eng, er);
+    }
+}
+
+/* Fetches the next block of the request body for 'er', once the
+ * last has been written; returns non-zero if the body provider
+ * fails. */
+static int engine_pull(struct engine_req *er)
+{
+    ne_request *const req = er->req;
+    ssize_t bytes;
+
+    er->bodypos = 0;
+
+    if (req->body_length <= 0) {
+        er->bodylen = 0;
+        er->bodyend = 1;
+        return 0;
+    } else if (req->body_cb == body_string_send) {
+        /* a buffered body is written straight from the buffer. */
+        er->body = req->body.buf.buffer;
+        er->bodylen = req->body.buf.length;
+        er->bodyend = 1;
+        return 0;
+    }
+
+    if (er->block == NULL) er->block = ne_malloc(NE_BUFSIZ);
+    bytes = req->body_cb(req->body_ud, er->block, NE_BUFSIZ);
+    if (bytes < 0) {
+        NE_DEBUG(NE_DBG_HTTP, "Request body provider failed with "
+                 "%" NE_FMT_SSIZE_T "\n", bytes);
+        return -1;
+    }
+
+    er->body = er->block;
+    er->bodylen = bytes;
+    er->bodyend = bytes == 0;
+    return 0;
+}
+
+/* Writes as much of the request for 'er' as the connection will
+ * take, sending the headers together with the first block of the
+ * body; once it is all written, waits for the response. */
+static void engine_write(ne_engine *eng, struct engine_req *er)
+{
+    ne_request *const req = er->req;
+    ne_session *const sess = req->session;
+    size_t headlen = ne_buffer_size(er->head);
+
+    for (;;) {
+        ne_iovec vec[2];
+        int count = 0;
+        ssize_t ret;
+
+        if (er->bodypos == er->bodylen && !er->bodyend
+            && engine_pull(er)) {
+            engine_unwatch(eng, er);
+            ne_close_connection(sess);
+            engine_finish(eng, er, NE_ERROR);
+            return;
+        }
+
+        if (er->headpos < headlen) {
+            vec[count].base = er->head->data + er->headpos;
+            vec[count++].len = headlen - er->headpos;
+        }
+        if (er->bodypos < er->bodylen) {
+            vec[count].base = er->body + er->bodypos;
+            vec[count++].len = er->bodylen - er->bodypos;
+        }
+        if (count == 0) break;
+
+        ret = ne_sock_writev(sess->socket, vec, count);
+        if (ret == NE_SOCK_RETRY) {
+            engine_watch(eng, er, 1);
+            return;
+        } else if (ret < 0) {
+            engine_abort(eng, er, er->headpos < headlen
+                         ? _("Could not send request")
+                         : _("Could not send request body"), ret);
+            return;
+        }
+
+        engine_progress(er);
+        if (er->headpos < headlen) {
+            size_t len = headlen - er->headpos;
+
+            if ((size_t)ret < len) len = ret;
+            er->headpos += len;
+            ret -= len;
+            if (er->headpos == headlen) {
+                double now = timestamp();
+
+                req->timing.send_headers += now - er->phase;
+                er->phase = now;
+            }
+        }
+        if (ret > 0) {
+            er->bodypos += ret;
+            er->progress += ret;
+            if (sess->progress_cb)
+                sess->progress_cb(sess->progress_ud, er->progress,
+                                  req->body_length);
+        }
+    }
+
+    if (req->body_length > 0)
+        req->timing.send_body += timestamp() - er->phase;
+
+    sess->stats.requests++;
+    er->state = ER_HEAD;
+    er->phase = timestamp();
+    engine_watch(eng, er, 0);
+}
+
+/* Scans the data buffered for 'sock' for the end of the response
+ * head, skipping any interim 1xx responses.  Scanning resumes from
+ * the line at offset er->scanned in the buffered data.  Returns
+ * non-zero once the head is complete. */
+static int head_complete(struct engine_req *er, ne_socket *sock)
+{
+    const char *data, *line, *lf;
+    ssize_t avail;
+
+    if (!ne_sock_pending(sock)) return 0;
+
+    avail = ne_sock_peekbuf(sock, &data);
+    for (line = data + er->scanned;
+         (lf = memchr(line, '\n', data + avail - line)) != NULL;
+         line = lf + 1) {
+        if (er->msgstart) {
+            const char *sp = memchr(line, ' ', lf - line);
+
+            /* status-line: look for a 1xx status-code. */
+            er->interim = sp && sp + 1 < lf && sp[1] == '1';
+            er->msgstart = 0;
+        } else if (line == lf || (line + 1 == lf && *line == '\r')) {
+            if (!er->interim) {
+                er->scanned = lf + 1 - data;
+                return 1;
+            }
+            er->msgstart = 1;
+        }
+    }
+
+    er->scanned = line - data;
+    return 0;
+}
+
+/* Doubles the size of the read buffer of 'sock', once it is full;
+ * returns non-zero if it has reached ENGINE_MAXBUF. */
+static int engine_grow(ne_socket *sock)
+{
+    const char *data;
+    ssize_t size = ne_sock_peekbuf(sock, &data);
+
+    if (size * 2 > ENGINE_MAXBUF) return -1;
+
+    NE_DEBUG(NE_DBG_HTTP, "Read buffer grown to %" NE_FMT_SSIZE_T 
+             " bytes.\n", size * 2);
+    return ne_sock_read_bufsize(sock, size * 2);
+}
+
+static void engine_body(ne_engine *eng, struct engine_req *er);
+
+/* Reads the response head for 'er' as it arrives; once it is
+ * complete, parses it and starts to read the body. */
+static void engine_head(ne_engine *eng, struct engine_req *er)
+{
+    ne_request *const req = er->req;
+    ne_socket *const sock = req->session->socket;
+    int ret;
+
+    while (!head_complete(er, sock)) {
+        ssize_t bytes = ne_sock_fill(sock);
+
+        if (bytes > 0) {
+            engine_progress(er);
+        } else if (bytes == NE_SOCK_RETRY) {
+            return;
+        } else if (bytes < 0) {
+            if (ne_sock_pending(sock)) {
+                /* a partial response is never retried. */
+                er->retried = 1;
+            }
+            engine_abort(eng, er, _("Could not read status line"), bytes);
+            return;
+        } else if (engine_grow(sock)) {
+            engine_unwatch(eng, er);
+            engine_finish(eng, er,
+                          aborted(req, _("Response header too long"), 0));
+            return;
+        }
+    }
+
+    req->timing.first_byte += timestamp() - er->phase;
+
+    /* the head is read from the buffer, but the connection is closed
+     * if it is invalid. */
+    engine_unwatch(eng, er);
+    ret = read_status(req, 0);
+    if (ret == NE_OK) ret = read_response_head(req);
+    if (ret) {
+        engine_finish(eng, er, ret);
+        return;
+    }
+
+    er->state = ER_BODY;
+    engine_body(eng, er);
+}
+
+/* Returns non-zero if the whole response body has been read, where
+ * that can be known without reading from the connection. */
+static int body_complete(ne_request *req)
+{
+    return req->resp.mode == R_NO_BODY
+        || (req->resp.mode == R_CLENGTH && req->resp.body.clen.remain == 0);
+}
+
+/* Returns non-zero if the next block of the response body for 'req'
+ * can be read from the data buffered for 'sock', without reading
+ * from the socket.  For a chunked body, that needs any chunk framing
+ * before the next chunk data, or the last chunk and trailer fields,
+ * to be buffered in full. */
+static int body_ready(ne_request *req, ne_socket *sock)
+{
+    const struct ne_response *const resp = &req->resp;
+    const char *data, *end, *lf;
+    unsigned long len;
+    ssize_t avail;
+
+    if (!ne_sock_pending(sock))
+        return 0;
+    else if (resp->mode != R_CHUNKED || resp->body.chunk.remain)
+        return 1;
+
+    avail = ne_sock_peekbuf(sock, &data);
+    end = data + avail;
+
+    if (resp->body.chunk.delim) {
+        if (end - data < 2) return 0;
+        data += 2;
+    }
+
+    if ((lf = memchr(data, '\n', end - data)) == NULL)
+        return 0;
+    else if (parse_chunk_size(data, lf, &len))
+        return 1; /* read_chunked reports the error. */
+    data = lf + 1;
+
+    if (len) return data < end;
+
+    /* last chunk: look for the end of the trailer fields. */
+    while (data < end && *data != '\n'
+           && !(*data == '\r' && data + 1 < end && data[1] == '\n')) {
+        if ((lf = memchr(data, '\n', end - data)) == NULL)
+            return 0;
+        data = lf + 1;
+    }
+    return data < end;
+}
+
+/* Completes the request for 'er', once the response body has been
+ * read; 'ret' is the final return value of ne_read_response_view. */
+static void engine_end(ne_engine *eng, struct engine_req *er, ssize_t ret)
+{
+    ne_request *const req = er->req;
+    int code;
+
+    if (ret < 0) {
+        /* the connection was closed on error. */
+        engine_finish(eng, er, NE_ERROR);
+        return;
+    }
+
+    /* the connection is returned to the pool in blocking mode. */
+    ne_sock_nonblock(req->session->socket, 0);
+    code = ne_end_request(req);
+    if (code == NE_RETRY) {
+        /* e.g. authentication is needed: send it again. */
+        er->retried = 0;
+        er->state = ER_START;
+    } else {
+        engine_finish(eng, er, code);
+    }
+}
+
+/* Reads the response body for 'er' as it arrives, passing it to the
+ * body readers. */
+static void engine_body(ne_engine *eng, struct engine_req *er)
+{
+    ne_request *const req = er->req;
+    ne_socket *const sock = req->session->socket;
+    int n, eof = 0;
+
+    /* the connection is closed if the body cannot be read, or a body
+     * reader fails. */
+    engine_unwatch(eng, er);
+
+    for (n = 0; ; n++) {
+        ssize_t bytes;
+
+        while (eof || body_complete(req) || body_ready(req, sock)) {
+            const char *data;
+
+            bytes = ne_read_response_view(req, &data);
+            if (bytes <= 0) {
+                engine_end(eng, er, bytes);
+                return;
+            }
+        }
+
+        if (n == ENGINE_READS) break;
+
+        bytes = ne_sock_fill(sock);
+        if (bytes > 0) {
+            engine_progress(er);
+        } else if (bytes == NE_SOCK_RETRY) {
+            break;
+        } else if (bytes == 0) {
+            if (engine_grow(sock)) {
+                engine_finish(eng, er,
+                              aborted(req, _("Could not read chunk size"), 0));
+                return;
+            }
+        } else if (req->resp.mode == R_TILLEOF 
+                   && (bytes == NE_SOCK_CLOSED || bytes == NE_SOCK_TRUNC)) {
+            eof = 1;
+        } else {
+            engine_finish(eng, er,
+                          aborted(req, _("Could not read response body"),
+                                  bytes));
+            return;
+        }
+    }
+
+    engine_watch(eng, er, 0);
+}
+
+/* Fails the request for 'er', which has made no progress before its
+ * deadline. */
+static void engine_expire(ne_engine *eng, struct engine_req *er)
+{
+    ne_request *const req = er->req;
+    const char *doing;
+
+    engine_unwatch(eng, er);
+    use_conn(req);
+
+    switch (er->state) {
+    case ER_CONNECT: doing = connect_error(req->session); break;
+    case ER_WRITE: doing = _("Could not send request"); break;
+    case ER_HEAD: doing = _("Could not read status line"); break;
+    default: doing = _("Could not read response body"); break;
+    }
+
+    NE_DEBUG(NE_DBG_HTTP, "Request timed out in state %d.\n", er->state);
+    engine_finish(eng, er, aborted(req, doing, NE_SOCK_TIMEOUT));
+}
+
+/* Takes the next step for 'er', once its connection is ready. */
+static void engine_event(ne_engine *eng, struct engine_req *er)
+{
+    /* ignore requests which stopped polling since the wait. */
+    if (er->fd < 0) return;
+
+    use_conn(er->req);
+
+    switch (er->state) {
+    case ER_CONNECT: engine_connected(eng, er); break;
+    case ER_WRITE: engine_write(eng, er); break;
+    case ER_HEAD: engine_head(eng, er); break;
+    case ER_BODY: engine_body(eng, er); break;
+    default: break;
+    }
+}
+
+/* Waits until any of the connections being polled is ready, or the
+ * earliest request deadline, and takes the next step for each
+ * request which is ready, or has timed out; returns non-zero on
+ * error. */
+static int engine_poll(ne_engine *eng)
+{
+    struct engine_req *er;
+    double now = timestamp(), next = 0;
+    int n, ret, timeout;
+
+    for (er = eng->reqs; er; er = er->next) {
+        if (er->fd >= 0 && (next == 0 || er->deadline < next))
+            next = er->deadline;
+    }
+    timeout = next > now ? (int)((next - now) * 1000) + 1 : 0;
+
+#ifdef USE_EPOLL
+    if (eng->epfd >= 0) {
+        struct epoll_event evs[64];
+
+        do {
+            ret = epoll_wait(eng->epfd, evs, 64, timeout);
+        } while (ret < 0 && errno == EINTR);
+
+        for (n = 0; n < ret; n++)
+            engine_event(eng, evs[n].data.ptr);
+    } else
+#endif
+    {
+        struct pollfd *fds = ne_calloc((eng->count + 1) * sizeof *fds);
+        struct engine_req **ers = ne_calloc((eng->count + 1) * sizeof *ers);
+        int nfds = 0;
+
+        for (er = eng->reqs; er; er = er->next) {
+            if (er->fd >= 0) {
+                fds[nfds].fd = er->fd;
+                fds[nfds].events = er->writing ? POLLOUT : POLLIN;
+                ers[nfds++] = er;
+            }
+        }
+
+        do {
+            ret = poll(fds, nfds, timeout);
+        } while (ret < 0 && errno == EINTR);
+
+        for (n = 0; ret > 0 && n < nfds; n++) {
+            if (fds[n].revents)
+                engine_event(eng, ers[n]);
+        }
+
+        ne_free(fds);
+        ne_free(ers);
+    }
+
+    if (ret < 0) return 1;
+
+    now = timestamp();
+    for (er = eng->reqs; er; er = er->next) {
+        if (er->fd >= 0 && er->deadline <= now)
+            engine_expire(eng, er);
+    }
+
+    return 0;
+}
+
+/* Frees the state of 'er'. */
+static void engine_free(struct engine_req *er)
+{
+    if (er->head) ne_buffer_destroy(er->head);
+    if (er->block) ne_free(er->block);
+    ne_free(er);
+}
+
+int ne_engine_run(ne_engine *eng)
+{
+    while (eng->reqs) {
+        struct engine_req *er, **prev;
+        int waiting = 0;
+
+        /* start any new requests. */
+        for (er = eng->reqs; er; er = er->next) {
+            if (er->state == ER_START)
+                engine_start(eng, er);
+            if (er->fd >= 0)
+                waiting = 1;
+        }
+
+        if (waiting && engine_poll(eng))
+            return NE_ERROR;
+
+        /* Complete finished requests; the callbacks may dispatch
+         * more. */
+        for (prev = &eng->reqs; (er = *prev) != NULL; ) {
+            if (er->state == ER_DONE) {
+                *prev = er->next;
+                eng->count--;
+                NE_DEBUG(NE_DBG_HTTP | NE_DBG_FLUSH, 
+                         "Request ends, status %d class %dxx, error line:\n"
+                         "%s\n", er->req->status.code, 
+                         er->req->status.klass, er->req->session->error);
+                if (er->done)
+                    er->done(er->userdata, er->req, er->ret);
+                engine_free(er);
+            } else {
+                prev = &er->next;
+            }
+        }
+    }
+
+    return NE_OK;
+}
+
+void ne_engine_destroy(ne_engine *eng)
+{
+    while (eng->reqs) {
+        struct engine_req *er = eng->reqs;
+        ne_socket *sock = er->state != ER_DONE ? req_socket(er->req) : NULL;
+
+        /* the connection of a request which has not completed is
+         * left in blocking mode; it is closed when the request is
+         * destroyed. */
+        if (sock && ne_sock_fd(sock) >= 0) ne_sock_nonblock(sock, 0);
+        eng->reqs = er->next;
+        engine_free(er);
+    }
+#ifdef USE_EPOLL
+    if (eng->epfd >= 0) close(eng->epfd);
+#endif
+    ne_free(eng);
+}
@@ -180,6 +180,22 @@ void ne_print_request_header(ne_request *req, const char *name,
  * ne_get_status(). */
 int ne_request_dispatch(ne_request *req);
 
+/* ne_request_dispatch_pipeline: Dispatches the 'count' requests in
+ * 'reqs', which must all belong to the same session, using HTTP/1.1
+ * pipelining: requests are sent ahead of the responses to earlier
+ * requests, up to a limit on the number and total size of requests
+ * awaiting responses, and further requests are sent as each response
+ * is read.  Since the server may close the connection at any point, causing
+ * the remaining requests to be sent again, only idempotent requests
+ * should be pipelined.  Requests which cannot be pipelined (those
+ * using 100-continue), or for which no response is read before the
+ * connection is closed, or which must be retried (for instance, due
+ * to authentication), are dispatched in turn afterwards.  Returns
+ * NE_OK if every request was dispatched, otherwise the NE_* code
+ * for the first which failed, as for ne_request_dispatch, in which
+ * case the later requests may not have been dispatched. */
+int ne_request_dispatch_pipeline(ne_request **reqs, int count);
+
 /* Returns a pointer to the response status information for the given
  * request; pointer is valid until request object is destroyed. */
 const ne_status *ne_get_status(const ne_request *req) ne_attribute((const));
@@ -214,13 +230,27 @@ int ne_end_request(ne_request *req);
  */
 ssize_t ne_read_response_block(ne_request *req, char *buffer, size_t buflen);
 
+/* Read a block of the response without copying it: '*data' is set to
+ * point to the block, which is read-only and remains valid only until
+ * the next call on the request or its session.  The block is passed
+ * to the response body readers as for ne_read_response_block.
+ *
+ * Returns:
+ *  <0 - error, stop reading.
+ *   0 - end of response
+ *  >0 - length of the block.
+ */
+ssize_t ne_read_response_view(ne_request *req, const char **data);
+
 /* Read response blocks until end of response; exactly equivalent to
  * calling ne_read_response_block() until it returns 0.  Returns
  * non-zero on error. */
 int ne_discard_response(ne_request *req);
 
 /* Read response blocks until end of response, writing content to the
- * given file descriptor.  Returns NE_ERROR on error. */
+ * given file descriptor.  Where possible, the content is passed from
+ * the connection to the file without copying.  Returns NE_ERROR on
+ * error. */
 int ne_read_response_to_fd(ne_request *req, int fd);
 
 /* If 'flag' is non-zer, enable the HTTP/1.1 "Expect: 100-continue"
@@ -262,6 +292,33 @@ typedef int (*ne_post_send_fn)(ne_request *req, void *userdata,
 			       const ne_status *status);
 void ne_hook_post_send(ne_session *sess, ne_post_send_fn fn, void *userdata);
 
+/* Timing breakdown of a request: the time spent in each phase of
+ * the request, in seconds.  Phases which were not needed (e.g. the
+ * connection was already open) are zero. */
+typedef struct {
+    double lookup; /* hostname lookup */
+    double connect; /* TCP connection establishment */
+    double secure; /* SSL negotiation, including any proxy tunnel */
+    double send_headers; /* writing the request-line and headers */
+    double send_body; /* writing the request body */
+    double first_byte; /* waiting for the response status-line */
+    double read_headers; /* reading the response headers */
+    double read_body; /* reading the response body */
+    double total; /* from ne_begin_request until ne_end_request */
+} ne_request_timing;
+
+/* Returns the timing breakdown for the most recent attempt to send
+ * the request; the pointer is valid until the request object is
+ * destroyed. */
+const ne_request_timing *ne_get_request_timing(const ne_request *req);
+
+/* Hook called from ne_end_request, after the post_send hooks, with
+ * the timing breakdown for the request. */
+typedef void (*ne_timing_fn)(ne_request *req, void *userdata,
+                             const ne_request_timing *timing);
+void ne_hook_request_timing(ne_session *sess, ne_timing_fn fn, 
+                            void *userdata);
+
 /* Hook called when the function is destroyed. */
 typedef void (*ne_destroy_req_fn)(ne_request *req, void *userdata);
 void ne_hook_destroy_request(ne_session *sess,
@@ -277,6 +334,45 @@ void ne_hook_destroy_session(ne_session *sess,
 void ne_set_request_private(ne_request *req, const char *id, void *priv);
 void *ne_get_request_private(ne_request *req, const char *id);
 
+/* Request engine: an engine dispatches many requests at once, in one
+ * thread, across any number of sessions.  Requests in the same
+ * session use separate connections from the session's connection
+ * pool.
+ *
+ * Connections are used in non-blocking mode: each request is
+ * connected, written and its response read as the connection becomes
+ * ready, so a slow server delays only its own requests.  A request
+ * fails with NE_TIMEOUT if no progress is made on it for the
+ * session's read timeout (by default, 120 seconds).  The request body
+ * is sent without waiting for a 100-continue response.  Requests
+ * over SSL are not multiplexed: each is dispatched in turn, as by
+ * ne_request_dispatch. */
+typedef struct ne_engine_s ne_engine;
+
+/* Callback invoked when a request dispatched by an engine completes;
+ * 'ret' is the NE_* code, as would be returned by
+ * ne_request_dispatch.  The callback may dispatch further requests
+ * using the engine, and may destroy 'req'. */
+typedef void (*ne_engine_done_fn)(void *userdata, ne_request *req, int ret);
+
+/* Create an engine. */
+ne_engine *ne_engine_create(void);
+
+/* Add request 'req' to the engine; it is sent when ne_engine_run is
+ * next called (or, if it is running, on its next iteration).  The
+ * response body is passed to the request's body readers. */
+void ne_engine_dispatch(ne_engine *eng, ne_request *req,
+                        ne_engine_done_fn done, void *userdata);
+
+/* Runs the engine until every request dispatched has completed, and
+ * its callback has been invoked.  Returns NE_ERROR if waiting for
+ * responses failed, otherwise NE_OK. */
+int ne_engine_run(ne_engine *eng);
+
+/* Destroy an engine; requests which have not completed are
+ * forgotten. */
+void ne_engine_destroy(ne_engine *eng);
+
 END_NEON_DECLS
 
 #endif /* NE_REQUEST_H */
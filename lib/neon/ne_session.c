@@ -68,6 +68,7 @@ void ne_session_destroy(ne_session *sess)
     destroy_hooks(sess->create_req_hooks);
     destroy_hooks(sess->pre_send_hooks);
     destroy_hooks(sess->post_send_hooks);
+    destroy_hooks(sess->timing_hooks);
     destroy_hooks(sess->destroy_req_hooks);
     destroy_hooks(sess->destroy_sess_hooks);
     destroy_hooks(sess->private);
@@ -84,6 +85,14 @@ void ne_session_destroy(ne_session *sess)
 	ne_close_connection(sess);
     }
 
+    while (sess->idle) {
+        struct ne_conn *conn = sess->idle;
+        sess->idle = conn->next;
+        ne__close_conn(sess, conn);
+    }
+
+    if (sess->hdr_spare) ne_free(sess->hdr_spare);
+
 #ifdef NE_HAVE_SSL
     if (sess->ssl_context)
         ne_ssl_context_destroy(sess->ssl_context);
@@ -132,6 +141,8 @@ ne_session *ne_session_create(const char *scheme,
 
     strcpy(sess->error, "Unknown error.");
 
+    sess->max_idle = NE_DEFAULT_IDLE;
+
     /* use SSL if scheme is https */
     sess->use_ssl = !strcmp(scheme, "https");
     
@@ -198,6 +209,25 @@ void ne_set_read_timeout(ne_session *sess, int timeout)
     sess->rdtimeout = timeout;
 }
 
+void ne_set_read_bufsize(ne_session *sess, size_t size)
+{
+    sess->rdbufsize = size;
+}
+
+void ne_set_connection_limits(ne_session *sess, int max_conns, int max_idle)
+{
+    sess->max_conns = max_conns;
+    sess->max_idle = max_idle;
+
+    /* close any idle connections over the new limit. */
+    while (sess->nidle > max_idle) {
+        struct ne_conn *conn = sess->idle;
+        sess->idle = conn->next;
+        sess->nidle--;
+        ne__close_conn(sess, conn);
+    }
+}
+
 #define UAHDR "User-Agent: "
 #define AGENT " neon/" NEON_VERSION "\r\n"
 
@@ -235,13 +265,54 @@ const char *ne_get_error(ne_session *sess)
     return ne_strclean(sess->error);
 }
 
+/* Adds the byte counts for socket 'sock' to 'stats'. */
+static void add_iostats(ne_session_stats *stats, const ne_socket *sock)
+{
+    off_t nread, nwritten;
+
+    ne_sock_iostats(sock, &nread, &nwritten);
+    stats->received += nread;
+    stats->sent += nwritten;
+}
+
+void ne_get_session_stats(ne_session *sess, ne_session_stats *stats)
+{
+    struct ne_conn *conn;
+
+    *stats = sess->stats;
+
+    if (sess->connected)
+        add_iostats(stats, sess->socket);
+
+    for (conn = sess->idle; conn; conn = conn->next)
+        add_iostats(stats, conn->socket);
+
+    for (conn = sess->parked; conn; conn = conn->next)
+        add_iostats(stats, conn->socket);
+}
+
+/* Closes socket 'sock', which is one of the session's connections. */
+static void close_socket(ne_session *sess, ne_socket *sock)
+{
+    add_iostats(&sess->stats, sock);
+
+    NE_DEBUG(NE_DBG_SOCKET, "Closing connection.\n");
+    ne_sock_close(sock);
+    sess->nconns--;
+    NE_DEBUG(NE_DBG_SOCKET, "Connection closed.\n");
+}
+
+void ne__close_conn(ne_session *sess, struct ne_conn *conn)
+{
+    close_socket(sess, conn->socket);
+    ne_free(conn);
+}
+
 void ne_close_connection(ne_session *sess)
 {
     if (sess->connected) {
-	NE_DEBUG(NE_DBG_SOCKET, "Closing connection.\n");
-	ne_sock_close(sess->socket);
+        close_socket(sess, sess->socket);
 	sess->socket = NULL;
-	NE_DEBUG(NE_DBG_SOCKET, "Connection closed.\n");
     } else {
 	NE_DEBUG(NE_DBG_SOCKET, "(Not closing closed connection!).\n");
     }
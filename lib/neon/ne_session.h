@@ -88,6 +88,17 @@ typedef void (*ne_notify_status)(void *userdata,
 void ne_set_status(ne_session *sess,
 		   ne_notify_status status, void *userdata);
 
+/* I/O statistics for a session. */
+typedef struct {
+    unsigned long requests; /* number of requests sent */
+    off_t sent, received; /* number of bytes sent and received */
+} ne_session_stats;
+
+/* Retrieve the statistics accumulated over the lifetime of the
+ * session, across all connections: closed ones, and those which are
+ * active, idle or parked by a request. */
+void ne_get_session_stats(ne_session *sess, ne_session_stats *stats);
+
 /* Certificate verification failures.
  * The certificate is not yet valid: */
 #define NE_SSL_NOTYETVALID (0x01)
@@ -151,6 +162,26 @@ void ne_ssl_provide_clicert(ne_session *sess,
  * timeout value must be greater than zero. */
 void ne_set_read_timeout(ne_session *sess, int timeout);
 
+/* Set the size of the read buffer used for each connection; zero
+ * selects the default (64K).  The buffer holds response headers,
+ * chunk size lines and small reads; large response body reads bypass
+ * it, so its size mostly bounds how much of a header block or a run
+ * of small chunks can be taken from one read. */
+void ne_set_read_bufsize(ne_session *sess, size_t size);
+
+/* A session keeps a pool of connections to the server.  Whilst the
+ * response to one request is being read (using the "caller-pulls"
+ * interface, see ne_begin_request), further requests may be made
+ * using the same session, each using a separate connection.
+ * Persistent connections which are no longer in use are kept idle
+ * for reuse by later requests.
+ *
+ * Set the maximum number of connections which may be open at once
+ * (zero for no limit; the default), and the maximum number of idle
+ * connections (NE_DEFAULT_IDLE by default). */
+#define NE_DEFAULT_IDLE (4)
+void ne_set_connection_limits(ne_session *sess, int max_conns, int max_idle);
+
 /* Sets the user-agent string. neon/VERSION will be appended, to make
  * the full header "User-Agent: product neon/VERSION".
  * If this function is not called, the User-Agent header is not sent.
@@ -129,6 +129,24 @@ typedef struct in_addr ne_inet_addr;
 #define USE_CHECK_IPV6
 #endif
 
+/* sendfile() can be used to write directly from a file to a socket,
+ * and splice() to move data from a socket to a file through a pipe;
+ * only the Linux interfaces are supported. */
+#ifdef __linux__
+#define USE_SENDFILE
+#include <sys/sendfile.h>
+#ifdef _GNU_SOURCE /* for splice() */
+#define USE_SPLICE
+#include <fcntl.h>
+#endif
+#endif
+
+#ifndef WIN32
+#define USE_WRITEV
+#include <sys/uio.h>
+#include <fcntl.h> /* for O_NONBLOCK */
+#endif
+
 #include "ne_i18n.h"
 #include "ne_utils.h"
 #include "ne_string.h"
@@ -153,6 +171,8 @@ typedef struct in_addr ne_inet_addr;
                        (e) == WSAECONNRESET || (e) == WSAENETRESET)
 #define NE_ISCLOSED(e) ((e) == WSAESHUTDOWN || (e) == WSAENOTCONN)
 #define NE_ISINTR(e) (0)
+#define NE_ISAGAIN(e) ((e) == WSAEWOULDBLOCK)
+#define NE_ISINPROGRESS(e) ((e) == WSAEWOULDBLOCK)
 #else /* Unix */
 /* Also treat ECONNABORTED and ENOTCONN as "connection reset" errors;
  * both can be returned by Winsock-based sockets layers e.g. CygWin */
@@ -165,11 +185,22 @@ typedef struct in_addr ne_inet_addr;
 #define NE_ISRESET(e) ((e) == ECONNRESET || (e) == ECONNABORTED || (e) == ENOTCONN)
 #define NE_ISCLOSED(e) ((e) == EPIPE)
 #define NE_ISINTR(e) ((e) == EINTR)
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+#define NE_ISAGAIN(e) ((e) == EAGAIN || (e) == EWOULDBLOCK)
+#else
+#define NE_ISAGAIN(e) ((e) == EAGAIN)
+#endif
+#define NE_ISINPROGRESS(e) ((e) == EINPROGRESS)
 #endif
 
 /* Socket read timeout */
 #define SOCKET_READ_TIMEOUT 120
 
+/* Default and minimum size of the socket read buffer; reads of at
+ * least the minimum size bypass the buffer when it is empty. */
+#define DEF_RDBUFSIZ (65536)
+#define MIN_RDBUFSIZ (4096)
+
 /* Critical I/O functions on a socket: useful abstraction for easily
  * handling SSL I/O alongside raw socket I/O. */
 struct iofns {
@@ -182,6 +213,20 @@ struct iofns {
     /* Wait up to 'n' seconds for socket to become readable.  Returns
      * 0 when readable, otherwise NE_SOCK_TIMEOUT or NE_SOCK_ERROR. */
     int (*readable)(ne_socket *s, int n);
+    /* Write up to 'len' bytes from the current offset of file
+     * descriptor 'fd' to the socket.  Return number of bytes written
+     * on success, 0 if the file cannot be sent this way, or <0 on
+     * error.  May be NULL. */
+    ssize_t (*ssendfile)(ne_socket *s, int fd, size_t len);
+    /* Read up to 'len' bytes from the socket and write them to file
+     * descriptor 'fd'.  Return number of bytes written on success, 0
+     * if the data cannot be moved this way, or <0 on error.  May be
+     * NULL. */
+    ssize_t (*ssplice)(ne_socket *s, int fd, size_t len);
+    /* Write up to the total length of the 'count' blocks in 'vec' to
+     * the socket.  Return number of bytes written on success, or <0
+     * on error. */
+    ssize_t (*swritev)(ne_socket *s, const ne_iovec *vec, int count);
 };
 
 struct ne_socket_s {
@@ -189,6 +234,7 @@ struct ne_socket_s {
     char error[200];
     void *progress_ud;
     int rdtimeout; /* read timeout. */
+    int nonblock; /* non-zero if in non-blocking mode. */
     const struct iofns *ops;
 #ifdef NE_HAVE_SSL
     ne_ssl_socket ssl;
@@ -197,11 +243,16 @@ struct ne_socket_s {
      * these are consumed and passed back to the caller, bufpos
      * advances through ->buffer.  ->bufavail gives the number of
      * bytes which remain to be consumed in ->buffer (from ->bufpos),
-     * and is hence always <= RDBUFSIZ. */
-#define RDBUFSIZ 4096
-    char buffer[RDBUFSIZ];
+     * and is hence always <= ->bufsize. */
+    char *buffer;
+    size_t bufsize;
     char *bufpos;
     size_t bufavail;
+    /* number of bytes passed to and from the caller. */
+    off_t nread, nwritten;
+    /* pipe used to splice data from the socket, or -1 if not yet
+     * created. */
+    int pipefd[2];
 };
 
 /* ne_sock_addr represents an Internet address. */
@@ -392,13 +443,18 @@ ssize_t ne_sock_read(ne_socket *sock, char *buffer, size_t buflen)
 	memcpy(buffer, sock->bufpos, buflen);
 	sock->bufpos += buflen;
 	sock->bufavail -= buflen;
+	sock->nread += buflen;
 	return buflen;
-    } else if (buflen >= sizeof sock->buffer) {
-	/* No need for read buffer. */
-	return sock->ops->sread(sock, buffer, buflen);
+    } else if (buflen >= MIN_RDBUFSIZ) {
+	/* No need for read buffer: the caller's is large enough to
+	 * read into directly, whatever the size of ours. */
+	bytes = sock->ops->sread(sock, buffer, buflen);
+	if (bytes > 0)
+	    sock->nread += bytes;
+	return bytes;
     } else {
 	/* Fill read buffer. */
-	bytes = sock->ops->sread(sock, sock->buffer, sizeof sock->buffer);
+	bytes = sock->ops->sread(sock, sock->buffer, sock->bufsize);
 	if (bytes <= 0)
 	    return bytes;
 
@@ -407,6 +463,7 @@ ssize_t ne_sock_read(ne_socket *sock, char *buffer, size_t buflen)
 	memcpy(buffer, sock->buffer, buflen);
 	sock->bufpos = sock->buffer + buflen;
 	sock->bufavail = bytes - buflen;
+	sock->nread += buflen;
 	return buflen; 
     }
 }
@@ -420,7 +477,7 @@ ssize_t ne_sock_peek(ne_socket *sock, char *buffer, size_t buflen)
 	bytes = sock->bufavail;
     } else {
 	/* fill the buffer. */
-	bytes = sock->ops->sread(sock, sock->buffer, sizeof sock->buffer);
+	bytes = sock->ops->sread(sock, sock->buffer, sock->bufsize);
 	if (bytes <= 0)
 	    return bytes;
 
@@ -479,8 +536,10 @@ static ssize_t read_raw(ne_socket *sock, char *buffer, size_t len)
 {
     ssize_t ret;
     
-    ret = readable_raw(sock, sock->rdtimeout);
-    if (ret) return ret;
+    if (!sock->nonblock) {
+        ret = readable_raw(sock, sock->rdtimeout);
+        if (ret) return ret;
+    }
 
     do {
 	ret = recv(sock->fd, buffer, len, 0);
@@ -491,6 +550,7 @@ static ssize_t read_raw(ne_socket *sock, char *buffer, size_t len)
 	ret = NE_SOCK_CLOSED;
     } else if (ret < 0) {
 	int errnum = ne_errno;
+        if (NE_ISAGAIN(errnum)) return NE_SOCK_RETRY;
 	ret = NE_ISRESET(errnum) ? NE_SOCK_RESET : NE_SOCK_ERROR;
 	set_strerror(sock, errnum);
     }
@@ -498,8 +558,9 @@ static ssize_t read_raw(ne_socket *sock, char *buffer, size_t len)
     return ret;
 }
 
-#define MAP_ERR(e) (NE_ISCLOSED(e) ? NE_SOCK_CLOSED : \
-                    (NE_ISRESET(e) ? NE_SOCK_RESET : NE_SOCK_ERROR))
+#define MAP_ERR(e) (NE_ISAGAIN(e) ? NE_SOCK_RETRY : \
+                    (NE_ISCLOSED(e) ? NE_SOCK_CLOSED : \
+                     (NE_ISRESET(e) ? NE_SOCK_RESET : NE_SOCK_ERROR)))
 
 static ssize_t write_raw(ne_socket *sock, const char *data, size_t length) 
 {
@@ -517,7 +578,182 @@ static ssize_t write_raw(ne_socket *sock, const char *data, size_t length)
     return ret;
 }
 
-static const struct iofns iofns_raw = { read_raw, write_raw, readable_raw };
+#ifdef USE_SENDFILE
+static ssize_t sendfile_raw(ne_socket *sock, int fd, size_t length)
+{
+    ssize_t ret;
+
+    do {
+        ret = sendfile(sock->fd, fd, NULL, length);
+    } while (ret == -1 && NE_ISINTR(ne_errno));
+
+    if (ret < 0) {
+	int errnum = ne_errno;
+        /* the file does not support mmap-like operations. */
+        if (errnum == EINVAL || errnum == ENOSYS)
+            return 0;
+	set_strerror(sock, errnum);
+	return MAP_ERR(errnum);
+    }
+    return ret;
+}
+#else
+#define sendfile_raw (NULL)
+#endif
+
+#ifdef USE_SPLICE
+/* Write the 'len' bytes at 'data' to 'fd'.  Returns zero on success,
+ * or -1 on error, with errno set. */
+static int write_fd(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, data, len);
+
+        if (ret < 0 && !NE_ISINTR(ne_errno)) return -1;
+        if (ret > 0) {
+            data += ret;
+            len -= ret;
+        }
+    }
+    return 0;
+}
+
+/* Write 'len' bytes from the splice pipe of 'sock' to 'fd', copying
+ * through a buffer if 'fd' does not support splice().  Returns zero
+ * on success, or NE_SOCK_ERROR on error. */
+static int drain_pipe(ne_socket *sock, int fd, size_t len)
+{
+    int copy = 0;
+
+    while (len > 0) {
+        ssize_t ret;
+
+        if (!copy) {
+            ret = splice(sock->pipefd[0], NULL, fd, NULL, len, SPLICE_F_MOVE);
+            if (ret == -1 && ne_errno == EINVAL) {
+                copy = 1;
+                continue;
+            }
+        } else {
+            char buffer[8192];
+
+            ret = read(sock->pipefd[0], buffer,
+                       len > sizeof buffer ? sizeof buffer : len);
+            if (ret > 0 && write_fd(fd, buffer, ret))
+                ret = -1;
+        }
+
+        if (ret < 0 && NE_ISINTR(ne_errno)) {
+            continue;
+        } else if (ret <= 0) {
+            set_strerror(sock, ne_errno);
+            return NE_SOCK_ERROR;
+        }
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static ssize_t splice_raw(ne_socket *sock, int fd, size_t length)
+{
+    ssize_t ret;
+
+    if (sock->pipefd[0] == -1 && pipe(sock->pipefd)) {
+        sock->pipefd[0] = sock->pipefd[1] = -1;
+        return 0;
+    }
+
+    if (!sock->nonblock) {
+        ret = readable_raw(sock, sock->rdtimeout);
+        if (ret) return ret;
+    }
+
+    do {
+        ret = splice(sock->fd, NULL, sock->pipefd[1], NULL, length,
+                     SPLICE_F_MOVE);
+    } while (ret == -1 && NE_ISINTR(ne_errno));
+
+    if (ret == 0) {
+        set_error(sock, _("Connection closed"));
+        return NE_SOCK_CLOSED;
+    } else if (ret < 0) {
+	int errnum = ne_errno;
+        /* splice() is not supported for this socket. */
+        if (errnum == EINVAL || errnum == ENOSYS)
+            return 0;
+	set_strerror(sock, errnum);
+	return MAP_ERR(errnum);
+    }
+
+    return drain_pipe(sock, fd, ret) ? NE_SOCK_ERROR : ret;
+}
+#else
+#define splice_raw (NULL)
+#endif
+
+#ifdef USE_WRITEV
+/* Maximum number of blocks passed to writev() at once. */
+#define MAX_IOV (16)
+
+static ssize_t writev_raw(ne_socket *sock, const ne_iovec *vec, int count)
+{
+    struct iovec iov[MAX_IOV];
+    ssize_t ret;
+    int n;
+
+    if (count > MAX_IOV) count = MAX_IOV;
+
+    for (n = 0; n < count; n++) {
+        iov[n].iov_base = (void *)vec[n].base;
+        iov[n].iov_len = vec[n].len;
+    }
+
+    do {
+        ret = writev(sock->fd, iov, count);
+    } while (ret == -1 && NE_ISINTR(ne_errno));
+
+    if (ret < 0) {
+	int errnum = ne_errno;
+	set_strerror(sock, errnum);
+	return MAP_ERR(errnum);
+    }
+    return ret;
+}
+#else
+#define writev_raw (NULL)
+#endif
+
+static const struct iofns iofns_raw = {
+    read_raw, write_raw, readable_raw, sendfile_raw, splice_raw, writev_raw
+};
+
+#ifdef NE_HAVE_SSL
+/* Largest amount of data which is coalesced into a single SSL
+ * record; the maximum record size. */
+#define COALESCE_SIZE (16384)
+
+/* Write a vector to an SSL socket: blocks which fit together in a
+ * single record are copied into one buffer and written at once,
+ * otherwise the first block is written alone. */
+static ssize_t writev_coalesce(ne_socket *sock, const ne_iovec *vec,
+                               int count)
+{
+    char buffer[COALESCE_SIZE];
+    size_t len = 0;
+    int n;
+
+    for (n = 0; n < count && len + vec[n].len <= sizeof buffer; n++) {
+        memcpy(buffer + len, vec[n].base, vec[n].len);
+        len += vec[n].len;
+    }
+
+    if (n < 2)
+        return sock->ops->swrite(sock, vec[0].base, vec[0].len);
+    else
+        return sock->ops->swrite(sock, buffer, len);
+}
+#endif
 
 #ifdef HAVE_OPENSSL
 /* OpenSSL I/O function implementations. */
@@ -601,7 +837,10 @@ static ssize_t write_ossl(ne_socket *sock, const char *data, size_t len)
 static const struct iofns iofns_ssl = {
     read_ossl,
     write_ossl,
-    readable_ossl
+    readable_ossl,
+    NULL,
+    NULL,
+    writev_coalesce
 };
 
 #elif defined(HAVE_GNUTLS)
@@ -691,7 +930,10 @@ static ssize_t write_gnutls(ne_socket *sock, const char *data, size_t len)
 static const struct iofns iofns_ssl = {
     read_gnutls,
     write_gnutls,
-    readable_gnutls
+    readable_gnutls,
+    NULL,
+    NULL,
+    writev_coalesce
 };
 
 #endif
@@ -705,19 +947,118 @@ int ne_sock_fullwrite(ne_socket *sock, const char *data, size_t len)
         if (ret > 0) {
             data += ret;
             len -= ret;
+            sock->nwritten += ret;
         }
     } while (ret > 0 && len > 0);
 
     return ret < 0 ? ret : 0;
 }
 
+int ne_sock_fullwritev(ne_socket *sock, const ne_iovec *vector, int count)
+{
+    ssize_t ret;
+
+    if (sock->ops->swritev == NULL) {
+        for (ret = 0; ret == 0 && count > 0; vector++, count--)
+            ret = ne_sock_fullwrite(sock, vector->base, vector->len);
+        return ret;
+    }
+
+    while (count > 0) {
+        ret = sock->ops->swritev(sock, vector, count);
+        if (ret < 0) return ret;
+
+        sock->nwritten += ret;
+
+        /* skip past the blocks which were written completely. */
+        while (count > 0 && (size_t)ret >= vector->len) {
+            ret -= vector->len;
+            vector++;
+            count--;
+        }
+
+        /* finish writing a block which was written in part. */
+        if (ret > 0) {
+            ret = ne_sock_fullwrite(sock, (const char *)vector->base + ret,
+                                    vector->len - ret);
+            if (ret < 0) return ret;
+            vector++;
+            count--;
+        }
+    }
+
+    return 0;
+}
+
+ssize_t ne_sock_writev(ne_socket *sock, const ne_iovec *vector, int count)
+{
+    ssize_t ret;
+
+    if (sock->ops->swritev == NULL)
+        ret = sock->ops->swrite(sock, vector->base, vector->len);
+    else
+        ret = sock->ops->swritev(sock, vector, count);
+
+    if (ret > 0)
+        sock->nwritten += ret;
+    return ret;
+}
+
+ssize_t ne_sock_sendfile(ne_socket *sock, int fd, size_t len)
+{
+    char buffer[8192];
+    ssize_t ret;
+
+    if (sock->ops->ssendfile) {
+        ret = sock->ops->ssendfile(sock, fd, len);
+        if (ret > 0) {
+            sock->nwritten += ret;
+            return ret;
+        } else if (ret < 0) {
+            return ret;
+        }
+        /* otherwise, fall back on read and write. */
+    }
+
+    if (len > sizeof buffer) len = sizeof buffer;
+
+    do {
+        ret = read(fd, buffer, len);
+    } while (ret == -1 && NE_ISINTR(ne_errno));
+
+    if (ret < 0) {
+        set_strerror(sock, ne_errno);
+        return NE_SOCK_ERROR;
+    } else if (ret == 0) {
+        set_error(sock, _("Unexpected end of file"));
+        return NE_SOCK_ERROR;
+    }
+
+    len = ret;
+    ret = ne_sock_fullwrite(sock, buffer, len);
+    return ret < 0 ? ret : (ssize_t)len;
+}
+
+ssize_t ne_sock_splice(ne_socket *sock, int fd, size_t len)
+{
+    ssize_t ret;
+
+    if (sock->bufavail || !sock->ops->ssplice)
+        return 0;
+
+    ret = sock->ops->ssplice(sock, fd, len);
+    if (ret > 0)
+        sock->nread += ret;
+    return ret;
+}
+
 ssize_t ne_sock_readline(ne_socket *sock, char *buf, size_t buflen)
 {
     char *lf;
     size_t len;
     
     if ((lf = memchr(sock->bufpos, '\n', sock->bufavail)) == NULL
-	&& sock->bufavail < RDBUFSIZ) {
+	&& sock->bufavail < sock->bufsize) {
 	/* The buffered data does not contain a complete line: move it
 	 * to the beginning of the buffer. */
 	if (sock->bufavail)
@@ -729,11 +1070,11 @@ ssize_t ne_sock_readline(ne_socket *sock, char *buf, size_t buflen)
 	do {
 	    /* Read more data onto end of buffer. */
 	    ssize_t ret = sock->ops->sread(sock, sock->buffer + sock->bufavail,
-                                           RDBUFSIZ - sock->bufavail);
+                                           sock->bufsize - sock->bufavail);
 	    if (ret < 0) return ret;
 	    sock->bufavail += ret;
 	} while ((lf = memchr(sock->buffer, '\n', sock->bufavail)) == NULL
-		 && sock->bufavail < RDBUFSIZ);
+		 && sock->bufavail < sock->bufsize);
     }
 
     if (lf)
@@ -751,9 +1092,107 @@ ssize_t ne_sock_readline(ne_socket *sock, char *buf, size_t buflen)
     /* consume the line from buffer: */
     sock->bufavail -= len;
     sock->bufpos += len;
+    sock->nread += len;
     return len;
 }
 
+/* Returns a pointer past the first empty line (LF or CRLF) in the
+ * 'len' bytes at 'buf', scanning from offset '*scanned', which is at
+ * the start of a line; or NULL if there is no complete empty line, in
+ * which case '*scanned' is set to the offset of the start of the last
+ * (incomplete) line, where a later scan can resume. */
+static char *find_empty_line(char *buf, size_t len, size_t *scanned)
+{
+    char *end = buf + len, *line = buf + *scanned, *lf;
+
+    for (;;) {
+        if (line < end && line[0] == '\n')
+            return line + 1;
+        if (line + 1 < end && line[0] == '\r' && line[1] == '\n')
+            return line + 2;
+        
+        lf = memchr(line, '\n', end - line);
+        if (lf == NULL)
+            break;
+        line = lf + 1;
+    }
+
+    *scanned = line - buf;
+    return NULL;
+}
+
+ssize_t ne_sock_fill(ne_socket *sock)
+{
+    ssize_t ret;
+
+    if (sock->bufavail == sock->bufsize)
+        return 0;
+
+    /* Move the buffered data to the beginning of the buffer, and read
+     * more data onto the end. */
+    if (sock->bufpos != sock->buffer) {
+        if (sock->bufavail)
+            memmove(sock->buffer, sock->bufpos, sock->bufavail);
+        sock->bufpos = sock->buffer;
+    }
+
+    ret = sock->ops->sread(sock, sock->buffer + sock->bufavail,
+                           sock->bufsize - sock->bufavail);
+    if (ret > 0)
+        sock->bufavail += ret;
+    return ret;
+}
+
+ssize_t ne_sock_readblock(ne_socket *sock, char **block)
+{
+    char *end;
+    size_t len, scanned = 0;
+
+    /* 'scanned' is relative to bufpos, so remains valid when the
+     * buffered data is moved by ne_sock_fill. */
+    while ((end = find_empty_line(sock->bufpos, sock->bufavail,
+                                  &scanned)) == NULL) {
+        ssize_t ret = ne_sock_fill(sock);
+
+        if (ret == 0)
+            return 0; /* the block will not fit in the buffer */
+        else if (ret < 0)
+            return ret;
+    }
+
+    len = end - sock->bufpos;
+    *block = sock->bufpos;
+    sock->bufavail -= len;
+    sock->bufpos += len;
+    sock->nread += len;
+    return len;
+}
+
+ssize_t ne_sock_peekbuf(ne_socket *sock, const char **data)
+{
+    if (sock->bufavail == 0) {
+        /* fill the buffer. */
+        ssize_t bytes = sock->ops->sread(sock, sock->buffer, sock->bufsize);
+        if (bytes <= 0)
+            return bytes;
+
+        sock->bufpos = sock->buffer;
+        sock->bufavail = bytes;
+    }
+
+    *data = sock->bufpos;
+    return sock->bufavail;
+}
+
+void ne_sock_consume(ne_socket *sock, size_t count)
+{
+    if (count > sock->bufavail)
+        count = sock->bufavail;
+    sock->bufpos += count;
+    sock->bufavail -= count;
+    sock->nread += count;
+}
+
 ssize_t ne_sock_fullread(ne_socket *sock, char *buffer, size_t buflen) 
 {
     ssize_t len;
@@ -972,14 +1411,16 @@ ne_socket *ne_sock_create(void)
 {
     ne_socket *sock = ne_calloc(sizeof *sock);
     sock->rdtimeout = SOCKET_READ_TIMEOUT;
-    sock->bufpos = sock->buffer;
+    sock->bufsize = DEF_RDBUFSIZ;
+    sock->bufpos = sock->buffer = ne_malloc(sock->bufsize);
     sock->ops = &iofns_raw;
-    sock->fd = -1;
+    sock->fd = sock->pipefd[0] = sock->pipefd[1] = -1;
     return sock;
 }
 
-int ne_sock_connect(ne_socket *sock,
-                    const ne_inet_addr *addr, unsigned int port)
+/* Creates a TCP socket for connecting to address 'addr'; returns
+ * the descriptor, or -1 on error, setting the socket error. */
+static int create_socket(ne_socket *sock, const ne_inet_addr *addr)
 {
     int fd;
 
@@ -999,7 +1440,7 @@ int ne_sock_connect(ne_socket *sock,
     if (fd > FD_SETSIZE) {
         ne_close(fd);
         set_error(sock, _("Socket descriptor number exceeds FD_SETSIZE"));
-        return NE_SOCK_ERROR;
+        return -1;
     }
 #endif
 
@@ -1011,6 +1452,16 @@ int ne_sock_connect(ne_socket *sock,
     }
 #endif
 
+    return fd;
+}
+
+int ne_sock_connect(ne_socket *sock,
+                    const ne_inet_addr *addr, unsigned int port)
+{
+    int fd = create_socket(sock, addr);
+
+    if (fd < 0) return NE_SOCK_ERROR;
+
     if (raw_connect(fd, addr, htons(port))) {
         set_strerror(sock, ne_errno);
 	ne_close(fd);
@@ -1021,6 +1472,57 @@ int ne_sock_connect(ne_socket *sock,
     return 0;
 }
 
+int ne_sock_connect_start(ne_socket *sock,
+                          const ne_inet_addr *addr, unsigned int port)
+{
+    int fd = create_socket(sock, addr);
+
+    if (fd < 0) return NE_SOCK_ERROR;
+
+    sock->fd = fd;
+    if (ne_sock_nonblock(sock, 1)) {
+        ne_close(fd);
+        sock->fd = -1;
+        return NE_SOCK_ERROR;
+    }
+
+    if (raw_connect(fd, addr, htons(port))) {
+        int errnum = ne_errno;
+
+        if (NE_ISINPROGRESS(errnum))
+            return NE_SOCK_RETRY;
+
+        set_strerror(sock, errnum);
+	ne_close(fd);
+        sock->fd = -1;
+	return NE_SOCK_ERROR;
+    }
+
+    return 0;
+}
+
+int ne_sock_connect_finish(ne_socket *sock)
+{
+    int errnum = 0;
+#ifdef WIN32
+    int len = sizeof errnum;
+#else
+    socklen_t len = sizeof errnum;
+#endif
+
+    if (getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, (void *)&errnum, &len))
+        errnum = ne_errno;
+
+    if (errnum) {
+        set_strerror(sock, errnum);
+        ne_close(sock->fd);
+        sock->fd = -1;
+        return NE_SOCK_ERROR;
+    }
+
+    return 0;
+}
+
 ne_inet_addr *ne_iaddr_make(ne_iaddr_type type, const unsigned char *raw)
 {
     ne_inet_addr *ia;
@@ -1112,11 +1614,67 @@ int ne_sock_fd(const ne_socket *sock)
     return sock->fd;
 }
 
+int ne_sock_pending(const ne_socket *sock)
+{
+    return sock->bufavail > 0;
+}
+
+int ne_sock_nonblock(ne_socket *sock, int flag)
+{
+#ifdef WIN32
+    u_long arg = flag;
+#else
+    int flags;
+#endif
+
+    if (sock->ops != &iofns_raw) {
+        set_error(sock, _("Non-blocking mode is not supported for "
+                          "secure connections"));
+        return NE_SOCK_ERROR;
+    }
+
+#ifdef WIN32
+    if (ioctlsocket(sock->fd, FIONBIO, &arg)) {
+#else
+    flags = fcntl(sock->fd, F_GETFL);
+    if (flags == -1
+        || fcntl(sock->fd, F_SETFL,
+                 flag ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == -1) {
+#endif
+        set_strerror(sock, ne_errno);
+        return NE_SOCK_ERROR;
+    }
+
+    sock->nonblock = flag;
+    return 0;
+}
+
 void ne_sock_read_timeout(ne_socket *sock, int timeout)
 {
     sock->rdtimeout = timeout;
 }
 
+int ne_sock_read_bufsize(ne_socket *sock, size_t size)
+{
+    char *buffer;
+
+    if (size < MIN_RDBUFSIZ)
+        size = MIN_RDBUFSIZ;
+
+    if (size < sock->bufavail)
+        return -1;
+
+    /* preserve any data which has not yet been consumed. */
+    buffer = ne_malloc(size);
+    if (sock->bufavail)
+        memcpy(buffer, sock->bufpos, sock->bufavail);
+    ne_free(sock->buffer);
+
+    sock->bufpos = sock->buffer = buffer;
+    sock->bufsize = size;
+    return 0;
+}
+
 #ifdef NE_HAVE_SSL
 
 int ne_sock_accept_ssl(ne_socket *sock, ne_ssl_context *ctx)
@@ -1216,6 +1774,12 @@ ne_ssl_socket ne__sock_sslsock(ne_socket *sock)
 
 #endif
 
+void ne_sock_iostats(const ne_socket *sock, off_t *nread, off_t *nwritten)
+{
+    *nread = sock->nread;
+    *nwritten = sock->nwritten;
+}
+
 const char *ne_sock_error(const ne_socket *sock)
 {
     return sock->error;
@@ -1240,10 +1804,16 @@ int ne_sock_close(ne_socket *sock)
     }
 #endif
 
+    if (sock->pipefd[0] != -1) {
+        close(sock->pipefd[0]);
+        close(sock->pipefd[1]);
+    }
+
     if (sock->fd < 0)
         ret = 0;
     else
         ret = ne_close(sock->fd);
+    ne_free(sock->buffer);
     ne_free(sock);
     return ret;
 }
@@ -38,6 +38,8 @@ BEGIN_NEON_DECLS
 #define NE_SOCK_RESET (-4)
 /* Secure connection was closed without proper SSL shutdown. */
 #define NE_SOCK_TRUNC (-5)
+/* Operation would block; returned only in non-blocking mode. */
+#define NE_SOCK_RETRY (-6)
 
 /* ne_socket represents a TCP socket. */
 typedef struct ne_socket_s ne_socket;
@@ -120,6 +122,27 @@ ne_socket *ne_sock_create(void);
 int ne_sock_connect(ne_socket *sock, const ne_inet_addr *addr, 
                     unsigned int port);
 
+/* Start to connect the socket to server at address 'addr' on port
+ * 'port' without waiting; the socket is placed in non-blocking mode.
+ * Returns 0 if the connection was established at once, NE_SOCK_RETRY
+ * if it is in progress, in which case ne_sock_connect_finish must be
+ * called once the descriptor is writable, or NE_SOCK_* on error. */
+int ne_sock_connect_start(ne_socket *sock, const ne_inet_addr *addr,
+                          unsigned int port);
+
+/* Complete a connection started by ne_sock_connect_start, once the
+ * descriptor is writable.  Returns 0 if the connection was
+ * established, otherwise NE_SOCK_ERROR. */
+int ne_sock_connect_finish(ne_socket *sock);
+
+/* Place the socket in non-blocking mode if 'flag' is non-zero,
+ * otherwise in blocking mode.  In non-blocking mode, reads and writes
+ * do not wait for the socket, or for the read timeout, and return
+ * NE_SOCK_RETRY if they would block.  Returns non-zero if the mode
+ * could not be changed; non-blocking mode is not supported for SSL
+ * sockets. */
+int ne_sock_nonblock(ne_socket *sock, int flag);
+
 /* ne_sock_read reads up to 'count' bytes into 'buffer'.
  * Returns:
  *   NE_SOCK_* on error,
@@ -136,6 +159,20 @@ ssize_t ne_sock_read(ne_socket *sock, char *buffer, size_t count);
  */
 ssize_t ne_sock_peek(ne_socket *sock, char *buffer, size_t count);
 
+/* ne_sock_peekbuf sets '*data' to point to the data in the socket
+ * read buffer, first reading into the buffer if it is empty.  The
+ * data remains valid, and will be returned by subsequent reads,
+ * until it is consumed using ne_sock_consume or another operation on
+ * the socket.
+ * Returns:
+ *   NE_SOCK_* on error,
+ *   >0 length of the data at '*data'.
+ */
+ssize_t ne_sock_peekbuf(ne_socket *sock, const char **data);
+
+/* Consume 'count' bytes of the data returned by ne_sock_peekbuf. */
+void ne_sock_consume(ne_socket *sock, size_t count);
+
 /* Block for up to 'n' seconds until data becomes available for reading
  * on the socket. Returns:
  *  NE_SOCK_* on error,
@@ -148,6 +185,41 @@ int ne_sock_block(ne_socket *sock, int n);
  * Returns 0 on success, NE_SOCK_* on error. */
 int ne_sock_fullwrite(ne_socket *sock, const char *data, size_t count); 
 
+/* Writes up to 'count' bytes to the socket, read from the current
+ * offset of file descriptor 'fd'; the file offset is advanced by the
+ * number of bytes written.  Where possible the data is passed
+ * directly from the file to the socket without copying.  Returns the
+ * (non-zero) number of bytes written, or NE_SOCK_* on error; reaching
+ * end-of-file is an error. */
+ssize_t ne_sock_sendfile(ne_socket *sock, int fd, size_t count);
+
+/* Reads up to 'count' bytes from the socket and writes them to file
+ * descriptor 'fd', passing the data directly from the socket to the
+ * file without copying.  This is not possible for an SSL socket, or
+ * if data has been read into the socket's read buffer and not yet
+ * consumed.  Returns the number of bytes written, zero if the data
+ * cannot be passed this way, or NE_SOCK_* on error; the error string
+ * describes any failure to write to the file. */
+ssize_t ne_sock_splice(ne_socket *sock, int fd, size_t count);
+
+/* A block of data to be written by ne_sock_fullwritev. */
+typedef struct {
+    const void *base;
+    size_t len;
+} ne_iovec;
+
+/* Writes the 'count' blocks of data described by 'vector' to the
+ * socket, in order.  Where possible the blocks are written using a
+ * single system call (or, for an SSL socket, a single record).
+ * Returns 0 on success, NE_SOCK_* on error. */
+int ne_sock_fullwritev(ne_socket *sock, const ne_iovec *vector, int count);
+
+/* Writes some or all of the 'count' blocks of data described by
+ * 'vector' to the socket, in order, with a single system call (or,
+ * for an SSL socket, a single record).  Returns the (non-zero) number
+ * of bytes written, or NE_SOCK_* on error. */
+ssize_t ne_sock_writev(ne_socket *sock, const ne_iovec *vector, int count);
+
 /* Reads an LF-terminated line into 'buffer', and NUL-terminate it.
  * At most 'len' bytes are read (including the NUL terminator).
  * Returns:
@@ -156,6 +228,28 @@ int ne_sock_fullwrite(ne_socket *sock, const char *data, size_t count);
  */
 ssize_t ne_sock_readline(ne_socket *sock, char *buffer, size_t len);
 
+/* Reads a block of lines which ends with an empty line, such as an
+ * HTTP message header block, without copying it out of the read
+ * buffer.  On success, '*block' is set to point to the block, which
+ * may be modified by the caller and remains valid until the next
+ * operation on the socket.
+ * Returns:
+ * NE_SOCK_* on error,
+ * 0 if the block cannot fit in the read buffer; nothing is consumed,
+ * >0 length of the block, including the empty line.
+ */
+ssize_t ne_sock_readblock(ne_socket *sock, char **block);
+
+/* Reads more data into the read buffer with a single read, after any
+ * data already buffered, without consuming anything; the buffered
+ * data can then be examined using ne_sock_peekbuf.
+ * Returns:
+ * NE_SOCK_* on error,
+ * 0 if the read buffer is full,
+ * >0 number of bytes read.
+ */
+ssize_t ne_sock_fill(ne_socket *sock);
+
 /* Read exactly 'len' bytes into buffer; returns 0 on success,
  * NE_SOCK_* on error. */
 ssize_t ne_sock_fullread(ne_socket *sock, char *buffer, size_t len);
@@ -166,16 +260,33 @@ int ne_sock_accept(ne_socket *sock, int fd);
 /* Returns the file descriptor used for socket 'sock'. */
 int ne_sock_fd(const ne_socket *sock);
 
+/* Returns non-zero if data has been read from the socket into the
+ * read buffer which has not yet been consumed; such data will not be
+ * signalled by polling the socket's file descriptor. */
+int ne_sock_pending(const ne_socket *sock);
+
 /* Close the socket, and destroy the socket object. Returns non-zero
  * on error. */
 int ne_sock_close(ne_socket *sock);
 
+/* Retrieve the number of bytes which have been read from and
+ * written to the socket since it was created. */
+void ne_sock_iostats(const ne_socket *sock, off_t *nread, off_t *nwritten);
+
 /* Return current error string for socket. */
 const char *ne_sock_error(const ne_socket *sock);
 
 /* Set read timeout for socket. */
 void ne_sock_read_timeout(ne_socket *sock, int timeout);
 
+/* Set the size of the socket read buffer; sizes less than 4096 bytes
+ * are rounded up.  The buffer holds data for ne_sock_readline,
+ * ne_sock_readblock and reads of less than 4096 bytes; whatever its
+ * size, larger reads made whilst it is empty go directly into the
+ * caller's buffer.  Returns non-zero if the buffer currently holds
+ * more than 'size' bytes of unread data. */
+int ne_sock_read_bufsize(ne_socket *sock, size_t size);
+
 /* Negotiate an SSL connection on socket as an SSL server, using given
  * SSL context. */
 int ne_sock_accept_ssl(ne_socket *sock, ne_ssl_context *ctx);
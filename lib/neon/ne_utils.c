@@ -27,6 +27,17 @@
 #include <string.h>
 #endif
 
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <time.h>
 #include <stdio.h>
 #include <ctype.h> /* isdigit() for ne_parse_statusline */
 
@@ -52,12 +63,321 @@
 #include "ne_utils.h"
 #include "ne_string.h" /* for ne_strdup */
 #include "ne_dates.h"
+#include "ne_alloc.h"
+
+#if defined(__GNUC__) && defined(HAVE_PTHREAD)
+#define USE_DEBUG_RING
+#include <pthread.h>
+#endif
 
 int ne_debug_mask = 0;
 FILE *ne_debug_stream = NULL;
 
+/* Rate limits for each debug channel: at most 'rate' messages are
+ * logged in each second; the remainder are counted in 'dropped'.
+ * The counters may be updated by several threads at once, so are
+ * updated atomically where the compiler allows. */
+static struct {
+    unsigned int rate;
+    volatile unsigned int count;
+    volatile unsigned long dropped;
+    volatile time_t window;
+} limits[32];
+
+#ifdef __GNUC__
+#define DBG_INC(x) __sync_fetch_and_add(&(x), 1)
+#define DBG_TAKE(x, old) ((old) = __sync_lock_test_and_set(&(x), 0))
+#define DBG_CAS(x, o, n) __sync_bool_compare_and_swap(&(x), (o), (n))
+#else
+#define DBG_INC(x) ((x)++)
+#define DBG_TAKE(x, old) ((old) = (x), (x) = 0)
+#define DBG_CAS(x, o, n) ((x) == (o) ? ((x) = (n), 1) : 0)
+#endif
+
+/* The set of channels which are rate-limited. */
+static int debug_limited;
+
+static void log_all_suppressed(void);
+
+#ifdef USE_DEBUG_RING
+
+/* Asynchronous debugging.  Each message is formatted by the caller
+ * into a record in a ring buffer, and written out to the debug stream
+ * by a background thread.  Space for a record is reserved by
+ * compare-and-swap on 'head', so callers never wait for each other or
+ * for the stream; the size field of the record header is written last,
+ * marking the record complete.  If the ring is full, the message is
+ * dropped, and counted.  The consumer zeroes each record once written
+ * out, so free space in the ring always reads as zero. */
+
+struct dbg_record {
+    volatile unsigned int size; /* size in ring; zero until complete */
+    unsigned int length; /* length of message; zero for padding */
+    unsigned int channel; /* channel number */
+    unsigned int usec;
+    unsigned long sec;
+};
+
+#define RECORD_ALIGN (8)
+#define RECORD_SIZE(n) ((sizeof(struct dbg_record) + (n) + RECORD_ALIGN - 1) \
+                        & ~(unsigned long)(RECORD_ALIGN - 1))
+
+/* Size of the output buffer used by the flusher thread. */
+#define FLUSH_BUFSIZ (16384)
+
+/* How often the flusher thread wakes up, in milliseconds. */
+#define FLUSH_INTERVAL (50)
+
+static struct {
+    char *data; /* non-NULL if the ring is in use */
+    unsigned long size, mask;
+    volatile unsigned long head, tail;
+    volatile unsigned long dropped;
+    unsigned int flags;
+    int stop;
+    pthread_t thread;
+} ring;
+
+/* ring_lock is held by whichever thread is writing out records. */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_wake = PTHREAD_COND_INITIALIZER;
+
+/* Append a record for a message of 'len' bytes on channel 'n' to the
+ * ring. */
+static void ring_append(int n, const char *msg, size_t len)
+{
+    unsigned long head, off, pad, need, used;
+    struct dbg_record *rec;
+    struct timeval tv;
+
+    if (len > ring.size / 4) len = ring.size / 4;
+    need = RECORD_SIZE(len);
+
+    do {
+        head = ring.head;
+        off = head & ring.mask;
+        /* records never wrap; pad out the end of the ring. */
+        pad = off + need > ring.size ? ring.size - off : 0;
+        used = head + pad + need - ring.tail;
+        if (used > ring.size) {
+            __sync_fetch_and_add(&ring.dropped, 1);
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&ring.head, head, 
+                                           head + pad + need));
+
+    if (pad) {
+        rec = (struct dbg_record *)(ring.data + off);
+        rec->length = 0;
+        __sync_synchronize();
+        rec->size = pad;
+        off = 0;
+    }
+
+    rec = (struct dbg_record *)(ring.data + off);
+    gettimeofday(&tv, NULL);
+    rec->length = len;
+    rec->channel = n;
+    rec->sec = tv.tv_sec;
+    rec->usec = tv.tv_usec;
+    memcpy(rec + 1, msg, len);
+    __sync_synchronize();
+    rec->size = need;
+
+    /* wake the flusher early once the ring is half full. */
+    if (used >= ring.size / 2 && used - pad - need < ring.size / 2)
+        pthread_cond_signal(&ring_wake);
+}
+
+/* Store 'value' in 'len' bytes at 'p', in network byte order. */
+static void put_bytes(unsigned char *p, unsigned long value, int len)
+{
+    while (len-- > 0) {
+        p[len] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/* Write out all complete records in the ring to the debug stream;
+ * ring_lock must be held. */
+static void ring_drain(void)
+{
+    char out[FLUSH_BUFSIZ];
+    size_t used = 0;
+    unsigned long dropped;
+
+    for (;;) {
+        struct dbg_record *rec = (struct dbg_record *)
+            (ring.data + (ring.tail & ring.mask));
+        unsigned int size = rec->size, len;
+        const char *msg = (const char *)(rec + 1);
+
+        if (size == 0) break;
+        __sync_synchronize();
+
+        len = rec->length;
+        if (ring.flags & NE_DEBUG_BINARY) {
+            if (len > 0xffff) len = 0xffff;
+            if (used + 12 > sizeof out) {
+                fwrite(out, used, 1, ne_debug_stream);
+                used = 0;
+            }
+            /* see ne_debug_decode for the record format. */
+            if (len) {
+                unsigned char *p = (unsigned char *)out + used;
+                p[0] = '\0';
+                p[1] = rec->channel;
+                put_bytes(p + 2, len, 2);
+                put_bytes(p + 4, rec->sec, 4);
+                put_bytes(p + 8, rec->usec, 4);
+                used += 12;
+            }
+        }
+
+        if (used + len > sizeof out) {
+            fwrite(out, used, 1, ne_debug_stream);
+            used = 0;
+        }
+        if (len > sizeof out) {
+            fwrite(msg, len, 1, ne_debug_stream);
+        } else {
+            memcpy(out + used, msg, len);
+            used += len;
+        }
+
+        memset(rec, 0, size);
+        __sync_synchronize();
+        ring.tail += size;
+    }
+
+    dropped = __sync_lock_test_and_set(&ring.dropped, 0);
+    if (dropped && used + 64 < sizeof out) {
+        used += ne_snprintf(out + used, 64, 
+                            "[%lu debug messages dropped]\n", dropped);
+    }
+
+    if (used) fwrite(out, used, 1, ne_debug_stream);
+    fflush(ne_debug_stream);
+}
+
+static void *ring_flusher(void *unused)
+{
+    pthread_mutex_lock(&ring_lock);
+    while (!ring.stop) {
+        struct timeval now;
+        struct timespec until;
+
+        gettimeofday(&now, NULL);
+        until.tv_sec = now.tv_sec;
+        until.tv_nsec = (now.tv_usec + FLUSH_INTERVAL * 1000) * 1000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&ring_wake, &ring_lock, &until);
+        if (ne_debug_stream) ring_drain();
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return NULL;
+}
+
+/* Stop the flusher thread, write out the ring and free it. */
+static void ring_stop(void)
+{
+    if (ring.data == NULL) return;
+
+    log_all_suppressed();
+
+    pthread_mutex_lock(&ring_lock);
+    ring.stop = 1;
+    pthread_cond_signal(&ring_wake);
+    pthread_mutex_unlock(&ring_lock);
+    pthread_join(ring.thread, NULL);
+
+    if (ne_debug_stream) ring_drain();
+    ne_free(ring.data);
+    ring.data = NULL;
+}
+
+/* Around fork(), hold ring_lock so the child does not inherit it
+ * mid-write; the child has no flusher thread, so discards the ring,
+ * whose contents the parent will write out, and reverts to
+ * synchronous output. */
+static void ring_prepare(void)
+{
+    pthread_mutex_lock(&ring_lock);
+}
+
+static void ring_parent(void)
+{
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void ring_child(void)
+{
+    pthread_mutex_unlock(&ring_lock);
+    if (ring.data) {
+        ne_free(ring.data);
+        ring.data = NULL;
+    }
+}
+
+#endif /* USE_DEBUG_RING */
+
+/* Write message 'msg' of 'len' bytes on channel 'n'. */
+static void debug_write(int n, const char *msg, size_t len)
+{
+#ifdef USE_DEBUG_RING
+    if (ring.data) {
+        ring_append(n, msg, len);
+        return;
+    }
+#endif
+    fwrite(msg, len, 1, ne_debug_stream);
+}
+
+/* Log a count of the messages on channel 'n' suppressed by its rate
+ * limit since the last count, if any. */
+static void log_suppressed(int n)
+{
+    unsigned long dropped;
+
+    DBG_TAKE(limits[n].dropped, dropped);
+    if (dropped) {
+        char note[64];
+        ne_snprintf(note, sizeof note, 
+                    "[%lu debug messages suppressed]\n", dropped);
+        debug_write(n, note, strlen(note));
+    }
+}
+
+/* Log the counts of suppressed messages for all channels. */
+static void log_all_suppressed(void)
+{
+    int n;
+
+    if (ne_debug_stream == NULL) return;
+
+    for (n = 0; n < 32; n++) {
+        if (debug_limited & (1 << n))
+            log_suppressed(n);
+    }
+}
+
 void ne_debug_init(FILE *stream, int mask)
 {
+#ifdef USE_DEBUG_RING
+    /* anything buffered goes to the old stream. */
+    if (ring.data) {
+        pthread_mutex_lock(&ring_lock);
+        if (ne_debug_stream) ring_drain();
+        ne_debug_stream = stream;
+        ne_debug_mask = mask;
+        pthread_mutex_unlock(&ring_lock);
+        return;
+    }
+#endif
     ne_debug_stream = stream;
     ne_debug_mask = mask;
 #if defined(HAVE_SETVBUF) && defined(_IONBF)
@@ -67,10 +387,139 @@ void ne_debug_init(FILE *stream, int mask)
 #endif        
 }
 
+int ne_debug_ring(size_t size, unsigned int flags)
+{
+#ifdef USE_DEBUG_RING
+    static int registered;
+    unsigned long n;
+
+    ring_stop();
+    if (size == 0) return 0;
+
+    for (n = 4096; n < size; n <<= 1)
+        /* nullop */;
+
+    if (!registered) {
+        pthread_atfork(ring_prepare, ring_parent, ring_child);
+        atexit(ring_stop);
+        registered = 1;
+    }
+
+    /* leave room for a padding record header past the end. */
+    ring.data = ne_calloc(n + sizeof(struct dbg_record));
+    ring.size = n;
+    ring.mask = n - 1;
+    ring.head = ring.tail = ring.dropped = 0;
+    ring.flags = flags;
+    ring.stop = 0;
+
+    if (pthread_create(&ring.thread, NULL, ring_flusher, NULL)) {
+        ne_free(ring.data);
+        ring.data = NULL;
+        return -1;
+    }
+
+    return 0;
+#else
+    return size ? -1 : 0;
+#endif
+}
+
+void ne_debug_flush(void)
+{
+    log_all_suppressed();
+
+#ifdef USE_DEBUG_RING
+    if (ring.data) {
+        pthread_mutex_lock(&ring_lock);
+        if (ne_debug_stream) ring_drain();
+        pthread_mutex_unlock(&ring_lock);
+        return;
+    }
+#endif
+    if (ne_debug_stream) fflush(ne_debug_stream);
+}
+
+void ne_debug_ratelimit(int ch, unsigned int rate)
+{
+    int n;
+
+    for (n = 0; n < 32; n++) {
+        if (ch & (1 << n)) {
+            if (ne_debug_stream && (debug_limited & (1 << n)))
+                log_suppressed(n);
+            limits[n].rate = rate;
+            limits[n].count = 0;
+            if (rate)
+                debug_limited |= 1 << n;
+            else
+                debug_limited &= ~(1 << n);
+        }
+    }
+}
+
+/* Returns non-zero if a message on channel 'n' exceeds its rate
+ * limit.  A count of the messages dropped in the previous second is
+ * logged with the first message let through in the next.  Only the
+ * thread which moves the window on resets the counters. */
+static int rate_limited(int n)
+{
+    time_t now = time(NULL), window = limits[n].window;
+
+    if (window != now && DBG_CAS(limits[n].window, window, now)) {
+        limits[n].count = 0;
+        log_suppressed(n);
+    }
+
+    if (DBG_INC(limits[n].count) < limits[n].rate)
+        return 0;
+
+    DBG_INC(limits[n].dropped);
+    return 1;
+}
+
 void ne_debug(int ch, const char *template, ...) 
 {
     va_list params;
+    int n;
+
     if ((ch & ne_debug_mask) == 0) return;
+
+    /* messages are recorded against the lowest channel enabled. */
+    for (n = 0; (ch & ne_debug_mask & (1 << n)) == 0; n++)
+        /* nullop */;
+
+    if ((debug_limited & (1 << n)) && rate_limited(n)) return;
+
+#ifdef USE_DEBUG_RING
+    if (ring.data) {
+        char stack[1024], *msg = stack;
+        size_t len, max = sizeof stack;
+
+        va_start(params, template);
+        len = ne_vsnprintf(msg, max, template, params);
+        va_end(params);
+
+        /* the message may have been truncated; retry in a larger
+         * buffer, up to the maximum record size. */
+        while (len == max - 1 && max < ring.size / 4) {
+            max *= 2;
+            if (msg != stack) ne_free(msg);
+            msg = ne_malloc(max);
+            va_start(params, template);
+            len = ne_vsnprintf(msg, max, template, params);
+            va_end(params);
+        }
+
+        ring_append(n, msg, len);
+        if (msg != stack) ne_free(msg);
+
+        if ((ch & NE_DBG_FLUSH) == NE_DBG_FLUSH)
+            pthread_cond_signal(&ring_wake);
+        return;
+    }
+#endif
+
     fflush(stdout);
     va_start(params, template);
     vfprintf(ne_debug_stream, template, params);
@@ -79,6 +528,51 @@ void ne_debug(int ch, const char *template, ...)
 	fflush(ne_debug_stream);
 }
 
+/* Names of the debug channels, for ne_debug_decode. */
+static const char *const channel_names[] = {
+    "socket", "http", "xml", "httpauth", "httpplain", "locks",
+    "xmlparse", "httpbody", "ssl"
+};
+
+int ne_debug_decode(FILE *in, FILE *out)
+{
+    int c;
+
+    while ((c = getc(in)) != EOF) {
+        unsigned char hdr[11];
+        unsigned long len, sec, usec;
+        int n;
+
+        /* text is passed through; a NUL byte starts a record. */
+        if (c != '\0') {
+            putc(c, out);
+            continue;
+        }
+
+        if (fread(hdr, sizeof hdr, 1, in) != 1) return -1;
+
+        len = (hdr[1] << 8) | hdr[2];
+        for (sec = usec = 0, n = 3; n < 7; n++) {
+            sec = (sec << 8) | hdr[n];
+            usec = (usec << 8) | hdr[n + 4];
+        }
+
+        if (hdr[0] < sizeof channel_names / sizeof channel_names[0]) {
+            fprintf(out, "%lu.%06lu %s: ", sec, usec, 
+                    channel_names[hdr[0]]);
+        } else {
+            fprintf(out, "%lu.%06lu %d: ", sec, usec, hdr[0]);
+        }
+
+        while (len-- > 0) {
+            if ((c = getc(in)) == EOF) return -1;
+            putc(c, out);
+        }
+    }
+
+    return ferror(in) ? -1 : 0;
+}
+
 #define NE_STRINGIFY(x) # x
 #define NE_EXPAT_VER(x,y,z) NE_STRINGIFY(x) "." NE_STRINGIFY(y) "." NE_STRINGIFY(z)
 
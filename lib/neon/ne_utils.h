@@ -91,6 +91,43 @@ extern FILE *ne_debug_stream;
  * debugging. */
 void ne_debug(int ch, const char *, ...) ne_attribute((format(printf, 2, 3)));
 
+/* Flag for ne_debug_ring: write binary records, see ne_debug_decode. */
+#define NE_DEBUG_BINARY (1<<0)
+
+/* Buffer debugging output in a ring of (at least) 'size' bytes, which
+ * is written out to the debug stream by a background thread, rather
+ * than writing each message synchronously.  Messages are dropped
+ * (and counted) if the ring fills.  If 'flags' includes
+ * NE_DEBUG_BINARY, each message is written as a binary record, with
+ * a timestamp and channel.  Pass 'size' as zero to write out any
+ * buffered output and return to synchronous output; this must be
+ * done before closing the debug stream.  A forked child process
+ * reverts to synchronous output.  Returns non-zero if asynchronous
+ * output is not supported. */
+int ne_debug_ring(size_t size, unsigned int flags);
+
+/* Write out any debugging output buffered by ne_debug_ring, and the
+ * counts of messages suppressed by rate limits. */
+void ne_debug_flush(void);
+
+/* Limit debugging output to 'rate' messages per second, for each of
+ * the given debug channels; a count of messages suppressed is logged
+ * with the next message let through, or by ne_debug_flush.  If
+ * several threads log messages at once, the limit is approximate.
+ * Pass 'rate' as zero to remove the limit. */
+void ne_debug_ratelimit(int ch, unsigned int rate);
+
+/* Decode binary debugging output read from 'in', writing it as text
+ * to 'out'.  Returns non-zero if 'in' is truncated or cannot be
+ * read.
+ *
+ * Each binary record is a NUL byte, then a one-byte channel number,
+ * two bytes giving the length of the message, four each giving the
+ * seconds and microseconds of the timestamp (all in network byte
+ * order), then the message itself.  Any other text is passed
+ * through unchanged. */
+int ne_debug_decode(FILE *in, FILE *out);
+
 /* Storing an HTTP status result */
 typedef struct {
     int major_version;
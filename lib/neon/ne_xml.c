@@ -82,19 +82,77 @@ struct handler {
 static void sax_error(void *ctx, const char *msg, ...);
 #endif
 
+/* A block of the element arena.  Elements, and the names and
+ * namespace bindings declared by them, are allocated from the arena in
+ * start_element and released in end_element; since elements end in
+ * the reverse order to which they start, the arena is used as a
+ * stack.  Blocks are kept for reuse once released, so a parse
+ * allocates only as many blocks as the deepest branch needs. */
+struct arena_block {
+    struct arena_block *next; /* next block, if any */
+    size_t size, used; /* bytes available and used in the block */
+};
+
+/* Position in the arena; everything allocated after it can be
+ * released at once. */
+struct arena_mark {
+    struct arena_block *block; /* current block, or NULL if empty */
+    size_t used;
+};
+
+/* Default size of an arena block, and allocation alignment. */
+#define ARENA_BLOCKSIZ (4096)
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+/* Returns the data region of arena block 'b'. */
+#define BLOCK_DATA(b) ((char *)(b) + ARENA_ALIGN(sizeof(struct arena_block)))
+
+/* Namespace URIs are interned by the parser: each distinct URI seen
+ * is given an ID, which indexes the 'nspaces' array of the parser.
+ * ID 0 is the empty namespace. */
+struct nsentry {
+    int id;
+    unsigned int hash;
+    struct nsentry *next; /* next in hash bucket */
+};
+
+/* A namespace prefix used in the document.  The bindings of the
+ * prefix are kept as a stack; the top is the binding in scope. */
+struct prefix {
+    char *name;
+    size_t len;
+    unsigned int hash;
+    struct binding *top; /* binding in scope, or NULL */
+    int last; /* ID of the namespace last bound to the prefix */
+    struct prefix *next; /* next in hash bucket */
+};
+
+/* A binding of a prefix (or of the default namespace, if 'prefix' is
+ * NULL) to a namespace, declared by an element. */
+struct binding {
+    int nsid;
+    struct prefix *prefix;
+    struct binding *shadowed; /* binding it hides, if any */
+    struct binding *next; /* next binding declared by the element */
+};
+
+/* Number of buckets in the namespace and prefix hash tables. */
+#define NS_BUCKETS (64)
+
 struct element {
     const ne_xml_char *nspace;
     ne_xml_char *name;
+    int nsid; /* ID of nspace */
 
     int state; /* opaque state integer */
     
-    /* Namespaces declared in this element */
-    ne_xml_char *default_ns; /* A default namespace */
-    struct namespace *nspaces; /* List of other namespace scopes */
+    struct binding *bindings; /* namespaces declared in this element */
 
     struct handler *handler; /* Handler for this element */
 
     struct element *parent; /* parent element, or NULL */    
+
+    struct arena_mark mark; /* arena position before this element */
 };
 
 /* We pass around a ne_xml_parser as the userdata in the parsing
@@ -110,6 +168,17 @@ struct ne_xml_parser_s {
     int failure; /* zero whilst parse should continue */
     int prune; /* if non-zero, depth within a dead branch */
 
+    struct arena_block *blocks; /* first block of the element arena */
+    struct arena_block *block; /* current block, or NULL if empty */
+
+    char **nspaces; /* interned namespace URIs, indexed by ID */
+    int nscount, nsalloc;
+    struct nsentry *nshash[NS_BUCKETS];
+    struct prefix *prefixes[NS_BUCKETS];
+    struct binding *default_ns; /* default namespace in scope */
+    struct binding root_ns; /* default namespace of the root */
+    struct idmap_ids *maps; /* cached namespace IDs for idmaps */
+
 #ifdef NEED_BOM_HANDLING
     int bom_pos;
 #endif
@@ -127,14 +196,15 @@ struct ne_xml_parser_s {
 static void start_element(void *userdata, const ne_xml_char *name, const ne_xml_char **atts);
 static void end_element(void *userdata, const ne_xml_char *name);
 static void char_data(void *userdata, const ne_xml_char *cdata, int len);
-static const char *resolve_nspace(const struct element *elm, 
-                                  const char *prefix, size_t pfxlen);
-
-/* Linked list of namespace scopes */
-struct namespace {
-    ne_xml_char *name;
-    ne_xml_char *uri;
-    struct namespace *next;
+static int resolve_nspace(ne_xml_parser *p, 
+                          const char *prefix, size_t pfxlen);
+
+/* The namespace IDs of the entries of an idmap array, as used in
+ * ne_xml_mapid_current. */
+struct idmap_ids {
+    const struct ne_xml_idmap *map;
+    int *ids;
+    struct idmap_ids *next;
 };
 
 #ifdef HAVE_LIBXML
@@ -208,6 +278,43 @@ const char *ne_xml_doc_encoding(const ne_xml_parser *p)
 #endif
 }
 
+/* Allocate 'len' bytes from the element arena of parser 'p'. */
+static void *arena_alloc(ne_xml_parser *p, size_t len)
+{
+    struct arena_block *b = p->block, **prev;
+    void *ret;
+
+    len = ARENA_ALIGN(len);
+
+    if (b == NULL || b->used + len > b->size) {
+        /* Move on to the next block, reusing it if big enough. */
+        prev = b ? &b->next : &p->blocks;
+        b = *prev;
+        if (b == NULL || b->size < len) {
+            size_t size = len > ARENA_BLOCKSIZ ? len : ARENA_BLOCKSIZ;
+            struct arena_block *nb = 
+                ne_malloc(ARENA_ALIGN(sizeof *nb) + size);
+
+            nb->size = size;
+            nb->next = b;
+            *prev = b = nb;
+        }
+        b->used = 0;
+        p->block = b;
+    }
+
+    ret = BLOCK_DATA(b) + b->used;
+    b->used += len;
+    return ret;
+}
+
+/* Duplicate string 's' into the element arena. */
+static char *arena_strdup(ne_xml_parser *p, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(p, len), s, len);
+}
+
 /* The first character of the REC-xml-names "NCName" rule excludes
  * "Digit | '.' | '-' | '_' | CombiningChar | Extender"; the XML
  * parser will not enforce this rule in a namespace declaration since
@@ -223,6 +330,73 @@ const char *ne_xml_doc_encoding(const ne_xml_parser *p)
  * also be rejected but will be allowed for the time being. */
 #define invalid_ncname(xn) (invalid_ncname_ch1((xn)[0]))
 
+/* Hash 'len' bytes of 'str' (FNV-1a). */
+static unsigned int hash_bytes(const char *str, size_t len)
+{
+    const unsigned char *ptr = (const unsigned char *)str;
+    unsigned int h = 2166136261U;
+
+    while (len--)
+        h = (h ^ *ptr++) * 16777619U;
+
+    return h;
+}
+
+/* Returns the ID of namespace URI 'uri', interning it if necessary. */
+static int intern_nspace(ne_xml_parser *p, const char *uri)
+{
+    size_t len = strlen(uri);
+    unsigned int hash = hash_bytes(uri, len);
+    struct nsentry **bucket = &p->nshash[hash % NS_BUCKETS], *ent;
+
+    for (ent = *bucket; ent; ent = ent->next) {
+        if (ent->hash == hash && strcmp(p->nspaces[ent->id], uri) == 0)
+            return ent->id;
+    }
+
+    if (p->nscount == p->nsalloc) {
+        p->nsalloc = p->nsalloc ? p->nsalloc * 2 : 8;
+        p->nspaces = ne_realloc(p->nspaces, p->nsalloc * sizeof *p->nspaces);
+    }
+
+    ent = ne_malloc(sizeof *ent);
+    ent->id = p->nscount++;
+    ent->hash = hash;
+    ent->next = *bucket;
+    *bucket = ent;
+    p->nspaces[ent->id] = ne_strdup(uri);
+
+    return ent->id;
+}
+
+/* Returns the prefix entry for the 'len'-byte 'name'; if 'create' is
+ * non-zero it is created if necessary, otherwise NULL is returned if
+ * the prefix has not been seen. */
+static struct prefix *find_prefix(ne_xml_parser *p, const char *name,
+                                  size_t len, int create)
+{
+    unsigned int hash = hash_bytes(name, len);
+    struct prefix **bucket = &p->prefixes[hash % NS_BUCKETS], *pfx;
+
+    for (pfx = *bucket; pfx; pfx = pfx->next) {
+        if (pfx->hash == hash && pfx->len == len 
+            && memcmp(pfx->name, name, len) == 0)
+            return pfx;
+    }
+
+    if (!create) return NULL;
+
+    pfx = ne_calloc(sizeof *pfx);
+    pfx->last = -1;
+    pfx->name = ne_strndup(name, len);
+    pfx->len = len;
+    pfx->hash = hash;
+    pfx->next = *bucket;
+    *bucket = pfx;
+
+    return pfx;
+}
+
 /* Extract the namespace prefix declarations from 'atts'. */
 static int declare_nspaces(ne_xml_parser *p, struct element *elm,
                            const ne_xml_char **atts)
@@ -230,12 +404,15 @@ static int declare_nspaces(ne_xml_parser *p, struct element *elm,
     int n;
     
     for (n = 0; atts && atts[n]; n += 2) {
+        struct binding *b;
+
         if (strcmp(atts[n], "xmlns") == 0) {
             /* New default namespace */
-            elm->default_ns = ne_strdup(atts[n+1]);
+            b = arena_alloc(p, sizeof *b);
+            b->prefix = NULL;
+            b->shadowed = p->default_ns;
+            p->default_ns = b;
         } else if (strncmp(atts[n], "xmlns:", 6) == 0) {
-            struct namespace *ns;
-            
             /* Reject some invalid NCNames as namespace prefix, and an
              * empty URI as the namespace URI */
             if (invalid_ncname(atts[n] + 6) || atts[n+1][0] == '\0') {
@@ -245,13 +422,26 @@ static int declare_nspaces(ne_xml_parser *p, struct element *elm,
                 return -1;
             }
 
-            /* New namespace scope */
-            ns = ne_calloc(sizeof(*ns));
-            ns->next = elm->nspaces;
-            elm->nspaces = ns;
-            ns->name = ne_strdup(atts[n]+6); /* skip the xmlns= */
-            ns->uri = ne_strdup(atts[n+1]);
+            /* New namespace scope; skip the xmlns: */
+            b = arena_alloc(p, sizeof *b);
+            b->prefix = find_prefix(p, atts[n] + 6, strlen(atts[n] + 6), 1);
+            b->shadowed = b->prefix->top;
+            b->prefix->top = b;
+        } else {
+            continue;
         }
+
+        /* Documents tend to bind a prefix to the same namespace each
+         * time it is declared; avoid hashing the URI if so. */
+        if (b->prefix && b->prefix->last != -1
+            && strcmp(p->nspaces[b->prefix->last], atts[n+1]) == 0) {
+            b->nsid = b->prefix->last;
+        } else {
+            b->nsid = intern_nspace(p, atts[n+1]);
+            if (b->prefix) b->prefix->last = b->nsid;
+        }
+        b->next = elm->bindings;
+        elm->bindings = b;
     }
     
     return 0;
@@ -266,26 +456,20 @@ static int expand_qname(ne_xml_parser *p, struct element *elm,
 
     pfx = strchr(qname, ':');
     if (pfx == NULL) {
-        struct element *e = elm;
-
-        /* Find default namespace; guaranteed to terminate as the root
-         * element always has default_ns="". */
-        while (e->default_ns == NULL)
-            e = e->parent;
-        
-        elm->name = ne_strdup(qname);
-        elm->nspace = e->default_ns;
+        /* the root binding guarantees a default namespace. */
+        elm->name = arena_strdup(p, qname);
+        elm->nsid = p->default_ns->nsid;
     } else if (invalid_ncname(pfx + 1) || qname == pfx) {
         ne_snprintf(p->error, ERR_SIZE, 
                     _("XML parse error at line %d: invalid element name"), 
                     ne_xml_currentline(p));
         return -1;
     } else {
-        const char *uri = resolve_nspace(elm, qname, pfx-qname);
+        int nsid = resolve_nspace(p, qname, pfx-qname);
 
-	if (uri) {
-	    elm->name = ne_strdup(pfx+1);
-            elm->nspace = uri;
+	if (nsid >= 0) {
+	    elm->name = arena_strdup(p, pfx+1);
+            elm->nsid = nsid;
 	} else {
 	    ne_snprintf(p->error, ERR_SIZE, 
                         ("XML parse error at line %d: undeclared namespace prefix"),
@@ -293,6 +477,7 @@ static int expand_qname(ne_xml_parser *p, struct element *elm,
 	    return -1;
 	}
     }
+    elm->nspace = p->nspaces[elm->nsid];
     return 0;
 }
 
@@ -303,6 +488,7 @@ static void start_element(void *userdata, const ne_xml_char *name,
     ne_xml_parser *p = userdata;
     struct element *elm;
     struct handler *hand;
+    struct arena_mark mark;
     int state = NE_XML_DECLINE;
 
     if (p->failure) return;
@@ -313,7 +499,11 @@ static void start_element(void *userdata, const ne_xml_char *name,
     }
 
     /* Create a new element */
-    elm = ne_calloc(sizeof *elm);
+    mark.block = p->block;
+    mark.used = p->block ? p->block->used : 0;
+    elm = arena_alloc(p, sizeof *elm);
+    memset(elm, 0, sizeof *elm);
+    elm->mark = mark;
     elm->parent = p->current;
     p->current = elm;
 
@@ -342,23 +532,24 @@ static void start_element(void *userdata, const ne_xml_char *name,
         p->failure = state;
 }
 
-/* Destroys an element structure. */
-static void destroy_element(struct element *elm) 
+/* Destroys an element structure, which must be the most recently
+ * started element, releasing everything allocated for it. */
+static void destroy_element(ne_xml_parser *p, struct element *elm) 
 {
-    struct namespace *this_ns, *next_ns;
-    ne_free(elm->name);
-    /* Free the namespaces */
-    this_ns = elm->nspaces;
-    while (this_ns != NULL) {
-	next_ns = this_ns->next;
-	ne_free(this_ns->name);
-	ne_free(this_ns->uri);
-	ne_free(this_ns);
-	this_ns = next_ns;
+    struct arena_mark mark = elm->mark;
+    struct binding *b;
+
+    /* Take the namespaces declared by the element out of scope. */
+    for (b = elm->bindings; b; b = b->next) {
+        if (b->prefix)
+            b->prefix->top = b->shadowed;
+        else
+            p->default_ns = b->shadowed;
     }
-    if (elm->default_ns)
-        ne_free(elm->default_ns);
-    ne_free(elm);
+
+    p->block = mark.block;
+    if (mark.block)
+        mark.block->used = mark.used;
 }
 
 /* cdata SAX callback */
@@ -402,36 +593,28 @@ static void end_element(void *userdata, const ne_xml_char *name)
     p->current = elm->parent;
     p->prune = 0;
 
-    destroy_element(elm);
+    destroy_element(p, elm);
 }
 
-/* Find a namespace definition for 'prefix' in given element, where
- * length of prefix is 'pfxlen'.  Returns the URI or NULL. */
-static const char *resolve_nspace(const struct element *elm, 
-                                  const char *prefix, size_t pfxlen)
+/* Find the namespace bound to 'prefix' in the current scope, where
+ * length of prefix is 'pfxlen'.  Returns the namespace ID, or -1 if
+ * the prefix is not bound. */
+static int resolve_nspace(ne_xml_parser *p, 
+                          const char *prefix, size_t pfxlen)
 {
-    const struct element *s;
-
-    /* Search up the tree. */
-    for (s = elm; s != NULL; s = s->parent) {
-	const struct namespace *ns;
-	/* Iterate over defined spaces on this node. */
-	for (ns = s->nspaces; ns != NULL; ns = ns->next) {
-	    if (strlen(ns->name) == pfxlen && 
-		memcmp(ns->name, prefix, pfxlen) == 0)
-		return ns->uri;
-	}
-    }
+    struct prefix *pfx = find_prefix(p, prefix, pfxlen, 0);
 
-    return NULL;
+    return pfx && pfx->top ? pfx->top->nsid : -1;
 }
 
 ne_xml_parser *ne_xml_create(void) 
 {
     ne_xml_parser *p = ne_calloc(sizeof *p);
-    /* Placeholder for the root element */
+    /* Placeholder for the root element, in the empty namespace */
     p->current = p->root = ne_calloc(sizeof *p->root);
-    p->root->default_ns = "";
+    p->root->nsid = p->root_ns.nsid = intern_nspace(p, "");
+    p->root->nspace = p->nspaces[0];
+    p->default_ns = &p->root_ns;
     p->root->state = 0;
     strcpy(p->error, _("Unknown error"));
 #ifdef HAVE_EXPAT
@@ -559,8 +742,9 @@ int ne_xml_failed(ne_xml_parser *p)
 
 void ne_xml_destroy(ne_xml_parser *p) 
 {
-    struct element *elm, *parent;
+    struct arena_block *block, *nblock;
     struct handler *hand, *next;
+    int n;
 
     /* Free up the handlers on the stack: the root element has the
      * pointer to the base of the handler stack. */
@@ -569,15 +753,39 @@ void ne_xml_destroy(ne_xml_parser *p)
 	ne_free(hand);
     }
 
-    /* Clean up remaining elements */
-    for (elm = p->current; elm != p->root; elm = parent) {
-	parent = elm->parent;
-	destroy_element(elm);
+    /* Free the arena, and with it any remaining elements. */
+    for (block = p->blocks; block != NULL; block = nblock) {
+        nblock = block->next;
+        ne_free(block);
     }
 
     /* free root element */
     ne_free(p->root);
 
+    /* ...and the namespace and prefix tables. */
+    for (n = 0; n < NS_BUCKETS; n++) {
+        while (p->nshash[n]) {
+            struct nsentry *ent = p->nshash[n];
+            p->nshash[n] = ent->next;
+            ne_free(ent);
+        }
+        while (p->prefixes[n]) {
+            struct prefix *pfx = p->prefixes[n];
+            p->prefixes[n] = pfx->next;
+            ne_free(pfx->name);
+            ne_free(pfx);
+        }
+    }
+    for (n = 0; n < p->nscount; n++)
+        ne_free(p->nspaces[n]);
+    ne_free(p->nspaces);
+    while (p->maps) {
+        struct idmap_ids *ids = p->maps;
+        p->maps = ids->next;
+        ne_free(ids->ids);
+        ne_free(ids);
+    }
+
 #ifdef HAVE_EXPAT
     XML_ParserFree(p->parser);
     if (p->encoding) ne_free(p->encoding);
@@ -633,9 +841,8 @@ ne_xml_get_attr(ne_xml_parser *p, const char **attrs,
 	    /* If a namespace is given, and the local part matches,
 	     * then resolve the namespace and compare that too. */
 	    if (strcmp(pnt + 1, name) == 0) {
-		const char *uri = resolve_nspace(p->current, 
-						 attrs[n], pnt - attrs[n]);
-		if (uri && strcmp(uri, nspace) == 0)
+		int nsid = resolve_nspace(p, attrs[n], pnt - attrs[n]);
+		if (nsid >= 0 && strcmp(p->nspaces[nsid], nspace) == 0)
 		    return attrs[n+1];
 	    }
 	}
@@ -656,3 +863,41 @@ int ne_xml_mapid(const struct ne_xml_idmap map[], size_t maplen,
     
     return 0;
 }
+
+int ne_xml_nspace_id(ne_xml_parser *p, const char *uri)
+{
+    return intern_nspace(p, uri);
+}
+
+int ne_xml_current_nspace_id(ne_xml_parser *p)
+{
+    return p->current->nsid;
+}
+
+int ne_xml_mapid_current(ne_xml_parser *p, const struct ne_xml_idmap map[],
+                         size_t maplen, const char *name)
+{
+    struct idmap_ids *ids;
+    int nsid = p->current->nsid;
+    size_t n;
+
+    for (ids = p->maps; ids && ids->map != map; ids = ids->next)
+        /* nullop */;
+
+    if (ids == NULL) {
+        /* First use of this map with this parser: look up the IDs. */
+        ids = ne_malloc(sizeof *ids);
+        ids->map = map;
+        ids->ids = ne_malloc(maplen * sizeof *ids->ids);
+        for (n = 0; n < maplen; n++)
+            ids->ids[n] = intern_nspace(p, map[n].nspace);
+        ids->next = p->maps;
+        p->maps = ids;
+    }
+
+    for (n = 0; n < maplen; n++)
+        if (ids->ids[n] == nsid && strcmp(name, map[n].name) == 0)
+            return map[n].id;
+
+    return 0;
+}
@@ -143,6 +143,26 @@ struct ne_xml_idmap {
 int ne_xml_mapid(const struct ne_xml_idmap map[], size_t maplen,
                  const char *nspace, const char *name);
 
+/* Namespace URIs are interned by the parser: within one parser, each
+ * distinct namespace URI has a distinct integer ID, and the empty
+ * namespace has ID zero.  The nspace string passed to the start- and
+ * end-element callbacks is the parser's interned copy.
+ *
+ * ne_xml_nspace_id returns the ID of namespace URI 'uri' for parser
+ * 'p'.  ne_xml_current_nspace_id returns the namespace ID of the
+ * element whose start-element, character data or end-element
+ * callback is being invoked. */
+int ne_xml_nspace_id(ne_xml_parser *p, const char *uri);
+int ne_xml_current_nspace_id(ne_xml_parser *p);
+
+/* As ne_xml_mapid, for the element whose start-element or
+ * end-element callback is being invoked by parser 'p', where 'name'
+ * is the element name.  Namespaces are matched by ID; the IDs for
+ * 'map' are looked up on first use, so 'map' must not be modified
+ * during the parse. */
+int ne_xml_mapid_current(ne_xml_parser *p, const struct ne_xml_idmap map[],
+                         size_t maplen, const char *name);
+
 /* media type, appropriate for adding to a Content-Type header */
 #define NE_XML_MEDIA_TYPE "application/xml"
 
@@ -164,6 +164,58 @@ static int put_get_utf8_segment(void)
     return do_put_get("res-%e2%82%ac");
 }
 
+#define NPIPE (8)
+
+static int collect_body(void *userdata, const char *buf, size_t len)
+{
+    ne_buffer_append(userdata, buf, len);
+    return 0;
+}
+
+/* Retrieve the resource several times in a batch of HEAD and GET
+ * requests; these are pipelined if --pipeline is used. */
+static int get_batch(void)
+{
+    ne_request *reqs[NPIPE];
+    ne_buffer *bodies[NPIPE];
+    int n, ret = OK;
+
+    PRECOND(pg_uri);
+
+    for (n = 0; n < NPIPE; n++) {
+        reqs[n] = ne_request_create(i_session, n % 2 ? "HEAD" : "GET",
+                                    pg_uri);
+        bodies[n] = ne_buffer_create();
+        ne_add_response_body_reader(reqs[n], ne_accept_2xx, 
+                                    collect_body, bodies[n]);
+    }
+
+    if (dispatch_requests(reqs, NPIPE)) {
+        t_context("GET of `%s': %s", pg_uri, ne_get_error(i_session));
+        ret = FAIL;
+    }
+    
+    for (n = 0; n < NPIPE && ret == OK; n++) {
+        const ne_status *st = ne_get_status(reqs[n]);
+
+        if (st->code != 200) {
+            t_context("%s %d of %d gave %d, should be 200", 
+                      n % 2 ? "HEAD" : "GET", n + 1, NPIPE, st->code);
+            ret = FAIL;
+        } else if (n % 2 == 0 && strcmp(bodies[n]->data, test_contents)) {
+            t_context("GET %d of %d returned wrong content", n + 1, NPIPE);
+            ret = FAIL;
+        }
+    }
+
+    for (n = 0; n < NPIPE; n++) {
+        ne_request_destroy(reqs[n]);
+        ne_buffer_destroy(bodies[n]);
+    }
+
+    return ret;
+}
+
 static int mkcol_over_plain(void)
 {
     PRECOND(pg_uri);
@@ -433,6 +485,7 @@ ne_test tests[] = {
     T(options),
     T(put_get),
     T(put_get_utf8_segment),
+    T(get_batch),
     T(mkcol_over_plain),
     T(delete),
     T(delete_null),
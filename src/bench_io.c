@@ -0,0 +1,492 @@
+/*
+   litmus: PUT/GET throughput benchmark
+   Copyright (C) 2005, Joe Orton <joe@manyfish.co.uk>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* The benchmark is configured using environment variables:
+ *
+ *   BENCH_WORKERS   number of worker processes (default 4)
+ *   BENCH_DURATION  length of the timed run, in seconds (default 10)
+ *   BENCH_SIZES     comma-separated list of object sizes, each
+ *                   optionally suffixed with k or m (default 64k)
+ *   BENCH_PUTS      percentage of requests which are PUTs (default 50)
+ *   BENCH_INFLIGHT  number of requests each worker keeps in flight
+ *                   at once (default 1)
+ *
+ * Each worker uses its own session, and its own set of resources,
+ * one for each object size.  If more than one request is kept in
+ * flight, the worker dispatches them using a request engine, each
+ * over a separate connection. */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "ne_request.h"
+#include "ne_string.h"
+
+#include "tests.h"
+#include "common.h"
+
+#define BLOCKSIZE (8192)
+
+#define DEF_WORKERS (4)
+#define DEF_DURATION (10)
+#define DEF_SIZES "64k"
+#define DEF_PUTS (50)
+#define DEF_INFLIGHT (1)
+
+#define MAX_SIZES (16)
+
+static int workers, duration, puts_pct, inflight;
+static off_t sizes[MAX_SIZES];
+static int nsizes;
+
+static char block[BLOCKSIZE];
+
+/* Results for one type of request, as collected by a worker. */
+struct op_stats {
+    unsigned long count, errors;
+    double bytes;
+    double *latency; /* array of 'count' latencies, in seconds. */
+    size_t alloc;
+};
+
+/* Results header written by a worker to the parent. */
+struct worker_result {
+    double elapsed;
+    unsigned long count[2], errors[2];
+    double bytes[2];
+};
+
+#define OP_PUT (0)
+#define OP_GET (1)
+
+static const char *const op_names[] = { "PUT", "GET" };
+
+static int bench_init(void)
+{
+    const char *list = getenv("BENCH_SIZES");
+    char *copy, *ptr;
+    int n;
+
+    CALL(env_int("BENCH_WORKERS", DEF_WORKERS, 1, INT_MAX, &workers));
+    CALL(env_int("BENCH_DURATION", DEF_DURATION, 1, INT_MAX, &duration));
+    CALL(env_int("BENCH_PUTS", DEF_PUTS, 0, 100, &puts_pct));
+    CALL(env_int("BENCH_INFLIGHT", DEF_INFLIGHT, 1, INT_MAX, &inflight));
+
+    ptr = copy = ne_strdup(list ? list : DEF_SIZES);
+    nsizes = 0;
+    do {
+        char *token = ne_token(&ptr, ',');
+
+        if (nsizes == MAX_SIZES || (sizes[nsizes] = parse_size(token)) < 0) {
+            t_context("invalid object size list `%s'", list);
+            ne_free(copy);
+            return FAILHARD;
+        }
+        nsizes++;
+    } while (ptr);
+    ne_free(copy);
+
+    for (n = 0; n < BLOCKSIZE; n++)
+        block[n] = n % 256;
+
+    /* upload a random file to prep auth if necessary. */
+    CALL(upload_foo("random.txt"));
+
+    /* don't log a message for each body block! */
+    ne_debug_init(ne_debug_stream, ne_debug_mask & ~(NE_DBG_HTTPBODY|NE_DBG_HTTP));
+
+    return OK;
+}
+
+/* State for the request body provider. */
+struct body {
+    off_t total, remain;
+};
+
+static ssize_t provider(void *userdata, char *buffer, size_t buflen)
+{
+    struct body *body = userdata;
+
+    if (buflen == 0) {
+        body->remain = body->total;
+        return 0;
+    }
+
+    if (buflen > BLOCKSIZE)
+        buflen = BLOCKSIZE;
+    if ((off_t)buflen > body->remain)
+        buflen = body->remain;
+
+    memcpy(buffer, block, buflen);
+    body->remain -= buflen;
+    return buflen;
+}
+
+static int count_reader(void *userdata, const char *buf, size_t len)
+{
+    double *bytes = userdata;
+    *bytes += len;
+    return 0;
+}
+
+/* Create a request of type 'op' on 'uri' for an object of size
+ * 'size', using 'body' as the state for a PUT request body; the
+ * number of bytes of a GET response body is added to *bytes. */
+static ne_request *bench_create(ne_session *sess, int op, const char *uri,
+                                off_t size, struct body *body, double *bytes)
+{
+    ne_request *req = ne_request_create(sess, op_names[op], uri);
+
+    if (op == OP_PUT) {
+        body->total = size;
+#ifdef NE_LFS
+        ne_set_request_body_provider64(req, size, provider, body);
+#else
+        ne_set_request_body_provider(req, size, provider, body);
+#endif
+    } else {
+        ne_add_response_body_reader(req, ne_accept_2xx, count_reader, bytes);
+    }
+
+    return req;
+}
+
+/* Returns the result of dispatching request 'req', of type 'op' for
+ * an object of size 'size', given dispatch return value 'ret'.  On
+ * success, adds the size of a PUT request body to *bytes. */
+static int bench_result(ne_request *req, int op, off_t size, int ret,
+                        double *bytes)
+{
+    if (ret == NE_OK && ne_get_status(req)->klass != 2)
+        ret = NE_ERROR;
+    else if (ret == NE_OK && op == OP_PUT)
+        *bytes += size;
+    return ret;
+}
+
+/* Perform one request of type 'op' on 'uri' for an object of size
+ * 'size'; returns non-zero on failure.  Adds the number of bytes
+ * transferred to *bytes. */
+static int bench_request(ne_session *sess, int op, const char *uri,
+                         off_t size, double *bytes)
+{
+    struct body body;
+    ne_request *req = bench_create(sess, op, uri, size, &body, bytes);
+    int ret = bench_result(req, op, size, ne_request_dispatch(req), bytes);
+
+    ne_request_destroy(req);
+    return ret;
+}
+
+static void add_latency(struct op_stats *st, double latency)
+{
+    if (st->count == st->alloc) {
+        st->alloc = st->alloc ? st->alloc * 2 : 1024;
+        st->latency = ne_realloc(st->latency,
+                                 st->alloc * sizeof *st->latency);
+    }
+    st->latency[st->count++] = latency;
+}
+
+/* State for a worker which keeps several requests in flight. */
+struct flight_state {
+    ne_session *sess;
+    ne_engine *engine;
+    char **uris;
+    struct op_stats *stats;
+    unsigned int seed;
+    double end;
+    int n;
+};
+
+/* A request in flight. */
+struct flight {
+    struct flight_state *state;
+    int op, size;
+    double start, bytes;
+    struct body body;
+};
+
+/* Returns a random request type, PUT with probability puts_pct. */
+static int pick_op(unsigned int *seed)
+{
+    return (int)(100.0 * rand_r(seed) / (RAND_MAX + 1.0)) < puts_pct
+        ? OP_PUT : OP_GET;
+}
+
+static void flight_done(void *userdata, ne_request *req, int ret);
+
+/* Dispatch the next request for 'state' using its engine. */
+static void flight_next(struct flight_state *state)
+{
+    struct flight *fl = ne_calloc(sizeof *fl);
+    ne_request *req;
+
+    fl->state = state;
+    fl->size = state->n++ % nsizes;
+    fl->op = pick_op(&state->seed);
+    req = bench_create(state->sess, fl->op, state->uris[fl->size],
+                       sizes[fl->size], &fl->body, &fl->bytes);
+    fl->start = bench_now();
+    ne_engine_dispatch(state->engine, req, flight_done, fl);
+}
+
+static void flight_done(void *userdata, ne_request *req, int ret)
+{
+    struct flight *fl = userdata;
+    struct flight_state *state = fl->state;
+    struct op_stats *st = &state->stats[fl->op];
+
+    if (bench_result(req, fl->op, sizes[fl->size], ret, &fl->bytes)) {
+        st->errors++;
+    } else {
+        add_latency(st, bench_now() - fl->start);
+        st->bytes += fl->bytes;
+    }
+
+    ne_request_destroy(req);
+    ne_free(fl);
+
+    if (bench_now() < state->end)
+        flight_next(state);
+}
+
+/* Run requests for 'sess' until time 'end', keeping 'inflight'
+ * requests in flight; returns non-zero if the engine failed. */
+static int run_inflight(ne_session *sess, char **uris, unsigned int seed,
+                        double end, struct op_stats *stats)
+{
+    struct flight_state state;
+    int n, ret;
+
+    state.sess = sess;
+    state.engine = ne_engine_create();
+    state.uris = uris;
+    state.stats = stats;
+    state.seed = seed;
+    state.end = end;
+    state.n = 0;
+
+    /* keep a persistent connection for each request in flight. */
+    ne_set_connection_limits(sess, 0, inflight);
+
+    for (n = 0; n < inflight; n++)
+        flight_next(&state);
+
+    ret = ne_engine_run(state.engine);
+    ne_engine_destroy(state.engine);
+    return ret;
+}
+
+/* State of a worker process. */
+static ne_session *worker_sess;
+static char **worker_uris;
+
+/* Creates the resources for worker 'id'. */
+static int worker_setup(int id, void *userdata)
+{
+    int n;
+
+    worker_sess = create_session();
+    worker_uris = ne_calloc(nsizes * sizeof *worker_uris);
+
+    for (n = 0; n < nsizes; n++) {
+        char name[64];
+        double ignored = 0;
+
+        ne_snprintf(name, sizeof name, "bench-%d-%d", id, n);
+        worker_uris[n] = ne_concat(i_path, name, NULL);
+
+        if (bench_request(worker_sess, OP_PUT, worker_uris[n], sizes[n],
+                          &ignored))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Runs requests in worker 'id' for the configured duration and
+ * writes the results to 'out'. */
+static int worker_run(int id, int out, void *userdata)
+{
+    struct op_stats stats[2];
+    struct worker_result res;
+    unsigned int seed = id + 1;
+    double start, end;
+    int n, op;
+
+    memset(stats, 0, sizeof stats);
+
+    start = bench_now();
+    end = start + duration;
+
+    if (inflight > 1 && run_inflight(worker_sess, worker_uris, seed, end,
+                                     stats))
+        return 1;
+
+    for (n = 0; inflight == 1 && bench_now() < end; n++) {
+        int sz = n % nsizes;
+        double before, bytes = 0;
+
+        op = pick_op(&seed);
+
+        before = bench_now();
+        if (bench_request(worker_sess, op, worker_uris[sz], sizes[sz],
+                          &bytes)) {
+            stats[op].errors++;
+        } else {
+            add_latency(&stats[op], bench_now() - before);
+            stats[op].bytes += bytes;
+        }
+    }
+
+    memset(&res, 0, sizeof res);
+    res.elapsed = bench_now() - start;
+    for (op = 0; op < 2; op++) {
+        res.count[op] = stats[op].count;
+        res.errors[op] = stats[op].errors;
+        res.bytes[op] = stats[op].bytes;
+    }
+
+    if (full_write(out, &res, sizeof res)) return 1;
+    for (op = 0; op < 2; op++) {
+        if (stats[op].count && full_write(out, stats[op].latency,
+                                          stats[op].count * sizeof(double)))
+            return 1;
+    }
+
+    for (n = 0; n < nsizes; n++)
+        ne_delete(worker_sess, worker_uris[n]);
+
+    return 0;
+}
+
+/* Results collected from the workers. */
+struct bench_totals {
+    struct op_stats stats[3];
+    double elapsed;
+};
+
+/* Adds the results of a worker, read from 'in', to the totals. */
+static int worker_collect(int id, int in, void *userdata)
+{
+    struct bench_totals *tot = userdata;
+    struct worker_result res;
+    int op;
+
+    if (full_read(in, &res, sizeof res))
+        return 1;
+
+    if (res.elapsed > tot->elapsed) tot->elapsed = res.elapsed;
+
+    for (op = 0; op < 2; op++) {
+        struct op_stats *st = &tot->stats[op];
+        unsigned long total = st->count + res.count[op];
+
+        st->latency = ne_realloc(st->latency, (total + 1) * sizeof(double));
+        if (res.count[op]
+            && full_read(in, st->latency + st->count,
+                         res.count[op] * sizeof(double)))
+            return 1;
+        st->count = total;
+        st->errors += res.errors[op];
+        st->bytes += res.bytes[op];
+    }
+
+    return 0;
+}
+
+static void report(const char *name, struct op_stats *st, double elapsed)
+{
+    if (st->count == 0) {
+        t_info("%s: no requests completed (%lu errors)", name, st->errors);
+        return;
+    }
+
+    sort_doubles(st->latency, st->count);
+
+    t_info("%s: %lu requests (%lu errors), %.1f req/s, %.2f MB/s, "
+           "latency p50 %.2fms p95 %.2fms p99 %.2fms",
+           name, st->count, st->errors, st->count / elapsed,
+           st->bytes / elapsed / (1024.0 * 1024.0),
+           percentile(st->latency, st->count, 50) * 1000.0,
+           percentile(st->latency, st->count, 95) * 1000.0,
+           percentile(st->latency, st->count, 99) * 1000.0);
+}
+
+static int bench_run(void)
+{
+    static const struct child_ops ops = {
+        worker_setup, worker_run, worker_collect
+    };
+    struct bench_totals tot;
+    struct op_stats *stats = tot.stats;
+    int op, failed;
+
+    memset(&tot, 0, sizeof tot);
+
+    failed = run_children(workers, &ops, &tot);
+
+    if (!failed) {
+        struct op_stats *all = &stats[2];
+
+        all->count = stats[OP_PUT].count + stats[OP_GET].count;
+        all->errors = stats[OP_PUT].errors + stats[OP_GET].errors;
+        all->bytes = stats[OP_PUT].bytes + stats[OP_GET].bytes;
+        all->latency = ne_malloc((all->count + 1) * sizeof(double));
+        memcpy(all->latency, stats[OP_PUT].latency,
+               stats[OP_PUT].count * sizeof(double));
+        memcpy(all->latency + stats[OP_PUT].count, stats[OP_GET].latency,
+               stats[OP_GET].count * sizeof(double));
+
+        t_info("%d workers for %.1fs, %d in flight, %d%% PUT, "
+               "%d object size%s", workers, tot.elapsed, inflight, puts_pct,
+               nsizes, nsizes == 1 ? "" : "s");
+        report("PUT", &stats[OP_PUT], tot.elapsed);
+        report("GET", &stats[OP_GET], tot.elapsed);
+        report("all", all, tot.elapsed);
+    }
+
+    for (op = 0; op < 3; op++)
+        if (stats[op].latency) ne_free(stats[op].latency);
+
+    ONN("a worker failed to set up or report its results", failed);
+
+    if (stats[OP_PUT].errors + stats[OP_GET].errors) {
+        t_warning("%lu requests failed",
+                  stats[OP_PUT].errors + stats[OP_GET].errors);
+    }
+
+    return OK;
+}
+
+ne_test tests[] = {
+    INIT_TESTS,
+    T(bench_init),
+
+    T_LEAKY(bench_run),
+
+    FINISH_TESTS
+};
@@ -19,7 +19,12 @@
 
 #include <config.h>
 
+#include <sys/types.h>
 #include <sys/stat.h> /* for struct stat */
+#include <sys/wait.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #ifdef HAVE_STRING_H
 #include <string.h>
@@ -33,6 +38,8 @@
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <time.h>
 
 #include <ne_uri.h>
 #include <ne_auth.h>
@@ -42,6 +49,7 @@
 #include "common.h"
 
 int i_class2 = 0;
+int i_pipeline = 0;
 
 ne_session *i_session, *i_session2;
 
@@ -56,16 +64,24 @@ const char *i_username = NULL, *i_password;
 
 static char *htdocs_root = NULL;
 
+/* name of the scratch collection created beneath i_path. */
+static const char *scratch_name = "litmus";
+
 static char *proxy_hostname = NULL;
 static unsigned int proxy_port;
 
 int i_foo_fd;
 off_t i_foo_len;
 
+/* statistics of sessions which have been destroyed. */
+static ne_session_stats done_stats;
+
 const static struct option longopts[] = {
     { "htdocs", required_argument, NULL, 'd' },
     { "help", no_argument, NULL, 'h' },
     { "proxy", required_argument, NULL, 'p' },
+    { "scratch", required_argument, NULL, 's' },
+    { "pipeline", no_argument, NULL, 'P' },
 #if 0
     { "colour", no_argument, NULL, 'c' },
     { "no-colour", no_argument, NULL, 'n' },
@@ -78,7 +94,9 @@ static void usage(FILE *output)
     fprintf(output, 
 	    "\rUsage: %s [OPTIONS] URL [username password]\n"
 	    " Options are:\n"
-	    "    -d DIR    use given htdocs root directory\n",
+	    "    -d DIR    use given htdocs root directory\n"
+	    "    -s NAME   use given name for the scratch collection\n"
+	    "    -P        pipeline requests where possible\n",
 	    test_argv[0]);
 }
 
@@ -144,7 +162,7 @@ int init(void)
     char *proxy_url = NULL;
 
     while ((optc = getopt_long(test_argc, test_argv, 
-			       "d:hp", longopts, NULL)) != -1) {
+			       "d:hpPs:", longopts, NULL)) != -1) {
 	switch (optc) {
 	case 'd':
 	    htdocs_root = optarg;
@@ -152,6 +170,12 @@ int init(void)
 	case 'p':
 	    proxy_url = optarg;
 	    break;
+	case 's':
+	    scratch_name = optarg;
+	    break;
+	case 'P':
+	    i_pipeline = 1;
+	    break;
 	case 'h':
 	    usage(stdout);
 	    exit(1);
@@ -261,6 +285,22 @@ static void i_pre_send(ne_request *req, void *userdata, ne_buffer *hdr)
     ne_buffer_zappend(hdr, buf);
 }
 
+/* Log the time taken by each phase of a request to the debug log,
+ * in milliseconds. */
+static void i_timing(ne_request *req, void *userdata, 
+                     const ne_request_timing *t)
+{
+#define MS(x) ((x) * 1000.0)
+    NE_DEBUG(NE_DBG_HTTP, "%s: timing: %d: lookup %.3f, connect %.3f, "
+             "ssl %.3f, send headers %.3f, send body %.3f, first byte %.3f, "
+             "read headers %.3f, read body %.3f, total %.3f (ms)\n",
+             (const char *)userdata, ne_get_status(req)->code, 
+             MS(t->lookup), MS(t->connect), MS(t->secure), 
+             MS(t->send_headers), MS(t->send_body), MS(t->first_byte),
+             MS(t->read_headers), MS(t->read_body), MS(t->total));
+#undef MS
+}
+
 /* Allow all certificates. */
 static int ignore_verify(void *ud, int fs, const ne_ssl_certificate *cert)
 {
@@ -293,8 +333,10 @@ static int init_session(ne_session *sess)
 
 static int make_space(void)
 {
-    char *space = ne_concat(i_path, "litmus/", NULL);
+    char *name = ne_path_escape(scratch_name);
+    char *space = ne_concat(i_path, name, "/", NULL);
     
+    free(name);
     ne_delete(i_session, space);
 
     if (ne_mkcol(i_session, space)) {
@@ -310,6 +352,30 @@ static int make_space(void)
     return OK;
 }
 
+/* Add the statistics for session 'sess' to 'total'. */
+static void add_stats(ne_session_stats *total, ne_session *sess)
+{
+    ne_session_stats st;
+
+    ne_get_session_stats(sess, &st);
+    total->requests += st.requests;
+    total->sent += st.sent;
+    total->received += st.received;
+}
+
+/* I/O statistics callback for the test framework. */
+static void iostats(unsigned long *requests, off_t *sent, off_t *received)
+{
+    ne_session_stats total = done_stats;
+
+    if (i_session) add_stats(&total, i_session);
+    if (i_session2) add_stats(&total, i_session2);
+
+    *requests = total.requests;
+    *sent = total.sent;
+    *received = total.received;
+}
+
 int begin(void)
 {
     const char *scheme = use_secure?"https":"http";
@@ -323,15 +389,33 @@ int begin(void)
      * test number and session. */
     ne_hook_pre_send(i_session, i_pre_send, "X-Litmus");
     ne_hook_pre_send(i_session2, i_pre_send, "X-Litmus-Second");
+    ne_hook_request_timing(i_session, i_timing, "X-Litmus");
+    ne_hook_request_timing(i_session2, i_timing, "X-Litmus-Second");
+
+    test_iostats = iostats;
     
     CALL(make_space());
     
     return OK;
 }
 
+ne_session *create_session(void)
+{
+    ne_session *sess = ne_session_create(use_secure?"https":"http",
+                                         i_hostname, i_port);
+    
+    /* init_session() can only fail if begin() has already failed. */
+    init_session(sess);
+    ne_hook_pre_send(sess, i_pre_send, "X-Litmus");
+    
+    return sess;
+}
+
 int finish(void)
 {
+    add_stats(&done_stats, i_session);
     ne_session_destroy(i_session);
+    i_session = NULL;
     return OK;
 }
 
@@ -376,6 +460,19 @@ int options(void)
     return OK;
 }
 
+int dispatch_requests(ne_request **reqs, int count)
+{
+    int n, ret = NE_OK;
+
+    if (i_pipeline)
+        return ne_request_dispatch_pipeline(reqs, count);
+
+    for (n = 0; n < count && ret == NE_OK; n++)
+        ret = ne_request_dispatch(reqs[n]);
+
+    return ret;
+}
+
 char *get_lastmodified(const char *path)
 {
     ne_request *req = ne_request_create(i_session, "HEAD", path);
@@ -449,3 +546,215 @@ int compare_contents(const char *fn, const char *contents)
 
     return ret;
 }
+
+double bench_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+}
+
+int env_int(const char *name, int def, int min, int max, int *val)
+{
+    const char *str = getenv(name);
+    char *end;
+    long n;
+
+    if (str == NULL) {
+        *val = def;
+        return OK;
+    }
+
+    n = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || n < min || n > max) {
+        t_context("invalid %s `%s'", name, str);
+        return FAIL;
+    }
+
+    *val = n;
+    return OK;
+}
+
+off_t parse_size(const char *str)
+{
+    char *end;
+    long val = strtol(str, &end, 10);
+
+    if (end == str || val < 0) return -1;
+
+    switch (*end) {
+    case 'k': case 'K': val *= 1024; end++; break;
+    case 'm': case 'M': val *= 1024 * 1024; end++; break;
+    }
+
+    return *end == '\0' ? (off_t)val : -1;
+}
+
+int full_write(int fd, const void *data, size_t len)
+{
+    const char *ptr = data;
+
+    while (len > 0) {
+        ssize_t ret = write(fd, ptr, len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return -1;
+        ptr += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+int full_read(int fd, void *data, size_t len)
+{
+    char *ptr = data;
+
+    while (len > 0) {
+        ssize_t ret = read(fd, ptr, len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return -1;
+        ptr += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void sort_doubles(double *vals, unsigned long n)
+{
+    qsort(vals, n, sizeof *vals, cmp_double);
+}
+
+double percentile(const double *vals, unsigned long n, double pc)
+{
+    unsigned long rank = (unsigned long)(pc / 100.0 * n + 0.999999);
+
+    if (rank < 1) rank = 1;
+    return vals[rank - 1];
+}
+
+/* Child process 'id' for run_children: signals readiness on 'ready'
+ * by writing "R" (or failure, by writing "F") and closing it, waits
+ * for 'go' to be closed, then runs. */
+static int run_child(int id, const struct child_ops *ops, void *userdata,
+                     int ready, int go, int out)
+{
+    char ch;
+
+    if (ops->setup && ops->setup(id, userdata)) {
+        /* tell the parent, which is waiting for every child. */
+        full_write(ready, "F", 1);
+        close(ready);
+        return 1;
+    }
+
+    if (full_write(ready, "R", 1)) return 1;
+    /* the parent sees EOF if a child dies before writing. */
+    close(ready);
+    /* blocks until the parent closes the pipe. */
+    if (read(go, &ch, 1) != 0) return 1;
+
+    return ops->run(id, out, userdata);
+}
+
+int run_children(int count, const struct child_ops *ops, void *userdata)
+{
+    int ready[2], go[2], n, forked, failed = 0;
+    int *outs = ne_calloc(count * sizeof *outs);
+    pid_t *pids = ne_calloc(count * sizeof *pids);
+
+    if (pipe(ready)) {
+        failed = 1;
+    } else if (pipe(go)) {
+        close(ready[0]);
+        close(ready[1]);
+        failed = 1;
+    }
+
+    if (failed) {
+        ne_free(outs);
+        ne_free(pids);
+        return -1;
+    }
+
+    fflush(stdout);
+    if (ne_debug_stream) fflush(ne_debug_stream);
+
+    for (forked = 0; forked < count; forked++) {
+        int out[2];
+
+        if (pipe(out)) {
+            failed = 1;
+            break;
+        }
+
+        pids[forked] = fork();
+        if (pids[forked] < 0) {
+            close(out[0]);
+            close(out[1]);
+            failed = 1;
+            break;
+        }
+
+        if (pids[forked] == 0) {
+            /* silence debugging: the stream is shared with parent. */
+            ne_debug_init(NULL, 0);
+            close(out[0]);
+            close(ready[0]);
+            close(go[1]);
+            _exit(run_child(forked, ops, userdata, ready[1], go[0], out[1]));
+        }
+
+        close(out[1]);
+        outs[forked] = out[0];
+    }
+
+    close(ready[1]);
+    close(go[0]);
+
+    /* wait for each child to be ready. */
+    for (n = 0; !failed && n < forked; n++) {
+        char ch;
+        if (full_read(ready[0], &ch, 1) || ch != 'R')
+            failed = 1;
+    }
+    close(ready[0]);
+
+    /* ...and start them all, unless they are to be killed. */
+    if (failed) {
+        for (n = 0; n < forked; n++)
+            kill(pids[n], SIGTERM);
+    }
+    close(go[1]);
+
+    for (n = 0; n < forked; n++) {
+        if (!failed && ops->collect(n, outs[n], userdata))
+            failed = 1;
+    }
+
+    for (n = 0; n < forked; n++) {
+        int status;
+
+        close(outs[n]);
+        if (failed) kill(pids[n], SIGTERM);
+        if (waitpid(pids[n], &status, 0) != pids[n]
+            || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = 1;
+    }
+
+    ne_free(outs);
+    ne_free(pids);
+
+    return failed;
+}
@@ -63,12 +63,23 @@ extern char *i_path;
 
 extern int i_class2; /* true if server is a class 2 DAV server. */
 
+extern int i_pipeline; /* true if requests should be pipelined. */
+
 /* If open_foo() has been called, this is the fd to the 'foo' file. */
 extern int i_foo_fd;
 
 /* size of file in foo */
 extern off_t i_foo_len;
 
+/* Create a new session to the server, configured in the same way as
+ * i_session. */
+ne_session *create_session(void);
+
+/* Dispatch the 'count' requests in 'reqs', pipelined if
+ * i_pipeline is set; returns NE_OK or the NE_* code of the first
+ * which failed. */
+int dispatch_requests(ne_request **reqs, int count);
+
 /* Upload htdocs/foo to i_path + path */
 int upload_foo(const char *path);
 
@@ -81,6 +92,58 @@ char *get_lastmodified(const char *path);
 char *create_temp(const char *contents);
 
 int compare_contents(const char *fn, const char *contents);
+
+/* Benchmark support. */
+
+/* Returns a timestamp in seconds, from a monotonic clock if
+ * available. */
+double bench_now(void);
+
+/* Sets *val to the integer value of environment variable 'name', or
+ * to 'def' if it is not set.  Returns FAIL, having set the test
+ * context, if the value is not an integer between 'min' and 'max';
+ * otherwise OK. */
+int env_int(const char *name, int def, int min, int max, int *val);
+
+/* Parses 'str', a size or count with optional suffix k (1024) or m
+ * (1024*1024); returns -1 if invalid. */
+off_t parse_size(const char *str);
+
+/* Write 'len' bytes of 'data' to 'fd'; returns non-zero on error. */
+int full_write(int fd, const void *data, size_t len);
+
+/* Read 'len' bytes into 'data' from 'fd'; returns non-zero on error
+ * or EOF. */
+int full_read(int fd, void *data, size_t len);
+
+/* Sort the 'n' values in 'vals' into ascending order. */
+void sort_doubles(double *vals, unsigned long n);
+
+/* Returns the 'pc'th percentile of the 'n' sorted values in 'vals',
+ * by the nearest-rank method. */
+double percentile(const double *vals, unsigned long n, double pc);
+
+/* Callbacks for run_children. */
+struct child_ops {
+    /* Called in child 'id' before the run starts; returns non-zero on
+     * failure.  May be NULL. */
+    int (*setup)(int id, void *userdata);
+    /* Called in child 'id' to run it, writing its results to 'out';
+     * returns non-zero on failure. */
+    int (*run)(int id, int out, void *userdata);
+    /* Called in the parent to read the results of child 'id' from
+     * 'in'; returns non-zero on failure. */
+    int (*collect)(int id, int in, void *userdata);
+};
+
+/* Fork 'count' child processes, with debugging output disabled.  Each
+ * child runs the 'setup' callback, then waits until every child has
+ * done so, so that all the children run at once.  The results of
+ * each child are then passed to the 'collect' callback in turn.
+ * Returns non-zero if any child fails to set up, run or report its
+ * results, or exits unsuccessfully; the remaining children are then
+ * killed. */
+int run_children(int count, const struct child_ops *ops, void *userdata);
 /* BINARYMODE() enables binary file I/O on cygwin. */
 #ifdef __CYGWIN__
 #define BINARYMODE(fd) do { setmode(fd, O_BINARY); } while (0)
@@ -0,0 +1,66 @@
+/*
+   litmus: decode binary debugging output
+   Copyright (C) 2005, Joe Orton <joe@manyfish.co.uk>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* Turns a debug.log written with TEST_DEBUG_RING=binary back into
+ * text, prefixing each message with its timestamp and channel.  Reads
+ * the files named on the command line, or standard input. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ne_utils.h"
+
+static int decode(const char *name, FILE *in)
+{
+    if (ne_debug_decode(in, stdout)) {
+        fprintf(stderr, "debug-decode: %s: %s\n", name,
+                ferror(in) ? strerror(errno) : "truncated record");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int n, ret = 0;
+
+    if (argc < 2) {
+        return decode("stdin", stdin);
+    }
+
+    for (n = 1; n < argc; n++) {
+        FILE *in = fopen(argv[n], "rb");
+
+        if (in == NULL) {
+            fprintf(stderr, "debug-decode: %s: %s\n", argv[n],
+                    strerror(errno));
+            ret = 1;
+            continue;
+        }
+
+        ret |= decode(argv[n], in);
+        fclose(in);
+    }
+
+    return ret;
+}
@@ -67,7 +67,7 @@ static int init_largefile(void)
     path = ne_concat(i_path, "large.txt", NULL);
 
     /* don't log a message for each body block! */
-    ne_debug_init(ne_debug_stream, ne_debug_mask & ~(NE_DBG_HTTPBODY|NE_DBG_HTTP));
+    ne_debug_ratelimit(NE_DBG_HTTPBODY|NE_DBG_HTTP, 20);
 
     return OK;
 }
@@ -512,6 +512,11 @@ static int newowner_modify(int istoken)
 	
 	pops[0].name = &pname;
 	
+	/* This needs a session of its own rather than another pooled
+	 * connection of i_session: the different user is the session's
+	 * server authentication, and whether lock tokens are submitted
+	 * depends on the lock store registered with the session.  The
+	 * connection pool shares both with every request it serves. */
 	//I know I am hardcoding the scheme
 	//TODO: will have to change common.h to globally declare the scheme as well.
 	tmp_session = ne_session_create("http", i_hostname, i_port);
@@ -0,0 +1,487 @@
+/*
+   litmus: lock contention stress test
+   Copyright (C) 2005, Joe Orton <joe@manyfish.co.uk>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* The stress test is configured using environment variables:
+ *
+ *   STRESS_CLIENTS    number of client processes (default 4)
+ *   STRESS_DURATION   length of the timed run, in seconds (default 10)
+ *   STRESS_RESOURCES  number of resources shared by the clients
+ *                     (default 4)
+ *   STRESS_SHARED     percentage of locks which are shared (default 25)
+ *   STRESS_COLLS      percentage of locks which are depth infinity
+ *                     locks on a collection (default 10)
+ *
+ * The resources are spread across a three-level tree of collections:
+ * 'lockstress/', 'lockstress/a/' and 'lockstress/a/b/'.  Each client
+ * process has its own session and lock store, and repeatedly:
+ *
+ *  1. LOCKs a resource, or a collection with depth infinity
+ *  2. PUTs a body unique to the client and cycle to the resource (or
+ *     to a resource within the collection), with an If: header
+ *  3. for an exclusive lock, GETs the resource and checks the body
+ *  4. UNLOCKs the lock.
+ *
+ * A LOCK which fails with 423 Locked, or with a 207 Multi-Status
+ * response which gives 423 Locked for any resource, is counted, and
+ * the cycle is abandoned.  A PUT or UNLOCK which fails while the lock is held, or
+ * a body which changes while an exclusive lock is held, is a
+ * semantic violation, and fails the test. */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#include <ne_locks.h>
+#include <ne_207.h>
+#include <ne_string.h>
+#include <ne_uri.h>
+
+#include "tests.h"
+#include "common.h"
+
+#define DEF_CLIENTS (4)
+#define DEF_DURATION (10)
+#define DEF_RESOURCES (4)
+#define DEF_SHARED (25)
+#define DEF_COLLS (10)
+
+/* Depth of the collection tree. */
+#define NCOLLS (3)
+
+static int clients, duration, nres, shared_pct, colls_pct;
+
+/* collections, from the top; resource n is in colls[n % NCOLLS]. */
+static char *colls[NCOLLS];
+static char **resources;
+
+/* Results written by a client to the parent, followed by 'acquired'
+ * lock latencies. */
+struct client_result {
+    double elapsed;
+    unsigned long attempts; /* LOCK requests made */
+    unsigned long acquired; /* ...which succeeded */
+    unsigned long locked; /* ...which failed with 423, or 207 with 423 */
+    unsigned long errors; /* ...which failed otherwise */
+    unsigned long cycles; /* complete LOCK, modify, UNLOCK cycles */
+    unsigned long violations;
+    char violation[256]; /* description of the first violation */
+};
+
+/* Returns a random integer between 0 and n-1. */
+static int pick(unsigned int *seed, int n)
+{
+    return (int)((double)n * rand_r(seed) / (RAND_MAX + 1.0));
+}
+
+static int stress_init(void)
+{
+    CALL(env_int("STRESS_CLIENTS", DEF_CLIENTS, 1, INT_MAX, &clients));
+    CALL(env_int("STRESS_DURATION", DEF_DURATION, 1, INT_MAX, &duration));
+    CALL(env_int("STRESS_RESOURCES", DEF_RESOURCES, 1, INT_MAX, &nres));
+    CALL(env_int("STRESS_SHARED", DEF_SHARED, 0, 100, &shared_pct));
+    CALL(env_int("STRESS_COLLS", DEF_COLLS, 0, 100, &colls_pct));
+
+    /* don't log a message for each request! */
+    ne_debug_init(ne_debug_stream, ne_debug_mask & ~(NE_DBG_HTTPBODY|NE_DBG_HTTP|NE_DBG_LOCKS|NE_DBG_XML));
+
+    return OK;
+}
+
+static int precond(void)
+{
+    if (!i_class2) {
+	t_context("locking tests skipped,\n"
+		  "server does not claim Class 2 compliance");
+	return SKIPREST;
+    }
+
+    return OK;
+}
+
+static int create_tree(void)
+{
+    int n;
+
+    colls[0] = ne_concat(i_path, "lockstress/", NULL);
+    colls[1] = ne_concat(colls[0], "a/", NULL);
+    colls[2] = ne_concat(colls[1], "b/", NULL);
+
+    ne_delete(i_session, colls[0]);
+
+    for (n = 0; n < NCOLLS; n++)
+        ONMREQ("MKCOL", colls[n], ne_mkcol(i_session, colls[n]));
+
+    resources = ne_calloc(nres * sizeof *resources);
+    for (n = 0; n < nres; n++) {
+        char name[32];
+
+        ne_snprintf(name, sizeof name, "res-%d", n);
+        resources[n] = ne_concat(colls[n % NCOLLS], name, NULL);
+        ONMREQ("PUT", resources[n], ne_put(i_session, resources[n], i_foo_fd));
+    }
+
+    return OK;
+}
+
+/* The outcome of the last LOCK request made by a client, which
+ * ne_lock does not report: its status code, and for a 207 response,
+ * the number of responses and propstats in the body which gave 423
+ * Locked.  The body is parsed alongside ne_lock's own parser. */
+struct lock_outcome {
+    ne_request *req; /* the LOCK request in progress, or NULL */
+    ne_xml_parser *parser;
+    ne_207_parser *p207;
+    int code, locked;
+};
+
+static void *lo_start_response(void *userdata, const char *href)
+{
+    return userdata;
+}
+
+static void lo_end_status(void *userdata, void *response,
+                          const ne_status *status, const char *description)
+{
+    struct lock_outcome *lo = userdata;
+
+    if (status && status->code == 423)
+        lo->locked++;
+}
+
+static void lo_create(ne_request *req, void *userdata,
+                      const char *method, const char *requri)
+{
+    struct lock_outcome *lo = userdata;
+
+    if (strcmp(method, "LOCK")) return;
+
+    lo->req = req;
+    lo->code = lo->locked = 0;
+    lo->parser = ne_xml_create();
+    lo->p207 = ne_207_create(lo->parser, lo);
+    ne_207_set_response_handlers(lo->p207, lo_start_response, lo_end_status);
+    ne_207_set_propstat_handlers(lo->p207, NULL, lo_end_status);
+    ne_add_response_body_reader(req, ne_accept_207, ne_xml_parse_v,
+                                lo->parser);
+}
+
+static void lo_destroy(ne_request *req, void *userdata)
+{
+    struct lock_outcome *lo = userdata;
+
+    if (req != lo->req) return;
+
+    lo->code = ne_get_status(req)->code;
+    ne_207_destroy(lo->p207);
+    ne_xml_destroy(lo->parser);
+    lo->req = NULL;
+}
+
+/* Record a semantic violation in 'res'. */
+static void violation(struct client_result *res, const char *fmt, ...)
+    ne_attribute((format(printf, 2, 3)));
+
+static void violation(struct client_result *res, const char *fmt, ...)
+{
+    if (res->violations++ == 0) {
+        va_list ap;
+        va_start(ap, fmt);
+        ne_vsnprintf(res->violation, sizeof res->violation, fmt, ap);
+        va_end(ap);
+    }
+}
+
+/* PUT 'body' to 'uri' using any locks held on it. */
+static int put_body(ne_session *sess, const char *uri, const char *body)
+{
+    ne_request *req = ne_request_create(sess, "PUT", uri);
+    int ret;
+
+    ne_lock_using_resource(req, uri, 0);
+    ne_lock_using_parent(req, uri);
+    ne_set_request_body_buffer(req, body, strlen(body));
+
+    ret = ne_request_dispatch(req);
+    if (ret == NE_OK && ne_get_status(req)->klass != 2)
+        ret = NE_ERROR;
+
+    ne_request_destroy(req);
+    return ret;
+}
+
+static int collect(void *userdata, const char *buf, size_t len)
+{
+    ne_buffer_append(userdata, buf, len);
+    return 0;
+}
+
+/* GET 'uri' into 'buf'. */
+static int get_body(ne_session *sess, const char *uri, ne_buffer *buf)
+{
+    ne_request *req = ne_request_create(sess, "GET", uri);
+    int ret;
+
+    ne_buffer_clear(buf);
+    ne_add_response_body_reader(req, ne_accept_2xx, collect, buf);
+
+    ret = ne_request_dispatch(req);
+    if (ret == NE_OK && ne_get_status(req)->klass != 2)
+        ret = NE_ERROR;
+
+    ne_request_destroy(req);
+    return ret;
+}
+
+/* Run one LOCK, modify, UNLOCK cycle for client 'id'. */
+static void run_cycle(ne_session *sess, ne_lock_store *store, int id,
+                      struct lock_outcome *lo, unsigned int *seed,
+                      struct client_result *res,
+                      double **latency, size_t *alloc)
+{
+    struct ne_lock *lock = ne_lock_create();
+    const char *target;
+    char body[128];
+    double before;
+    int n = pick(seed, nres), ret;
+
+    ne_fill_server_uri(sess, &lock->uri);
+
+    if (pick(seed, 100) < colls_pct) {
+        /* lock the collection above resource n, or one further up. */
+        target = colls[pick(seed, n % NCOLLS + 1)];
+        lock->depth = NE_DEPTH_INFINITE;
+    } else {
+        target = resources[n];
+        lock->depth = NE_DEPTH_ZERO;
+    }
+
+    lock->uri.path = ne_strdup(target);
+    lock->scope = pick(seed, 100) < shared_pct
+        ? ne_lockscope_shared : ne_lockscope_exclusive;
+    lock->type = ne_locktype_write;
+    lock->timeout = 60;
+    lock->owner = ne_strdup("litmus lock stress test");
+
+    res->attempts++;
+    before = bench_now();
+    ret = ne_lock(sess, lock);
+    if (ret) {
+        if (lo->code == 423 || (lo->code == 207 && lo->locked))
+            res->locked++;
+        else
+            res->errors++;
+        ne_lock_destroy(lock);
+        return;
+    }
+
+    if (res->acquired == *alloc) {
+        *alloc = *alloc ? *alloc * 2 : 1024;
+        *latency = ne_realloc(*latency, *alloc * sizeof **latency);
+    }
+    (*latency)[res->acquired++] = bench_now() - before;
+
+    ne_lockstore_add(store, lock);
+
+    ne_snprintf(body, sizeof body, "client %d cycle %lu\n", id, res->cycles);
+
+    if (put_body(sess, resources[n], body)) {
+        violation(res, "PUT to `%s' under %s lock on `%s' failed: %s",
+                  resources[n], lock->scope == ne_lockscope_shared
+                  ? "shared" : "exclusive", target, ne_get_error(sess));
+    } else if (lock->scope == ne_lockscope_exclusive) {
+        ne_buffer *buf = ne_buffer_create();
+
+        if (get_body(sess, resources[n], buf)) {
+            res->errors++;
+        } else if (strcmp(buf->data, body)) {
+            violation(res, "`%s' changed under exclusive lock on `%s'",
+                      resources[n], target);
+        }
+        ne_buffer_destroy(buf);
+    }
+
+    if (ne_unlock(sess, lock)) {
+        violation(res, "UNLOCK of `%s' failed: %s", target,
+                  ne_get_error(sess));
+    } else {
+        res->cycles++;
+    }
+
+    ne_lockstore_remove(store, lock);
+    ne_lock_destroy(lock);
+}
+
+/* State of a client process. */
+static ne_session *client_sess;
+static ne_lock_store *client_store;
+static struct lock_outcome client_lo;
+
+static int client_setup(int id, void *userdata)
+{
+    client_sess = create_session();
+    client_store = ne_lockstore_create();
+
+    ne_lockstore_register(client_store, client_sess);
+    ne_hook_create_request(client_sess, lo_create, &client_lo);
+    ne_hook_destroy_request(client_sess, lo_destroy, &client_lo);
+
+    return 0;
+}
+
+/* Runs cycles in client 'id' for the configured duration and writes
+ * the results to 'out'. */
+static int client_run(int id, int out, void *userdata)
+{
+    struct client_result res;
+    unsigned int seed = id + 1;
+    double start, end, *latency = NULL;
+    size_t alloc = 0;
+
+    memset(&res, 0, sizeof res);
+
+    start = bench_now();
+    end = start + duration;
+
+    while (bench_now() < end)
+        run_cycle(client_sess, client_store, id, &client_lo, &seed, &res,
+                  &latency, &alloc);
+
+    res.elapsed = bench_now() - start;
+
+    if (full_write(out, &res, sizeof res)) return 1;
+    if (res.acquired && full_write(out, latency,
+                                   res.acquired * sizeof(double)))
+        return 1;
+
+    return 0;
+}
+
+/* Results collected from the clients. */
+struct stress_totals {
+    struct client_result total;
+    double *latency;
+    char violation[256]; /* the first violation, with client id */
+};
+
+/* Adds the results of a client, read from 'in', to the totals. */
+static int client_collect(int id, int in, void *userdata)
+{
+    struct stress_totals *tot = userdata;
+    struct client_result res, *total = &tot->total;
+
+    if (full_read(in, &res, sizeof res))
+        return 1;
+
+    tot->latency = ne_realloc(tot->latency,
+                              (total->acquired + res.acquired + 1)
+                              * sizeof(double));
+    if (res.acquired
+        && full_read(in, tot->latency + total->acquired,
+                     res.acquired * sizeof(double)))
+        return 1;
+
+    if (res.elapsed > total->elapsed) total->elapsed = res.elapsed;
+    total->attempts += res.attempts;
+    total->acquired += res.acquired;
+    total->locked += res.locked;
+    total->errors += res.errors;
+    total->cycles += res.cycles;
+    if (res.violations && total->violations == 0)
+        ne_snprintf(tot->violation, sizeof tot->violation, "client %d: %s",
+                    id, res.violation);
+    total->violations += res.violations;
+
+    return 0;
+}
+
+static int stress(void)
+{
+    static const struct child_ops ops = {
+        client_setup, client_run, client_collect
+    };
+    struct stress_totals tot;
+    struct client_result *total = &tot.total;
+    int failed;
+
+    memset(&tot, 0, sizeof tot);
+
+    failed = run_children(clients, &ops, &tot);
+
+    if (!failed && total->attempts) {
+        t_info("%d clients for %.1fs, %d resources, %d%% shared, "
+               "%d%% collection locks", clients, total->elapsed, nres,
+               shared_pct, colls_pct);
+        t_info("%lu LOCKs: %lu acquired, %lu locked (423/207, %.1f%%), "
+               "%lu other errors", total->attempts, total->acquired,
+               total->locked, 100.0 * total->locked / total->attempts,
+               total->errors);
+        t_info("%lu cycles, %.1f cycles/s, %.1f LOCKs/s", total->cycles,
+               total->cycles / total->elapsed,
+               total->attempts / total->elapsed);
+        if (total->acquired) {
+            sort_doubles(tot.latency, total->acquired);
+            t_info("lock acquisition latency p50 %.2fms p95 %.2fms "
+                   "p99 %.2fms",
+                   percentile(tot.latency, total->acquired, 50) * 1000.0,
+                   percentile(tot.latency, total->acquired, 95) * 1000.0,
+                   percentile(tot.latency, total->acquired, 99) * 1000.0);
+        }
+    }
+
+    if (tot.latency) ne_free(tot.latency);
+
+    ONN("a client failed to start or report its results", failed);
+    ONN("no locks were acquired", total->acquired == 0);
+    ONV(total->violations, ("%lu violations of locking semantics; "
+                            "first was %s", total->violations,
+                            tot.violation));
+
+    if (total->errors) {
+        t_warning("%lu requests failed", total->errors);
+    }
+
+    return OK;
+}
+
+static int delete_tree(void)
+{
+    ONMREQ("DELETE", colls[0], ne_delete(i_session, colls[0]));
+    return OK;
+}
+
+ne_test tests[] = {
+    INIT_TESTS,
+
+    T(options),
+    T(precond),
+    T(stress_init),
+    T(create_tree),
+
+    T_LEAKY(stress),
+
+    T(delete_tree),
+
+    FINISH_TESTS
+};
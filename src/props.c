@@ -331,12 +331,59 @@ static void pg_results(void *userdata, const char *uri,
     
 }
 
+/* Number of PROPFIND requests pipelined by propget. */
+#define NPIPE (4)
+
+struct pipe_results {
+    int result; /* FAIL if the results for any response were wrong */
+    int count; /* number of resources for which results were given */
+};
+
+static void pg_pipe_results(void *userdata, const char *uri,
+                            const ne_prop_result_set *rset)
+{
+    struct pipe_results *pr = userdata;
+    struct results r = {0};
+
+    pg_results(&r, uri, rset);
+    if (r.result) pr->result = r.result;
+    pr->count++;
+}
+
+/* As propget, but with several identical PROPFIND requests
+ * pipelined. */
+static int propget_pipelined(void)
+{
+    ne_propfind_handler *hdls[NPIPE];
+    struct pipe_results pr = {0};
+    int n, ret;
+
+    for (n = 0; n < NPIPE; n++)
+        hdls[n] = ne_propfind_create(i_session, prop_uri, NE_DEPTH_ZERO,
+                                     "PROPFIND");
+
+    ret = ne_propfind_named_pipeline(hdls, NPIPE, propnames, 
+                                     pg_pipe_results, &pr);
+
+    for (n = 0; n < NPIPE; n++)
+        ne_propfind_destroy(hdls[n]);
+
+    ONMREQ("PROPFIND", prop_uri, ret);
+    ONV(pr.count != NPIPE, 
+        ("%d responses returned for %d PROPFIND requests", pr.count, NPIPE));
+
+    return pr.result;
+}
+
 static int propget(void)
 {
     struct results r = {0};
 
     PRECOND(prop_ok);
 
+    if (i_pipeline) 
+        return propget_pipelined();
+
     r.result = 1;
     t_context("No responses returned");
 
@@ -0,0 +1,486 @@
+/*
+   litmus: PROPFIND collection scaling benchmark
+   Copyright (C) 2005, Joe Orton <joe@manyfish.co.uk>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* The benchmark is configured using environment variables:
+ *
+ *   SCALE_SIZES     comma-separated list of flat collection sizes, each
+ *                   optionally suffixed with k, meaning 1024 as for
+ *                   the other benchmarks (default 1k,10k,100k)
+ *   SCALE_TREE      fanout and depth of the nested tree, as
+ *                   "fanout,depth" (default 10,3); each collection in
+ *                   the tree has 'fanout' member collections, down to
+ *                   'depth' levels, and 'fanout' member resources
+ *   SCALE_INFLIGHT  number of requests kept in flight while creating
+ *                   the collections (default 8)
+ *
+ * For each flat collection, and for the tree, a PROPFIND is timed at
+ * Depth 1 and Depth infinity, for each of allprop, propname and a
+ * request for named properties.  Each PROPFIND is made in a new
+ * session by a child process, and the wall-clock time, client CPU
+ * time, bytes received and growth in the peak resident set size of
+ * the child process are reported. */
+
+#include "config.h"
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <sys/resource.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include <ne_props.h>
+#include <ne_basic.h>
+#include <ne_string.h>
+
+#include "tests.h"
+#include "common.h"
+
+#define DEF_SIZES "1k,10k,100k"
+#define DEF_TREE "10,3"
+#define DEF_INFLIGHT (8)
+
+#define MAX_SIZES (16)
+
+static long sizes[MAX_SIZES];
+static int nsizes, fanout, levels, inflight;
+
+/* the flat collections, and the top of the tree. */
+static char *flats[MAX_SIZES], *tree;
+static long tree_members;
+
+static const ne_propname named[] = {
+    { "DAV:", "getcontentlength" },
+    { "DAV:", "getlastmodified" },
+    { "DAV:", "getetag" },
+    { "DAV:", "resourcetype" },
+    { NULL }
+};
+
+enum scale_kind { SCALE_ALLPROP, SCALE_PROPNAME, SCALE_NAMED };
+
+static const char *const kind_names[] = { "allprop", "propname", "named" };
+
+/* Returns the CPU time used by this process, in seconds; sets *rss to
+ * the peak resident set size, in kilobytes. */
+static double cpu_time(long *rss)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    *rss = ru.ru_maxrss;
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int scale_init(void)
+{
+    const char *list = getenv("SCALE_SIZES"), *treespec = getenv("SCALE_TREE");
+    char *copy, *ptr;
+
+    CALL(env_int("SCALE_INFLIGHT", DEF_INFLIGHT, 1, INT_MAX, &inflight));
+
+    ptr = copy = ne_strdup(list ? list : DEF_SIZES);
+    nsizes = 0;
+    do {
+        char *token = ne_token(&ptr, ',');
+
+        if (nsizes == MAX_SIZES
+            || (sizes[nsizes] = parse_size(token)) < 1) {
+            t_context("invalid collection size list `%s'", list);
+            ne_free(copy);
+            return FAILHARD;
+        }
+        nsizes++;
+    } while (ptr);
+    ne_free(copy);
+
+    if (sscanf(treespec ? treespec : DEF_TREE, "%d,%d", &fanout, &levels) != 2
+        || fanout < 1 || levels < 1) {
+        t_context("invalid tree specification `%s'", treespec);
+        return FAILHARD;
+    }
+
+    /* don't log every response! */
+    ne_debug_init(ne_debug_stream, ne_debug_mask & ~(NE_DBG_HTTPBODY|NE_DBG_HTTP|NE_DBG_XML));
+
+    return OK;
+}
+
+/* State for creating a set of resources or collections. */
+struct populate {
+    ne_session *sess;
+    ne_engine *engine;
+    char **uris;
+    long count, next, failed;
+    int mkcol;
+};
+
+static void create_done(void *userdata, ne_request *req, int ret);
+
+/* Dispatch the request to create the next resource, if any. */
+static void create_next(struct populate *pop)
+{
+    ne_request *req;
+    static const char body[] = "litmus scaling test resource\n";
+
+    if (pop->next == pop->count) return;
+
+    if (pop->mkcol) {
+        req = ne_request_create(pop->sess, "MKCOL", pop->uris[pop->next]);
+    } else {
+        req = ne_request_create(pop->sess, "PUT", pop->uris[pop->next]);
+        ne_set_request_body_buffer(req, body, sizeof(body) - 1);
+    }
+    pop->next++;
+
+    ne_engine_dispatch(pop->engine, req, create_done, pop);
+}
+
+static void create_done(void *userdata, ne_request *req, int ret)
+{
+    struct populate *pop = userdata;
+
+    if ((ret != NE_OK || ne_get_status(req)->klass != 2) && !pop->failed++)
+        t_context("%s of collection member failed: %s",
+                  pop->mkcol ? "MKCOL" : "PUT", ret ? ne_get_error(pop->sess)
+                  : ne_get_status(req)->reason_phrase);
+
+    ne_request_destroy(req);
+    create_next(pop);
+}
+
+/* Create the 'count' resources, or collections if 'mkcol' is
+ * non-zero, in 'uris', keeping 'inflight' requests in flight. */
+static int create_all(ne_session *sess, char **uris, long count, int mkcol)
+{
+    struct populate pop;
+    int n, ret;
+
+    pop.sess = sess;
+    pop.engine = ne_engine_create();
+    pop.uris = uris;
+    pop.count = count;
+    pop.next = pop.failed = 0;
+    pop.mkcol = mkcol;
+
+    for (n = 0; n < inflight; n++)
+        create_next(&pop);
+
+    ret = ne_engine_run(pop.engine);
+    ne_engine_destroy(pop.engine);
+
+    ONN("creating collection members failed", ret || pop.failed);
+    return OK;
+}
+
+/* Create 'count' resources named res-N in collection 'coll'. */
+static int create_members(ne_session *sess, const char *coll, long count)
+{
+    char **uris = ne_calloc(count * sizeof *uris);
+    long n;
+    int ret;
+
+    for (n = 0; n < count; n++) {
+        char name[32];
+
+        ne_snprintf(name, sizeof name, "res-%ld", n);
+        uris[n] = ne_concat(coll, name, NULL);
+    }
+
+    ret = create_all(sess, uris, count, 0);
+
+    for (n = 0; n < count; n++)
+        ne_free(uris[n]);
+    ne_free(uris);
+
+    return ret;
+}
+
+/* Returns a session for creating collection members. */
+static ne_session *populate_session(void)
+{
+    ne_session *sess = create_session();
+
+    ne_set_connection_limits(sess, 0, inflight);
+    return sess;
+}
+
+static int create_flat(void)
+{
+    ne_session *sess = populate_session();
+    int n;
+
+    for (n = 0; n < nsizes; n++) {
+        char name[32];
+
+        ne_snprintf(name, sizeof name, "scale-%ld/", sizes[n]);
+        flats[n] = ne_concat(i_path, name, NULL);
+
+        ne_delete(i_session, flats[n]);
+        ONMREQ("MKCOL", flats[n], ne_mkcol(i_session, flats[n]));
+        CALL(create_members(sess, flats[n], sizes[n]));
+    }
+
+    ne_session_destroy(sess);
+    return OK;
+}
+
+static int create_tree(void)
+{
+    ne_session *sess = populate_session();
+    char **level = ne_malloc(sizeof *level);
+    long count = 1, n;
+    int depth;
+
+    tree = ne_concat(i_path, "scale-tree/", NULL);
+    ne_delete(i_session, tree);
+    ONMREQ("MKCOL", tree, ne_mkcol(i_session, tree));
+
+    level[0] = ne_strdup(tree);
+    tree_members = 0;
+
+    for (depth = 0; depth <= levels; depth++) {
+        char **next = NULL;
+
+        /* each collection gets 'fanout' resources... */
+        for (n = 0; n < count; n++)
+            CALL(create_members(sess, level[n], fanout));
+        tree_members += count * fanout;
+
+        /* ...and, above the bottom level, 'fanout' collections. */
+        if (depth < levels) {
+            long m;
+
+            next = ne_calloc(count * fanout * sizeof *next);
+            for (n = 0; n < count; n++) {
+                for (m = 0; m < fanout; m++) {
+                    char name[32];
+
+                    ne_snprintf(name, sizeof name, "coll-%ld/", m);
+                    next[n * fanout + m] = ne_concat(level[n], name, NULL);
+                }
+            }
+            CALL(create_all(sess, next, count * fanout, 1));
+            tree_members += count * fanout;
+        }
+
+        for (n = 0; n < count; n++)
+            ne_free(level[n]);
+        ne_free(level);
+        level = next;
+        count *= fanout;
+    }
+
+    ne_session_destroy(sess);
+    return OK;
+}
+
+static void count_results(void *userdata, const char *href,
+                          const ne_prop_result_set *results)
+{
+    long *count = userdata;
+    (*count)++;
+}
+
+/* Results of a PROPFIND, written by the child process which makes
+ * it to the parent. */
+struct measurement {
+    int ret; /* NE_* code */
+    long count; /* number of resources returned */
+    double elapsed, cpu; /* wall-clock and CPU time, in seconds */
+    double received; /* bytes received */
+    long rss; /* growth in peak resident set size, in kilobytes */
+    char error[512]; /* session error string, if failed */
+};
+
+/* A PROPFIND to be measured, and its results. */
+struct measure_args {
+    const char *uri;
+    int depth;
+    enum scale_kind kind;
+    struct measurement m;
+};
+
+/* Make the PROPFIND given by 'userdata' in a new session, in the child
+ * process, writing the results to 'out'. */
+static int run_measure(int id, int out, void *userdata)
+{
+    struct measure_args *args = userdata;
+    struct measurement *m = &args->m;
+    const char *uri = args->uri;
+    int depth = args->depth;
+    enum scale_kind kind = args->kind;
+    ne_session *sess = create_session();
+    ne_propfind_handler *ph;
+    ne_server_capabilities caps;
+    ne_session_stats before, after;
+    long rss_start, rss_end;
+    double start;
+
+    /* open the connection first, so it is not timed. */
+    ne_options(sess, uri, &caps);
+
+    ph = ne_propfind_create(sess, uri, depth, "PROPFIND");
+
+    ne_get_session_stats(sess, &before);
+    m->cpu = cpu_time(&rss_start);
+    start = bench_now();
+
+    switch (kind) {
+    case SCALE_ALLPROP:
+        m->ret = ne_propfind_allprop(ph, count_results, &m->count);
+        break;
+    case SCALE_PROPNAME:
+        m->ret = ne_propfind(ph, "<D:propname/>", count_results, &m->count,
+                             ne_propfind_method);
+        break;
+    default:
+        m->ret = ne_propfind_named(ph, named, count_results, &m->count);
+        break;
+    }
+
+    m->elapsed = bench_now() - start;
+    m->cpu = cpu_time(&rss_end) - m->cpu;
+    ne_get_session_stats(sess, &after);
+
+    m->received = after.received - before.received;
+    m->rss = rss_end - rss_start;
+    ne_strnzcpy(m->error, ne_get_error(sess), sizeof m->error);
+
+    ne_propfind_destroy(ph);
+    ne_session_destroy(sess);
+
+    return full_write(out, m, sizeof *m);
+}
+
+/* Read the results of the PROPFIND from the child process. */
+static int collect_measure(int id, int in, void *userdata)
+{
+    struct measure_args *args = userdata;
+
+    return full_read(in, &args->m, sizeof args->m);
+}
+
+/* Time a PROPFIND of type 'kind' with given 'depth' against
+ * collection 'uri'; at least 'expect' resources must be returned.
+ * The PROPFIND is made by a child process, so that its peak memory
+ * use is not hidden by that of earlier measurements. */
+static int measure(const char *uri, int depth, enum scale_kind kind,
+                   long expect)
+{
+    static const struct child_ops ops = {
+        NULL, run_measure, collect_measure
+    };
+    struct measure_args args;
+    struct measurement *const m = &args.m;
+
+    memset(&args, 0, sizeof args);
+    args.uri = uri;
+    args.depth = depth;
+    args.kind = kind;
+
+    /* run_children checks the child's exit status. */
+    ONN("measurement process failed", run_children(1, &ops, &args));
+
+    if (m->ret == NE_ERROR && depth == NE_DEPTH_INFINITE
+        && atoi(m->error) == 403) {
+        t_warning("Depth infinity PROPFIND refused for `%s'", uri);
+        return OK;
+    }
+
+    ONV(m->ret, ("PROPFIND %s, Depth %s, on `%s' failed: %s",
+                 kind_names[kind], depth == NE_DEPTH_ONE ? "1" : "infinity",
+                 uri, m->error));
+
+    ONV(m->count < expect, ("PROPFIND %s on `%s' returned %ld resources, "
+                            "expected %ld", kind_names[kind], uri, m->count,
+                            expect));
+
+    t_info("%-8s depth %-8s %7ld resources: %.3fs (%.1fus each), "
+           "cpu %.3fs, %.1fKB received, child peak RSS +%ldKB",
+           kind_names[kind], depth == NE_DEPTH_ONE ? "1" : "infinity",
+           m->count, m->elapsed, m->elapsed * 1e6 / m->count, m->cpu,
+           m->received / 1024.0, m->rss);
+
+    return OK;
+}
+
+/* Time each kind of PROPFIND at Depth 1 and infinity against 'uri',
+ * which has 'members' members, 'children' of which are immediate. */
+static int measure_all(const char *uri, long children, long members)
+{
+    int kind;
+
+    for (kind = SCALE_ALLPROP; kind <= SCALE_NAMED; kind++) {
+        CALL(measure(uri, NE_DEPTH_ONE, kind, children + 1));
+        CALL(measure(uri, NE_DEPTH_INFINITE, kind, members + 1));
+    }
+
+    return OK;
+}
+
+static int propfind_flat(void)
+{
+    int n;
+
+    for (n = 0; n < nsizes; n++) {
+        t_info("collection of %ld members:", sizes[n]);
+        CALL(measure_all(flats[n], sizes[n], sizes[n]));
+    }
+
+    return OK;
+}
+
+static int propfind_tree(void)
+{
+    t_info("tree of %ld members, fanout %d, depth %d:", tree_members,
+           fanout, levels);
+    return measure_all(tree, 2 * fanout, tree_members);
+}
+
+static int cleanup(void)
+{
+    int n;
+
+    for (n = 0; n < nsizes; n++)
+        ONMREQ("DELETE", flats[n], ne_delete(i_session, flats[n]));
+    ONMREQ("DELETE", tree, ne_delete(i_session, tree));
+
+    return OK;
+}
+
+ne_test tests[] = {
+    INIT_TESTS,
+
+    T(scale_init),
+    T(create_flat),
+    T(create_tree),
+
+    T_LEAKY(propfind_flat),
+    T_LEAKY(propfind_tree),
+
+    T(cleanup),
+
+    FINISH_TESTS
+};
@@ -0,0 +1,391 @@
+/*
+   litmus: deep-tree COPY/MOVE/DELETE scaling benchmark
+   Copyright (C) 2005, Joe Orton <joe@manyfish.co.uk>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* The benchmark is configured using environment variables:
+ *
+ *   TREE_FANOUT    number of member collections and member resources
+ *                  of each collection in a tree (default 4)
+ *   TREE_DEPTHS    comma-separated list of tree depths (default 1,2,3)
+ *   TREE_INFLIGHT  number of requests kept in flight while creating
+ *                  the trees (default 8)
+ *
+ * For each depth, a tree is created, and then a COPY of the tree with
+ * Depth infinity, a MOVE of the copy within the same parent
+ * collection, and a DELETE of the moved copy and of the tree are
+ * timed.  The response bodies of any 207 responses are parsed as they
+ * arrive, and the responses for which the server reports an error are
+ * counted.  A warning is given if the time taken by the MOVE, which
+ * need not touch each member, grows with the size of the tree. */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include <ne_request.h>
+#include <ne_basic.h>
+#include <ne_207.h>
+#include <ne_string.h>
+
+#include "tests.h"
+#include "common.h"
+
+#define DEF_FANOUT (4)
+#define DEF_DEPTHS "1,2,3"
+#define DEF_INFLIGHT (8)
+
+#define MAX_DEPTHS (16)
+
+/* The MOVE of the largest tree may take this many times as long as
+ * that of the smallest, or up to MOVE_MIN seconds, before it is not
+ * "constant-time". */
+#define MOVE_FACTOR (4.0)
+#define MOVE_MIN (0.1)
+
+static int depths[MAX_DEPTHS];
+static int ndepths, fanout, inflight;
+
+/* The number of members of each tree, and the time taken to MOVE
+ * it. */
+static long members[MAX_DEPTHS];
+static double move_times[MAX_DEPTHS];
+
+static int tree_init(void)
+{
+    const char *list = getenv("TREE_DEPTHS");
+    char *copy, *ptr;
+
+    CALL(env_int("TREE_FANOUT", DEF_FANOUT, 1, INT_MAX, &fanout));
+    CALL(env_int("TREE_INFLIGHT", DEF_INFLIGHT, 1, INT_MAX, &inflight));
+
+    ptr = copy = ne_strdup(list ? list : DEF_DEPTHS);
+    ndepths = 0;
+    do {
+        char *token = ne_token(&ptr, ','), *end;
+
+        if (ndepths < MAX_DEPTHS)
+            depths[ndepths] = strtol(token, &end, 10);
+        if (ndepths == MAX_DEPTHS || end == token || *end
+            || depths[ndepths] < 1) {
+            t_context("invalid tree depth list `%s'", list);
+            ne_free(copy);
+            return FAILHARD;
+        }
+        ndepths++;
+    } while (ptr);
+    ne_free(copy);
+
+    /* don't log every response! */
+    ne_debug_init(ne_debug_stream, ne_debug_mask & ~(NE_DBG_HTTPBODY|NE_DBG_HTTP|NE_DBG_XML));
+
+    return OK;
+}
+
+/* State for creating a set of resources or collections. */
+struct populate {
+    ne_session *sess;
+    ne_engine *engine;
+    char **uris;
+    long count, next, failed;
+    int mkcol;
+};
+
+static void create_done(void *userdata, ne_request *req, int ret);
+
+/* Dispatch the request to create the next resource, if any. */
+static void create_next(struct populate *pop)
+{
+    ne_request *req;
+    static const char body[] = "litmus tree test resource\n";
+
+    if (pop->next == pop->count) return;
+
+    if (pop->mkcol) {
+        req = ne_request_create(pop->sess, "MKCOL", pop->uris[pop->next]);
+    } else {
+        req = ne_request_create(pop->sess, "PUT", pop->uris[pop->next]);
+        ne_set_request_body_buffer(req, body, sizeof(body) - 1);
+    }
+    pop->next++;
+
+    ne_engine_dispatch(pop->engine, req, create_done, pop);
+}
+
+static void create_done(void *userdata, ne_request *req, int ret)
+{
+    struct populate *pop = userdata;
+
+    if ((ret != NE_OK || ne_get_status(req)->klass != 2) && !pop->failed++)
+        t_context("%s of tree member failed: %s",
+                  pop->mkcol ? "MKCOL" : "PUT", ret ? ne_get_error(pop->sess)
+                  : ne_get_status(req)->reason_phrase);
+
+    ne_request_destroy(req);
+    create_next(pop);
+}
+
+/* Create the 'count' resources, or collections if 'mkcol' is
+ * non-zero, in 'uris', keeping 'inflight' requests in flight. */
+static int create_all(ne_session *sess, char **uris, long count, int mkcol)
+{
+    struct populate pop;
+    int n, ret;
+
+    pop.sess = sess;
+    pop.engine = ne_engine_create();
+    pop.uris = uris;
+    pop.count = count;
+    pop.next = pop.failed = 0;
+    pop.mkcol = mkcol;
+
+    for (n = 0; n < inflight; n++)
+        create_next(&pop);
+
+    ret = ne_engine_run(pop.engine);
+    ne_engine_destroy(pop.engine);
+
+    ONN("creating tree members failed", ret || pop.failed);
+    return OK;
+}
+
+/* Create a tree of the given 'depth' at collection 'top', which must
+ * exist; each collection has 'fanout' member resources and, above the
+ * bottom level, 'fanout' member collections.  Places the number of
+ * members in *total. */
+static int create_tree(const char *top, int depth, long *total)
+{
+    ne_session *sess = create_session();
+    char **level = ne_malloc(sizeof *level), **uris;
+    long count = 1, n, m;
+    int d;
+
+    ne_set_connection_limits(sess, 0, inflight);
+
+    level[0] = ne_strdup(top);
+    *total = 0;
+
+    for (d = 0; d <= depth; d++) {
+        char **next = NULL;
+
+        /* each collection gets 'fanout' resources... */
+        uris = ne_calloc(count * fanout * sizeof *uris);
+        for (n = 0; n < count; n++) {
+            for (m = 0; m < fanout; m++) {
+                char name[32];
+
+                ne_snprintf(name, sizeof name, "res-%ld", m);
+                uris[n * fanout + m] = ne_concat(level[n], name, NULL);
+            }
+        }
+        CALL(create_all(sess, uris, count * fanout, 0));
+        for (n = 0; n < count * fanout; n++)
+            ne_free(uris[n]);
+        ne_free(uris);
+        *total += count * fanout;
+
+        /* ...and, above the bottom level, 'fanout' collections. */
+        if (d < depth) {
+            next = ne_calloc(count * fanout * sizeof *next);
+            for (n = 0; n < count; n++) {
+                for (m = 0; m < fanout; m++) {
+                    char name[32];
+
+                    ne_snprintf(name, sizeof name, "coll-%ld/", m);
+                    next[n * fanout + m] = ne_concat(level[n], name, NULL);
+                }
+            }
+            CALL(create_all(sess, next, count * fanout, 1));
+            *total += count * fanout;
+        }
+
+        for (n = 0; n < count; n++)
+            ne_free(level[n]);
+        ne_free(level);
+        level = next;
+        count *= fanout;
+    }
+
+    ne_session_destroy(sess);
+    return OK;
+}
+
+/* Errors reported in a 207 response: the number of responses and
+ * propstats with a non-2xx status, and the first such. */
+struct errors {
+    long count;
+    char *href, *first;
+};
+
+static void *start_response(void *userdata, const char *href)
+{
+    struct errors *errs = userdata;
+
+    if (errs->href) ne_free(errs->href);
+    errs->href = ne_strdup(href);
+    return errs;
+}
+
+static void end_status(void *userdata, void *response,
+                       const ne_status *status, const char *description)
+{
+    struct errors *errs = userdata;
+
+    if (status && status->klass != 2) {
+        if (errs->count++ == 0)
+            errs->first = ne_concat(errs->href ? errs->href : "(unknown)",
+                                    ": ", status->reason_phrase, NULL);
+    }
+}
+
+/* Perform 'method' on 'src', with Destination header 'dest' and the
+ * given depth, if either is not NULL or -1; reports the time taken,
+ * and any errors given in a 207 response, for a tree of 'total'
+ * members. */
+static int tree_op(const char *method, const char *src, const char *dest,
+                   int depth, long total, double *taken)
+{
+    ne_request *req = ne_request_create(i_session, method, src);
+    ne_xml_parser *p = ne_xml_create();
+    struct errors errs = {0};
+    ne_207_parser *p207 = ne_207_create(p, &errs);
+    const ne_status *st;
+    double start;
+    int ret;
+
+    /* the 207 body is parsed as it is read, so only the count of
+     * errors and the first is kept. */
+    ne_207_set_response_handlers(p207, start_response, end_status);
+    ne_207_set_propstat_handlers(p207, NULL, end_status);
+
+    ne_add_response_body_reader(req, ne_accept_207, ne_xml_parse_v, p);
+
+    if (depth != -1) ne_add_depth_header(req, depth);
+    if (dest) {
+        ne_print_request_header(req, "Destination", "%s://%s%s",
+                                 ne_get_scheme(i_session),
+                                 ne_get_server_hostport(i_session), dest);
+        ne_add_request_header(req, "Overwrite", "F");
+    }
+
+    start = bench_now();
+    ret = ne_request_dispatch(req);
+    *taken = bench_now() - start;
+    st = ne_get_status(req);
+
+    if (ret == NE_OK && st->code == 207 && ne_xml_failed(p)) {
+        t_context("%s of `%s': invalid 207 response: %s", method, src,
+                  ne_xml_get_error(p));
+        ret = NE_ERROR;
+    } else if (ret == NE_OK && st->klass != 2) {
+        t_context("%s of `%s' failed: %d %s", method, src, st->code,
+                  st->reason_phrase);
+        ret = NE_ERROR;
+    } else if (ret) {
+        t_context("%s of `%s' failed: %s", method, src,
+                  ne_get_error(i_session));
+    }
+
+    if (ret == NE_OK) {
+        t_info("%-6s %7ld members: %.3fs (%.1fus per member), "
+               "%ld errors", method, total, *taken, *taken * 1e6 / total,
+               errs.count);
+        if (errs.count)
+            t_warning("%s of `%s' reported %ld errors, the first for %s",
+                      method, src, errs.count, errs.first);
+    }
+
+    ne_207_destroy(p207);
+    ne_xml_destroy(p);
+    ne_request_destroy(req);
+    if (errs.href) ne_free(errs.href);
+    if (errs.first) ne_free(errs.first);
+
+    return ret == NE_OK ? OK : FAIL;
+}
+
+static int tree_ops(void)
+{
+    int n;
+
+    for (n = 0; n < ndepths; n++) {
+        char name[32], *top, *copy, *moved;
+        double taken;
+
+        ne_snprintf(name, sizeof name, "tree-%d", depths[n]);
+        top = ne_concat(i_path, name, "/", NULL);
+        copy = ne_concat(i_path, name, "-copy/", NULL);
+        moved = ne_concat(i_path, name, "-moved/", NULL);
+
+        ne_delete(i_session, top);
+        ne_delete(i_session, copy);
+        ne_delete(i_session, moved);
+
+        ONMREQ("MKCOL", top, ne_mkcol(i_session, top));
+        CALL(create_tree(top, depths[n], &members[n]));
+
+        t_info("tree of depth %d, fanout %d:", depths[n], fanout);
+        CALL(tree_op("COPY", top, copy, NE_DEPTH_INFINITE, members[n],
+                     &taken));
+        CALL(tree_op("MOVE", copy, moved, -1, members[n], &move_times[n]));
+        CALL(tree_op("DELETE", moved, NULL, -1, members[n], &taken));
+        CALL(tree_op("DELETE", top, NULL, -1, members[n], &taken));
+
+        ne_free(top);
+        ne_free(copy);
+        ne_free(moved);
+    }
+
+    return OK;
+}
+
+/* Check that the MOVE of the largest tree took not much longer than
+ * that of the smallest. */
+static int move_scaling(void)
+{
+    int n, small = 0, large = 0;
+
+    for (n = 1; n < ndepths; n++) {
+        if (members[n] < members[small]) small = n;
+        if (members[n] > members[large]) large = n;
+    }
+
+    if (members[large] > members[small]
+        && move_times[large] > MOVE_MIN
+        && move_times[large] > MOVE_FACTOR * move_times[small]) {
+        t_warning("MOVE of %ld members took %.3fs, of %ld members %.3fs",
+                  members[small], move_times[small],
+                  members[large], move_times[large]);
+    }
+
+    return OK;
+}
+
+ne_test tests[] = {
+    INIT_TESTS,
+
+    T(tree_init),
+    T_LEAKY(tree_ops),
+    T(move_scaling),
+
+    FINISH_TESTS
+};
@@ -40,6 +40,12 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#include <fcntl.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <sys/resource.h>
+#include <time.h>
 
 #include "ne_string.h"
 #include "ne_utils.h"
@@ -59,15 +65,31 @@ int test_argc;
 const char *test_suite;
 int test_num;
 
+test_iostats_fn test_iostats;
+
 /* statistics for all tests so far */
 static int passes = 0, fails = 0, skipped = 0, warnings = 0;
 
 /* per-test globals: */
-static int warned, aborted = 0;
+static int warned, informed, aborted = 0;
 static const char *test_name; /* current test name */
 
 static int use_colour = 0;
 
+/* per-test timing, enabled by setting $TEST_TIMING: */
+static int use_timing = 0;
+static double *test_times;
+
+/* number of slowest tests listed in the timing summary. */
+#define SLOWEST_COUNT (5)
+
+/* machine-readable results: a JSON record is written for each test
+ * to results_fd, if $TEST_RESULTS is set; JUnit XML <testcase>
+ * elements are collected in 'junit' if $TEST_JUNIT is set. */
+static int results_fd = -1;
+static ne_buffer *junit;
+static int junit_fails, junit_skips;
+
 /* resource for ANSI escape codes:
  * http://www.isthe.com/chongo/tech/comp/ansi_escapes.html */
 #define COL(x) do { if (use_colour) printf("\033[" x "m"); } while (0)
@@ -96,10 +118,265 @@ void t_warning(const char *str, ...)
     putchar('\n');
 }    
 
+void t_info(const char *str, ...)
+{
+    va_list ap;
+    va_start(ap, str);
+    vprintf(str, ap);
+    va_end(ap);
+    informed = 1;
+    putchar('\n');
+}
+
+/* Returns a monotonic timestamp in seconds. */
+static double wall_time(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+}
+
+/* Returns the user and system CPU time used by this process, in
+ * seconds. */
+static double cpu_time(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru))
+        return 0;
+
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Print the time taken by the suite, split between client CPU time
+ * and the remainder (waiting on the network, the server, or anything
+ * else), the suite's network traffic if the suite reports it, and
+ * list the slowest tests.  'requests', 'sent' and 'received' are the
+ * I/O counters at the start of the suite. */
+static void print_timing(int count, double elapsed, double cpu,
+                         unsigned long requests, off_t sent, off_t received)
+{
+    int n, m, shown[SLOWEST_COUNT];
+
+    printf("-> timing for `%s': %.3fs elapsed, %.3fs client CPU, "
+           "%.3fs non-CPU time.\n", test_suite, elapsed, cpu,
+           elapsed > cpu ? elapsed - cpu : 0.0);
+
+    if (test_iostats) {
+        unsigned long requests_end;
+        off_t sent_end, received_end;
+
+        test_iostats(&requests_end, &sent_end, &received_end);
+        printf("-> network for `%s': %lu requests, %" NE_FMT_OFF_T
+               " bytes sent, %" NE_FMT_OFF_T " bytes received.\n",
+               test_suite, requests_end - requests, sent_end - sent,
+               received_end - received);
+    }
+
+    for (m = 0; m < SLOWEST_COUNT && m < count; m++) {
+        int slowest = -1;
+
+        for (n = 0; n < count; n++) {
+            int k;
+            
+            for (k = 0; k < m && shown[k] != n; k++)
+                /* nullop */;
+
+            if (k == m && (slowest == -1 
+                           || test_times[n] > test_times[slowest]))
+                slowest = n;
+        }
+        
+        shown[m] = slowest;
+        if (m == 0) printf("-> slowest tests:\n");
+        printf("   %8.3fs  %2d. %s\n", test_times[slowest], slowest,
+               tests[slowest].name);
+    }
+}
+
+/* Append string 'str' to 'buf' as a JSON string literal. */
+static void json_append(ne_buffer *buf, const char *str)
+{
+    ne_buffer_czappend(buf, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            char esc[2] = { '\\', *str };
+            ne_buffer_append(buf, esc, 2);
+        } else if ((unsigned char)*str < 0x20) {
+            char esc[8];
+            ne_snprintf(esc, sizeof esc, "\\u%04x", (unsigned char)*str);
+            ne_buffer_zappend(buf, esc);
+        } else {
+            ne_buffer_append(buf, str, 1);
+        }
+    }
+    ne_buffer_czappend(buf, "\"");
+}
+
+/* Append string 'str' to 'buf' escaped for use as XML attribute
+ * value. */
+static void xml_append(ne_buffer *buf, const char *str)
+{
+    for (; *str; str++) {
+        switch (*str) {
+        case '&': ne_buffer_czappend(buf, "&amp;"); break;
+        case '<': ne_buffer_czappend(buf, "&lt;"); break;
+        case '>': ne_buffer_czappend(buf, "&gt;"); break;
+        case '"': ne_buffer_czappend(buf, "&quot;"); break;
+        case '\n': ne_buffer_czappend(buf, "&#10;"); break;
+        default:
+            /* control characters are not allowed in XML 1.0. */
+            if ((unsigned char)*str < 0x20)
+                ne_buffer_czappend(buf, "?");
+            else
+                ne_buffer_append(buf, str, 1);
+            break;
+        }
+    }
+}
+
+/* Open the machine-readable results outputs, if requested.  Returns
+ * non-zero on error. */
+static int open_results(void)
+{
+    const char *path = getenv("TEST_RESULTS");
+
+    if (path && strncmp(path, "fd:", 3) == 0) {
+        results_fd = atoi(path + 3);
+    } else if (path) {
+        results_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (results_fd < 0) {
+            fprintf(stderr, "%s: Could not open %s: %s\n", test_suite,
+                    path, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (getenv("TEST_JUNIT")) {
+        junit = ne_buffer_create();
+    }
+
+    return 0;
+}
+
+/* Output the result of test 'n', with given outcome. */
+static void record_result(int n, const char *outcome, double elapsed,
+                          unsigned long requests, off_t sent, off_t received)
+{
+    char num[128];
+
+    if (results_fd >= 0) {
+        ne_buffer *buf = ne_buffer_create();
+
+        ne_buffer_czappend(buf, "{\"suite\": ");
+        json_append(buf, test_suite);
+        ne_snprintf(num, sizeof num, ", \"index\": %d, \"name\": ", n);
+        ne_buffer_zappend(buf, num);
+        json_append(buf, tests[n].name);
+        ne_buffer_concat(buf, ", \"result\": \"", outcome, "\"", NULL);
+        ne_snprintf(num, sizeof num, ", \"warnings\": %d, \"context\": ", 
+                    warned);
+        ne_buffer_zappend(buf, num);
+        if (have_context)
+            json_append(buf, test_context);
+        else
+            ne_buffer_czappend(buf, "null");
+        ne_snprintf(num, sizeof num, ", \"duration\": %.6f, "
+                    "\"bytes_sent\": %" NE_FMT_OFF_T ", "
+                    "\"bytes_received\": %" NE_FMT_OFF_T ", "
+                    "\"requests\": %lu}\n",
+                    elapsed, sent, received, requests);
+        ne_buffer_zappend(buf, num);
+
+        /* write the record in one write() call, so that records from
+         * concurrently running suites are not interleaved. */
+        if (write(results_fd, buf->data, ne_buffer_size(buf)) < 0) {
+            fprintf(stderr, "%s: Could not write results: %s\n", test_suite,
+                    strerror(errno));
+        }
+        ne_buffer_destroy(buf);
+    }
+
+    if (junit) {
+        ne_buffer_czappend(junit, "  <testcase classname=\"");
+        xml_append(junit, test_suite);
+        ne_buffer_czappend(junit, "\" name=\"");
+        xml_append(junit, tests[n].name);
+        ne_snprintf(num, sizeof num, "\" time=\"%.6f\"", elapsed);
+        ne_buffer_zappend(junit, num);
+        if (strcmp(outcome, "fail") == 0 || strcmp(outcome, "skip") == 0) {
+            if (outcome[0] == 'f') {
+                ne_buffer_czappend(junit, ">\n    <failure message=\"");
+                junit_fails++;
+            } else {
+                ne_buffer_czappend(junit, ">\n    <skipped message=\"");
+                junit_skips++;
+            }
+            xml_append(junit, have_context ? test_context : "");
+            ne_buffer_czappend(junit, "\"/>\n  </testcase>\n");
+        } else {
+            ne_buffer_czappend(junit, "/>\n");
+        }
+    }
+}
+
+/* Close the machine-readable results outputs; writing the JUnit XML
+ * document for the 'count' tests run, if requested. */
+static void close_results(int count, double elapsed)
+{
+    if (results_fd >= 0 && results_fd > STDERR_FILENO) {
+        close(results_fd);
+    }
+
+    if (junit) {
+        char *fn = ne_concat(getenv("TEST_JUNIT"), "/", test_suite, ".xml",
+                             NULL);
+        FILE *f = fopen(fn, "w");
+
+        if (f == NULL) {
+            fprintf(stderr, "%s: Could not open %s: %s\n", test_suite, fn,
+                    strerror(errno));
+        } else {
+            ne_buffer *hdr = ne_buffer_create();
+            char num[128];
+
+            ne_buffer_czappend(hdr, "<?xml version=\"1.0\" "
+                               "encoding=\"utf-8\"?>\n<testsuite name=\"");
+            xml_append(hdr, test_suite);
+            ne_snprintf(num, sizeof num, "\" tests=\"%d\" failures=\"%d\" "
+                        "skipped=\"%d\" time=\"%.6f\">\n", count,
+                        junit_fails, junit_skips, elapsed);
+            ne_buffer_zappend(hdr, num);
+            fputs(hdr->data, f);
+            fputs(junit->data, f);
+            fputs("</testsuite>\n", f);
+            if (fclose(f)) {
+                fprintf(stderr, "%s: Error writing %s: %s\n", test_suite,
+                        fn, strerror(errno));
+            }
+            ne_buffer_destroy(hdr);
+        }
+
+        ne_free(fn);
+        ne_buffer_destroy(junit);
+    }
+}
+
 #define TEST_DEBUG \
 (NE_DBG_HTTP | NE_DBG_SOCKET | NE_DBG_HTTPBODY | NE_DBG_HTTPAUTH | \
  NE_DBG_LOCKS | NE_DBG_XMLPARSE | NE_DBG_XML | NE_DBG_SSL)
 
+/* Size of the debug log ring buffer, if enabled. */
+#define DEBUG_RING_SIZE (4 * 1024 * 1024)
+
 #define W(m) do { if (write(0, m, strlen(m)) < 0) exit(99); } while(0)
 
 #define W_RED(m) do { if (use_colour) W("\033[41;37;01m"); \
@@ -140,7 +417,10 @@ void in_child(void)
 
 int main(int argc, char *argv[])
 {
-    int n;
+    int n, count;
+    double suite_start = 0, suite_cpu = 0;
+    unsigned long suite_requests = 0;
+    off_t suite_sent = 0, suite_received = 0;
     static const char dots[] = "......................";
     
     /* get basename(argv[0]) */
@@ -157,6 +437,10 @@ int main(int argc, char *argv[])
     }
 #endif
 
+    if (getenv("TEST_TIMING") != NULL) {
+        use_timing = 1;
+    }
+
     test_argc = argc;
     test_argv = argv;
 
@@ -179,6 +463,12 @@ int main(int argc, char *argv[])
 	return -1;
     }
 
+    if (open_results()) {
+        fclose(debug);
+        fclose(child_debug);
+        return -1;
+    }
+
     /* install special SEGV handler. */
     signal(SIGSEGV, parent_segv);
     signal(SIGABRT, parent_segv);
@@ -195,15 +485,50 @@ int main(int argc, char *argv[])
     /* another silly test. */
     NE_DEBUG(0, "This message should also go to /dev/null");
 
+    /* $TEST_DEBUG_RING buffers the debug log in memory, to be written
+     * out in the background; if set to "binary", binary records are
+     * written, which debug-decode turns back into text.
+     * $TEST_DEBUG_RATE limits each channel to that many messages per
+     * second. */
+    if (getenv("TEST_DEBUG_RING") != NULL) {
+        unsigned int flags = 0;
+
+        if (strcmp(getenv("TEST_DEBUG_RING"), "binary") == 0)
+            flags = NE_DEBUG_BINARY;
+        if (ne_debug_ring(DEBUG_RING_SIZE, flags)) {
+            fprintf(stderr, "%s: Asynchronous debugging not supported.\n",
+                    test_suite);
+        }
+    }
+
+    if (getenv("TEST_DEBUG_RATE") != NULL) {
+        ne_debug_ratelimit(TEST_DEBUG, atoi(getenv("TEST_DEBUG_RATE")));
+    }
+
     if (ne_sock_init()) {
 	COL("43;01"); printf("WARNING:"); NOCOL;
 	printf(" Socket library initalization failed.\n");
     }
 
     printf("-> running `%s':\n", test_suite);
+
+    if (use_timing) {
+        for (n = 0; tests[n].fn != NULL; n++)
+            /* nullop */;
+        test_times = ne_calloc(n * sizeof *test_times);
+    }
+    suite_start = wall_time();
+    suite_cpu = cpu_time();
+    if (use_timing && test_iostats) {
+        test_iostats(&suite_requests, &suite_sent, &suite_received);
+    }
     
     for (n = 0; !aborted && tests[n].fn != NULL; n++) {
 	int result, is_xfail = 0;
+        double started, elapsed;
+        const char *outcome;
+        unsigned long requests = 0, requests_after = 0;
+        off_t sent = 0, sent_after = 0, received = 0, received_after = 0;
 #ifdef NEON_MEMLEAK
         size_t allocated = ne_alloc_used;
         int is_xleaky = 0;
@@ -214,13 +539,26 @@ int main(int argc, char *argv[])
 	       (int) (strlen(dots) - strlen(test_name)), dots);
 	have_context = 0;
 	test_num = n;
-	warned = 0;
+	warned = informed = 0;
 	fflush(stdout);
 	NE_DEBUG(TEST_DEBUG, "******* Running test %d: %s ********\n", 
 		 n, test_name);
 
+        if (test_iostats) {
+            test_iostats(&requests, &sent, &received);
+        }
+
 	/* run the test. */
+        started = wall_time();
 	result = tests[n].fn();
+        elapsed = wall_time() - started;
+        if (use_timing) {
+            test_times[n] = elapsed;
+        }
+
+        if (test_iostats) {
+            test_iostats(&requests_after, &sent_after, &received_after);
+        }
 
 #ifdef NEON_MEMLEAK
         /* issue warnings for memory leaks, if requested */
@@ -253,18 +591,24 @@ int main(int argc, char *argv[])
         }
 
 	/* align the result column if we've had warnings. */
-	if (warned) {
+	if (warned || informed) {
 	    printf("    %s ", dots);
 	}
 
+        if (use_timing) {
+            printf("%8.3fs ", test_times[n]);
+        }
+
 	switch (result) {
 	case OK:
             if (is_xfail) {
                 COL("32;07"); 
                 printf("xfail");
+                outcome = "xfail";
             } else {
                 COL("32"); 
                 printf("pass"); 
+                outcome = "pass";
             }
             NOCOL;
 	    if (warned) {
@@ -284,6 +628,7 @@ int main(int argc, char *argv[])
 	    /* fall-through */
 	case FAIL:
 	    COL("41;37;01"); printf("FAIL"); NOCOL;
+            outcome = "fail";
 	    if (have_context) {
 		printf(" (%s)", test_context);
 	    }
@@ -295,6 +640,7 @@ int main(int argc, char *argv[])
 	    /* fall-through */
 	case SKIP:
 	    COL("44;37;01"); printf("SKIPPED"); NOCOL;
+            outcome = "skip";
 	    if (have_context) {
 		printf(" (%s)", test_context);
 	    }
@@ -304,12 +650,18 @@ int main(int argc, char *argv[])
 	default:
 	    COL("41;37;01"); printf("OOPS"); NOCOL;
 	    printf(" unexpected test result `%d'\n", result);
+            outcome = "fail";
 	    break;
 	}
 
+        record_result(n, outcome, elapsed, requests_after - requests,
+                      sent_after - sent, received_after - received);
+
 	reap_server();
     }
 
+    count = n;
+
     /* discount skipped tests */
     if (skipped) {
 	printf("-> %d %s.\n", skipped,
@@ -334,6 +686,18 @@ int main(int argc, char *argv[])
 	}
     }
 
+    if (use_timing) {
+        print_timing(count, wall_time() - suite_start, 
+                     cpu_time() - suite_cpu, suite_requests,
+                     suite_sent, suite_received);
+        ne_free(test_times);
+    }
+
+    close_results(count, wall_time() - suite_start);
+
+    /* write out anything buffered before closing the log. */
+    ne_debug_ring(0, 0);
+
     if (fclose(debug)) {
 	fprintf(stderr, "Error closing debug.log: %s\n", strerror(errno));
 	fails = 1;
@@ -27,6 +27,7 @@
 #endif
 
 #include <stdio.h>
+#include <sys/types.h>
 
 #define OK 0
 #define FAIL 1
@@ -83,6 +84,14 @@ extern char test_context[];
 extern char **test_argv;
 extern int test_argc;
 
+/* I/O statistics callback: if set by the test suite, it is called
+ * before and after each test to retrieve the cumulative number of
+ * requests made, and bytes sent and received; the difference is
+ * included in the machine-readable results. */
+typedef void (*test_iostats_fn)(unsigned long *requests, 
+                                off_t *sent, off_t *received);
+extern test_iostats_fn test_iostats;
+
 /* child process should call this. */
 void in_child(void);
 
@@ -93,6 +102,13 @@ void t_warning(const char *str, ...)
 #endif /* __GNUC__ */
 ;
 
+/* print an informational message, such as a benchmark result. */
+void t_info(const char *str, ...)
+#ifdef __GNUC__
+                __attribute__ ((format (printf, 1, 2)))
+#endif /* __GNUC__ */
+;
+
 /* Macros for easily writing is-not-zero comparison tests; the ON*
  * macros fail the function if a comparison is not zero.
  *